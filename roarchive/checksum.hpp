@@ -0,0 +1,115 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef roarchive_checksum_hpp_included_
+#define roarchive_checksum_hpp_included_
+
+#include <zlib.h>
+
+#include <cstdint>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/iostreams/operations.hpp>
+#include <boost/iostreams/categories.hpp>
+
+#include "dbglog/dbglog.hpp"
+
+#include "error.hpp"
+
+namespace roarchive {
+
+/** CRC-32 (zip/gzip polynomial) of given data continuing from given CRC.
+ *
+ *  Computed by zlib which uses its fastest table-driven (braided) or
+ *  carry-less multiplication implementation available. Note that SSE4.2
+ *  crc32 instruction computes different polynomial (CRC-32C) and cannot be
+ *  used for zip CRCs.
+ */
+inline std::uint32_t crc32(std::uint32_t crc, const char *data
+                           , std::size_t size)
+{
+    return ::crc32_z(crc, reinterpret_cast<const Bytef*>(data), size);
+}
+
+/** Input filter verifying CRC-32 and size of data passing through.
+ *
+ *  Checked as soon as expected number of bytes has been read (reader
+ *  knowing the size never hits EOF) or at EOF. Mismatch is reported by
+ *  throwing ChecksumError which is propagated by streams with badbit
+ *  exceptions on.
+ */
+class Crc32Verifier {
+public:
+    typedef char char_type;
+    struct category : boost::iostreams::input_filter_tag
+                    , boost::iostreams::multichar_tag {};
+
+    Crc32Verifier(const boost::filesystem::path &path, std::uint32_t crc
+                  , std::size_t size)
+        : path_(path), expected_(crc), size_(size), crc_(0), read_(0)
+        , checked_(false)
+    {}
+
+    template <typename Source>
+    std::streamsize read(Source &src, char *data, std::streamsize size) {
+        const auto got(boost::iostreams::read(src, data, size));
+        if (got > 0) {
+            crc_ = crc32(crc_, data, got);
+            read_ += got;
+            if (read_ >= size_) { check(); }
+        } else if (got < 0) {
+            check();
+        }
+        return got;
+    }
+
+private:
+    void check() {
+        if (checked_) { return; }
+        checked_ = true;
+
+        if (read_ != size_) {
+            LOGTHROW(err2, ChecksumError)
+                << "Size mismatch in " << path_ << ": expected "
+                << size_ << " bytes, got " << read_ << ".";
+        }
+        if (crc_ != expected_) {
+            LOGTHROW(err2, ChecksumError)
+                << "CRC-32 mismatch in " << path_ << ": expected "
+                << std::hex << expected_ << ", got " << crc_ << ".";
+        }
+    }
+
+    boost::filesystem::path path_;
+    std::uint32_t expected_;
+    std::size_t size_;
+    std::uint32_t crc_;
+    std::size_t read_;
+    bool checked_;
+};
+
+} // namespace roarchive
+
+#endif // roarchive_checksum_hpp_included_
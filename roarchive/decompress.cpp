@@ -0,0 +1,245 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <zlib.h>
+#ifdef ROARCHIVE_HAS_LIBDEFLATE
+#  include <libdeflate.h>
+#endif
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <new>
+#include <algorithm>
+
+#include "dbglog/dbglog.hpp"
+
+#include "decompress.hpp"
+#include "error.hpp"
+
+namespace fs = boost::filesystem;
+
+namespace roarchive {
+
+namespace {
+
+bool gzipMagic(const char *data, std::size_t size)
+{
+    return (size >= 2) && (static_cast<unsigned char>(data[0]) == 0x1f)
+        && (static_cast<unsigned char>(data[1]) == 0x8b);
+}
+
+/** Deflate cannot expand input more than 1032 times.
+ */
+std::size_t maxOutputSize(const std::vector<char> &data)
+{
+    return std::max(data.size() * 1032, std::size_t(4096));
+}
+
+/** Initial output size: gzip trailer holds size of (last) member modulo
+ *  2^32, otherwise guess. Trailer is untrusted input, therefore it is clamped
+ *  to maximum size the input can possibly decompress to.
+ */
+std::size_t outputSize(const std::vector<char> &data, Decompress method)
+{
+    const std::size_t guess(std::max(data.size() * 4, std::size_t(4096)));
+    if ((method != Decompress::gzip) || (data.size() < 18)) { return guess; }
+
+    const auto *t(reinterpret_cast<const unsigned char*>
+                  (data.data() + data.size() - 4));
+    const std::size_t isize(t[0] | (t[1] << 8) | (t[2] << 16)
+                            | (std::uint32_t(t[3]) << 24));
+    return isize ? std::min(isize, maxOutputSize(data)) : guess;
+}
+
+const char* name(Decompress method)
+{
+    switch (method) {
+    case Decompress::gzip: return "gzip";
+    case Decompress::zlib: return "zlib";
+    default: break;
+    }
+    return "deflate";
+}
+
+#ifdef ROARCHIVE_HAS_LIBDEFLATE
+
+struct DecompressorDeleter {
+    void operator()(::libdeflate_decompressor *d) const {
+        ::libdeflate_free_decompressor(d);
+    }
+};
+
+/** Per-thread decompressor, allocation is not cheap.
+ */
+::libdeflate_decompressor* decompressor()
+{
+    thread_local std::unique_ptr<::libdeflate_decompressor
+                                 , DecompressorDeleter>
+        d(::libdeflate_alloc_decompressor());
+    if (!d) { throw std::bad_alloc(); }
+    return d.get();
+}
+
+std::vector<char> inflate(const std::vector<char> &in, Decompress method
+                          , const fs::path &path)
+{
+    const auto fn((method == Decompress::gzip)
+                  ? &::libdeflate_gzip_decompress_ex
+                  : ((method == Decompress::zlib)
+                     ? &::libdeflate_zlib_decompress_ex
+                     : &::libdeflate_deflate_decompress_ex));
+    auto *d(decompressor());
+
+    std::vector<char> out;
+    std::size_t inPos(0), outPos(0);
+    auto avail(outputSize(in, method));
+    for (;;) {
+        out.resize(outPos + avail);
+        std::size_t inUsed(0), outUsed(0);
+        const auto res(fn(d, in.data() + inPos, in.size() - inPos
+                          , out.data() + outPos, avail, &inUsed, &outUsed));
+
+        if (res == LIBDEFLATE_INSUFFICIENT_SPACE) {
+            // whole member is decompressed again
+            if (avail >= maxOutputSize(in)) {
+                LOGTHROW(err2, Error)
+                    << "Invalid " << name(method) << " data in "
+                    << path << ".";
+            }
+            avail = std::min(avail * 2, maxOutputSize(in));
+            continue;
+        }
+
+        if (res != LIBDEFLATE_SUCCESS) {
+            LOGTHROW(err2, Error)
+                << "Invalid " << name(method) << " data in " << path << ".";
+        }
+
+        inPos += inUsed;
+        outPos += outUsed;
+
+        // next gzip member
+        if ((method != Decompress::gzip)
+            || !gzipMagic(in.data() + inPos, in.size() - inPos))
+        {
+            break;
+        }
+        avail = std::max(avail, outputSize(in, method));
+    }
+
+    out.resize(outPos);
+    return out;
+}
+
+#else // ROARCHIVE_HAS_LIBDEFLATE
+
+struct InflateEnd {
+    ::z_stream *z;
+    ~InflateEnd() { ::inflateEnd(z); }
+};
+
+std::vector<char> inflate(const std::vector<char> &in, Decompress method
+                          , const fs::path &path)
+{
+    ::z_stream z;
+    std::memset(&z, 0, sizeof(z));
+    const int windowBits((method == Decompress::gzip) ? 16 + MAX_WBITS
+                         : ((method == Decompress::zlib) ? MAX_WBITS
+                            : -MAX_WBITS));
+    if (::inflateInit2(&z, windowBits) != Z_OK) { throw std::bad_alloc(); }
+    InflateEnd end{ &z };
+
+    const auto chunk([](std::size_t size) -> uInt {
+            return std::min<std::size_t>
+                (size, std::numeric_limits<uInt>::max());
+        });
+
+    std::vector<char> out(outputSize(in, method));
+    std::size_t inPos(0), outPos(0);
+    for (;;) {
+        if (outPos == out.size()) { out.resize(out.size() * 2); }
+
+        z.next_in = reinterpret_cast<Bytef*>
+            (const_cast<char*>(in.data() + inPos));
+        z.avail_in = chunk(in.size() - inPos);
+        z.next_out = reinterpret_cast<Bytef*>(out.data() + outPos);
+        z.avail_out = chunk(out.size() - outPos);
+
+        const auto res(::inflate(&z, Z_NO_FLUSH));
+        inPos = reinterpret_cast<const char*>(z.next_in) - in.data();
+        outPos = reinterpret_cast<char*>(z.next_out) - out.data();
+
+        if (res == Z_STREAM_END) {
+            // next gzip member
+            if ((method != Decompress::gzip)
+                || !gzipMagic(in.data() + inPos, in.size() - inPos))
+            {
+                break;
+            }
+            ::inflateReset(&z);
+            continue;
+        }
+
+        // Z_BUF_ERROR: no progress, fine if output is full
+        if ((res == Z_OK)
+            || ((res == Z_BUF_ERROR) && (outPos == out.size())))
+        {
+            continue;
+        }
+
+        LOGTHROW(err2, Error)
+            << ((res == Z_BUF_ERROR) ? "Truncated " : "Invalid ")
+            << name(method) << " data in " << path << ".";
+    }
+
+    out.resize(outPos);
+    return out;
+}
+
+#endif // ROARCHIVE_HAS_LIBDEFLATE
+
+} // namespace
+
+std::vector<char> decompress(std::vector<char> &&data, Decompress method
+                             , const fs::path &path)
+{
+    switch (method) {
+    case Decompress::none: return std::move(data);
+
+    case Decompress::detect:
+        if (!gzipMagic(data.data(), data.size())) { return std::move(data); }
+        method = Decompress::gzip;
+        break;
+
+    default: break;
+    }
+
+    return inflate(data, method, path);
+}
+
+} // namespace roarchive
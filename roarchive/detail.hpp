@@ -27,12 +27,17 @@
 #define roarchive_detail_hpp_included_
 
 #include <vector>
+#include <utility>
+#include <algorithm>
 
 #include <boost/optional.hpp>
 
 #include "utility/filesystem.hpp"
 
 #include "roarchive.hpp"
+#include "statscollector.hpp"
+#include "memoryaccount.hpp"
+#include "observer.hpp"
 
 namespace roarchive {
 
@@ -41,6 +46,8 @@ public:
     Detail(const boost::filesystem::path &path, bool directio = false)
         : path_(path), directio_(directio)
         , stat_(utility::FileStat::from(path, std::nothrow))
+        , stats_(std::make_shared<StatsCollector>())
+        , memory_(MemoryAccount::create(path))
     {}
 
     virtual ~Detail() {}
@@ -55,6 +62,14 @@ public:
         return istream(path, {});
     }
 
+    /** Range access. Default implementation opens whole file and skips to
+     *  offset (seeks when possible, reads and discards otherwise).
+     */
+    virtual IStream::pointer
+    istream(const boost::filesystem::path &path
+            , std::size_t offset, std::size_t length
+            , const IStream::FilterInit &filterInit) const;
+
     /** Checks file existence.
      */
     virtual bool exists(const boost::filesystem::path &path) const = 0;
@@ -66,9 +81,38 @@ public:
      */
     virtual std::vector<boost::filesystem::path> list() const = 0;
 
+    /** List all files under given directory. Default implementation filters
+     *  output of list().
+     */
+    virtual Files list(const boost::filesystem::path &prefix) const;
+
+    /** Calls callback for every file. Default implementation is derived from
+     *  output of list().
+     */
+    virtual void forEach(const Entry::Callback &callback) const;
+
+    /** List content of single directory. Default implementation is derived
+     *  from output of list().
+     */
+    virtual Listing listDir(const boost::filesystem::path &dir) const;
+
     virtual void applyHint(const FileHint &hint) = 0;
 
-    bool changed() const;
+    /** Announces files that are going to be read soon. No-op by default.
+     */
+    virtual void prefetch(const Files &paths) const { (void) paths; }
+
+    virtual bool changed() const;
+
+    /** Detail that serves requests. Lazily opened archive opens the real
+     *  archive here.
+     */
+    virtual Detail& resolve() { return *this; }
+    virtual const Detail& resolve() const { return *this; }
+
+    /** False for lazily opened archive that has not been opened yet.
+     */
+    virtual bool resolved() const { return true; }
 
     bool directio() const { return directio_; }
 
@@ -78,12 +122,74 @@ public:
 
     virtual const boost::optional<boost::filesystem::path>& usedHint() = 0;
 
+    StatsCollector& stats() const { return *stats_; }
+    const StatsCollector::pointer& statsPointer() const { return stats_; }
+
+    MemoryAccount& memory() const { return *memory_; }
+    const MemoryAccount::pointer& memoryPointer() const { return memory_; }
+
+    const Observer::pointer& observer() const { return observer_; }
+    void observer(const Observer::pointer &observer) { observer_ = observer; }
+
 protected:
     boost::filesystem::path path_;
     bool directio_;
     utility::FileStat stat_;
+    StatsCollector::pointer stats_;
+    MemoryAccount::pointer memory_;
+    Observer::pointer observer_;
 };
 
+/** Traced event. Reports begin on construction and end on destruction to
+ *  observer, does nothing if there is no observer.
+ *
+ *  Successful finish is marked by done() or by passing the result through
+ *  operator().
+ */
+class TraceSpan {
+public:
+    TraceSpan(const Observer::pointer &observer, Observer::Event event
+              , const boost::filesystem::path &path)
+        : observer_(observer.get()), info_(event), done_(false)
+    {
+        if (!observer_) { return; }
+        info_.path = path;
+        start_ = Observer::Clock::now();
+        observer_->begin(info_);
+    }
+
+    ~TraceSpan() {
+        if (!observer_) { return; }
+        info_.duration = Observer::Clock::now() - start_;
+        info_.failed = !done_;
+        observer_->end(info_);
+    }
+
+    void bytes(std::size_t bytes) { info_.bytes = bytes; }
+    void done() { done_ = true; }
+
+    template <typename T> T&& operator()(T &&value) {
+        done_ = true;
+        return std::forward<T>(value);
+    }
+
+private:
+    Observer *observer_;
+    Observer::Info info_;
+    Observer::Clock::time_point start_;
+    bool done_;
+};
+
+/** Clips byte range [offset, offset + length) to file of given size.
+ *  Returns [start, end) pair.
+ */
+inline std::pair<std::size_t, std::size_t>
+clipRange(std::size_t size, std::size_t offset, std::size_t length)
+{
+    const auto start(std::min(offset, size));
+    return { start, start + std::min(length, size - start) };
+}
+
 struct HintedPath {
     boost::filesystem::path path;
     boost::optional<boost::filesystem::path> usedHint;
@@ -24,10 +24,14 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/stat.h>
+
 #include <queue>
+#include <algorithm>
 
 #include <boost/filesystem.hpp>
 #include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/restrict.hpp>
 
 #include "dbglog/dbglog.hpp"
 
@@ -50,35 +54,67 @@ public:
                 , const fs::path &index)
         : IStream(filterInit), path_(path), index_(index)
     {
-        try {
-            auto source(bio::file_source(path.string()));
-            if (!source.is_open()) {
-                // TODO: really? distinguish
-                // should we use open(2)?
-                LOGTHROW(err2, NoSuchFile)
-                    << "Cannot open file file " << path << ".";
-            }
+        fis_.push(open());
+    }
 
-            fis_.push(std::move(source));
-        } catch (const std::ios_base::failure &e) {
-            LOGTHROW(err2, Error)
-                << "Cannot open file file " << path << ": " << e.what() << ".";
-        }
+    /** Range of file: restricted file device.
+     */
+    FileIStream(const fs::path &path, const IStream::FilterInit &filterInit
+                , const fs::path &index
+                , std::size_t offset, std::size_t length)
+        : IStream(filterInit), path_(path), index_(index)
+    {
+        auto source(open());
+        range_ = clipRange(fs::file_size(path), offset, length);
+        update(range_->second - range_->first);
+        fis_.push(bio::restrict(std::move(source), range_->first
+                                , range_->second - range_->first));
     }
 
     virtual fs::path path() const { return path_; }
     virtual fs::path index() const { return index_; }
     virtual void close() {}
 
+protected:
+    virtual boost::optional<FileRange> range() const {
+        if (range_) {
+            return FileRange(-1, path_, range_->first, range_->second);
+        }
+        return FileRange(-1, path_, 0, fs::file_size(path_));
+    }
+
 private:
+    bio::file_source open() const {
+        boost::optional<bio::file_source> source;
+        try {
+            source = bio::file_source(path_.string());
+        } catch (const std::ios_base::failure &e) {
+            LOGTHROW(err2, Error)
+                << "Cannot open file file " << path_ << ": " << e.what()
+                << ".";
+        }
+
+        if (!source->is_open()) {
+            // TODO: really? distinguish
+            // should we use open(2)?
+            LOGTHROW(err2, NoSuchFile)
+                << "Cannot open file file " << path_ << ".";
+        }
+        return *source;
+    }
+
     const fs::path path_;
     const fs::path index_;
+    boost::optional<std::pair<std::size_t, std::size_t> > range_;
 };
 
-HintedPath applyHintToPath(const fs::path &path, const FileHint &hint)
+HintedPath applyHintToPath(const fs::path &path, const FileHint &hint
+                           , const Observer::pointer &observer)
 {
     if (!hint) { return path; }
 
+    TraceSpan span(observer, Observer::Event::hintResolution, path);
+
     auto hintPath([&]() -> boost::optional<HintedPath>
     {
         // we need breadth-first search to find hint as close to root as
@@ -116,12 +152,13 @@ HintedPath applyHintToPath(const fs::path &path, const FileHint &hint)
     }
 
     // use hint
-    return *hintPath;
+    return span(*hintPath);
 }
 
 struct DirectoryBase {
-    DirectoryBase(const fs::path &path, const FileHint &hint)
-        : hintedPath_(applyHintToPath(path, hint))
+    DirectoryBase(const fs::path &path, const OpenOptions &openOptions)
+        : hintedPath_(applyHintToPath(path, openOptions.hint
+                                      , openOptions.observer))
     {}
 
     HintedPath hintedPath_;
@@ -132,8 +169,8 @@ class Directory
     , public RoArchive::Detail
 {
 public:
-    Directory(const fs::path &path, const FileHint &hint)
-        : DirectoryBase(path, hint)
+    Directory(const fs::path &path, const OpenOptions &openOptions)
+        : DirectoryBase(path, openOptions)
         , Detail(hintedPath_.path, true)
         , originalPath_(path)
     {}
@@ -151,6 +188,16 @@ public:
         return std::make_unique<FileIStream>(path_ / path, filterInit, path);
     }
 
+    virtual IStream::pointer istream(const fs::path &path
+                                     , std::size_t offset, std::size_t length
+                                     , const IStream::FilterInit &filterInit)
+        const
+    {
+        return std::make_unique<FileIStream>
+            ((path.is_absolute() ? path : path_ / path), filterInit, path
+             , offset, length);
+    }
+
     virtual bool exists(const fs::path &path) const {
         if (path.is_absolute()) {
             return fs::exists(path);
@@ -166,6 +213,54 @@ public:
         return list;
     }
 
+    virtual Files list(const fs::path &prefix) const {
+        Files list;
+        const auto root(path_ / prefix);
+        if (!fs::is_directory(root)) { return list; }
+        for (fs::recursive_directory_iterator i(root), e; i != e; ++i) {
+            list.push_back(utility::cutPathPrefix(i->path(), path_));
+        }
+        return list;
+    }
+
+    /** Walks the directory and reports files as they are found.
+     */
+    virtual void forEach(const Entry::Callback &callback) const {
+        Entry entry;
+        struct ::stat st;
+        for (fs::recursive_directory_iterator i(path_), e; i != e; ++i) {
+            // single stat provides both size and timestamp
+            if (::stat(i->path().c_str(), &st) == -1) {
+                entry.size = boost::none;
+                entry.timestamp = -1;
+            } else {
+                if (S_ISDIR(st.st_mode)) { continue; }
+                entry.size = S_ISREG(st.st_mode)
+                    ? boost::optional<std::size_t>(st.st_size) : boost::none;
+                entry.timestamp = st.st_mtime;
+            }
+
+            entry.path = utility::cutPathPrefix(i->path(), path_);
+            callback(entry);
+        }
+    }
+
+    virtual Listing listDir(const fs::path &dir) const {
+        Listing listing;
+        const auto root(path_ / dir);
+        if (!fs::is_directory(root)) { return listing; }
+        for (fs::directory_iterator i(root), e; i != e; ++i) {
+            if (fs::is_directory(i->status())) {
+                listing.directories.push_back(i->path().filename());
+            } else {
+                listing.files.push_back(i->path().filename());
+            }
+        }
+        std::sort(listing.files.begin(), listing.files.end());
+        std::sort(listing.directories.begin(), listing.directories.end());
+        return listing;
+    }
+
     virtual boost::optional<fs::path> findFile(const std::string &filename)
         const
     {
@@ -176,7 +271,7 @@ public:
     }
 
     virtual void applyHint(const FileHint &hint) {
-        hintedPath_ = applyHintToPath(originalPath_, hint);
+        hintedPath_ = applyHintToPath(originalPath_, hint, observer_);
         path_ = hintedPath_.path;
     }
 
@@ -194,7 +289,7 @@ RoArchive::dpointer
 RoArchive::directory(const fs::path &path, const OpenOptions &openOptions)
 {
     // do not apply any limit
-    return std::make_shared<Directory>(path, openOptions.hint);
+    return std::make_shared<Directory>(path, openOptions);
 }
 
 } // namespace roarchive
@@ -58,6 +58,12 @@ struct IOError : Error {
     IOError(const std::string &msg) : Error(msg) {}
 };
 
+/** Data do not match recorded checksum (see OpenOptions::verify).
+ */
+struct ChecksumError : Error {
+    ChecksumError(const std::string &msg) : Error(msg) {}
+};
+
 } // namespace roarchive
 
 #endif // roarchive_error_hpp_included_
@@ -25,20 +25,33 @@
  */
 
 #include <queue>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <sstream>
 
 #include <boost/filesystem.hpp>
 #include <boost/iostreams/device/array.hpp>
+#include <boost/numeric/conversion/cast.hpp>
 
 #include "dbglog/dbglog.hpp"
 
 #include "utility/cppversion.hpp"
 #include "utility/uri.hpp"
+#include "utility/path.hpp"
 
 #include "http/ondemandclient.hpp"
 #include "http/error.hpp"
 
 #include "detail.hpp"
 #include "io.hpp"
+#include "httpcache.hpp"
+#include "pathindex.hpp"
 
 namespace fs = boost::filesystem;
 namespace bio = boost::iostreams;
@@ -49,42 +62,118 @@ namespace {
 
 http::OnDemandClient client(4);
 
-class HttpIStream : public IStream {
-public:
-    HttpIStream(const fs::path &path, const IStream::FilterInit &filterInit
-                , const fs::path &index)
-        : IStream(filterInit), path_(path), index_(index)
-    {
-        // TODO: make more robust
-        const auto &fetcher(client.fetcher());
+typedef utility::ResourceFetcher::Query::Body Body;
+typedef std::shared_ptr<const Body> SharedBody;
 
-        auto q(fetcher.perform
-               (utility::ResourceFetcher::Query(path.string())));
+/** Fetches resource at given URI. Returns null body if resource doesn't
+ *  exist, throws on any other error.
+ */
+SharedBody download(const std::string &uri)
+{
+    // TODO: make more robust
+    const auto &fetcher(client.fetcher());
 
-        if (q.ec()) {
-            if (q.check(make_error_code(utility::HttpCode::NotFound))) {
-                LOGTHROW(err2, NoSuchFile)
-                    << "File at URL <" << path << "> doesn't exist.";
-            }
+    auto q(fetcher.perform(utility::ResourceFetcher::Query(uri)));
+
+    if (q.ec()) {
+        if (q.check(make_error_code(utility::HttpCode::NotFound))) {
+            return {};
+        }
 
-            LOGTHROW(err1, IOError)
-                << "Failed to download tile data from <"
-                << path << ">: Unexpected HTTP status code: <"
-                << q.ec() << ">.";
+        LOGTHROW(err1, IOError)
+            << "Failed to download tile data from <"
+            << uri << ">: Unexpected HTTP status code: <"
+            << q.ec() << ">.";
+    }
+
+    try {
+        return std::make_shared<Body>(q.moveOut());
+    } catch (const http::Error &e) {
+        LOGTHROW(err1, IOError)
+            << "Failed to download tile data from <"
+            << uri << ">: Unexpected error code <"
+            << e.what() << ">.";
+    }
+    return {};
+}
+
+/** Request coalescing: concurrent fetches of the same URI are merged into
+ *  single request, all requesters share the resulting body.
+ */
+class InFlight {
+public:
+    template <typename Fetch>
+    SharedBody fetch(const std::string &uri, const Fetch &fetch) {
+        std::promise<SharedBody> promise;
+        std::shared_future<SharedBody> future;
+        bool owner(false);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto fmap(map_.find(uri));
+            if (fmap != map_.end()) {
+                // someone else is already fetching this URI, wait for it
+                future = fmap->second;
+            } else {
+                future = promise.get_future().share();
+                map_.insert(map::value_type(uri, future));
+                owner = true;
+            }
         }
 
+        if (!owner) { return future.get(); }
+
+        // we are the one to fetch the data
         try {
-            body_ = std::move(q.moveOut());
-            const auto &data(body_.data);
-            auto source(bio::array_source
-                        (data.data(), data.data() + data.size()));
-            fis_.push(std::move(source));
-        } catch (const http::Error &e) {
-            LOGTHROW(err1, IOError)
-                << "Failed to download tile data from <"
-                << path << ">: Unexpected error code <"
-                << e.what() << ">.";
+            promise.set_value(fetch());
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            map_.erase(uri);
         }
+
+        return future.get();
+    }
+
+private:
+    typedef std::map<std::string, std::shared_future<SharedBody>> map;
+    std::mutex mutex_;
+    map map_;
+};
+
+InFlight inFlight;
+
+class HttpIStream : public IStream {
+public:
+    HttpIStream(const fs::path &path, const SharedBody &body
+                , const IStream::FilterInit &filterInit
+                , const fs::path &index
+                , const MemoryAccount::pointer &memory)
+        : IStream(filterInit, body->data.size())
+        , path_(path), index_(index), body_(body)
+        , charge_(memory, MemoryCategory::httpBodies, body->data.size())
+    {
+        const auto &data(body_->data);
+        fis_.push(bio::array_source(data.data(), data.data() + data.size()));
+    }
+
+    /** Range of file: slice of the whole body.
+     */
+    HttpIStream(const fs::path &path, const SharedBody &body
+                , std::size_t offset, std::size_t length
+                , const IStream::FilterInit &filterInit
+                , const fs::path &index
+                , const MemoryAccount::pointer &memory)
+        : IStream(filterInit), path_(path), index_(index), body_(body)
+        , charge_(memory, MemoryCategory::httpBodies, body->data.size())
+    {
+        const auto &data(body_->data);
+        const auto range(clipRange(data.size(), offset, length));
+        update(range.second - range.first);
+        fis_.push(bio::array_source(data.data() + range.first
+                                    , data.data() + range.second));
     }
 
     virtual fs::path path() const { return path_; }
@@ -94,9 +183,396 @@ public:
 private:
     const fs::path path_;
     const fs::path index_;
-    utility::ResourceFetcher::Query::Body body_;
+    SharedBody body_;
+
+    /** Whole body is held by the stream.
+     */
+    MemoryCharge charge_;
+};
+
+/** Cache of exists() answers.
+ *
+ *  Both positive and negative answers are remembered for given TTL. Expired
+ *  records are dropped lazily: on lookup and, oldest first, on insertion.
+ *  Records are charged to the archive's cache memory and the oldest ones are
+ *  evicted when the process is over memory budget.
+ */
+class ExistsCache {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    ExistsCache(std::time_t ttl, MemoryAccount &memory)
+        : ttl_(ttl), memory_(memory), size_()
+    {}
+
+    ~ExistsCache() { memory_.charge(MemoryCategory::cache, -size_); }
+
+    /** Cache is disabled when TTL is zero.
+     */
+    operator bool() const { return ttl_.count() > 0; }
+
+    /** Returns valid answer for given URI, if any.
+     */
+    boost::optional<bool> get(const std::string &uri) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto fmap(map_.find(uri));
+        if (fmap == map_.end()) { return boost::none; }
+
+        if (fmap->second.expires <= Clock::now()) {
+            erase(fmap);
+            return boost::none;
+        }
+        return fmap->second.exists;
+    }
+
+    void put(const std::string &uri, bool exists) {
+        const auto now(Clock::now());
+        const auto expires(now + ttl_);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            // drop expired records; TTL is constant, i.e. queue is ordered by
+            // expiration
+            while (!queue_.empty() && (queue_.front().first <= now)) {
+                auto fmap(map_.find(queue_.front().second));
+                if ((fmap != map_.end()) && (fmap->second.expires <= now)) {
+                    erase(fmap);
+                }
+                pop();
+            }
+
+            auto fmap(map_.find(uri));
+            if (fmap == map_.end()) {
+                fmap = map_.insert(std::make_pair(uri, Record())).first;
+                charge(recordSize(uri));
+            }
+            fmap->second.exists = exists;
+            fmap->second.expires = expires;
+            queue_.emplace_back(expires, uri);
+            charge(queueSize(uri));
+        }
+        enforceMemoryBudget();
+    }
+
+    /** Drops oldest records. Returns number of bytes released.
+     */
+    std::size_t evict(std::size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto size(size_);
+        while (((size - size_) < std::int64_t(bytes)) && !queue_.empty()) {
+            auto fmap(map_.find(queue_.front().second));
+            if (fmap != map_.end()) { erase(fmap); }
+            pop();
+        }
+        return size - size_;
+    }
+
+private:
+    struct Record {
+        bool exists;
+        Clock::time_point expires;
+    };
+
+    typedef std::map<std::string, Record> Map;
+
+    /** Approximate heap usage of map record and queue item.
+     */
+    static std::int64_t recordSize(const std::string &uri) {
+        return sizeof(Map::value_type) + 4 * sizeof(void*) + uri.size();
+    }
+
+    static std::int64_t queueSize(const std::string &uri) {
+        return sizeof(Clock::time_point) + sizeof(std::string) + uri.size();
+    }
+
+    void charge(std::int64_t bytes) {
+        size_ += bytes;
+        memory_.charge(MemoryCategory::cache, bytes);
+    }
+
+    void erase(Map::iterator fmap) {
+        charge(-recordSize(fmap->first));
+        map_.erase(fmap);
+    }
+
+    void pop() {
+        charge(-queueSize(queue_.front().second));
+        queue_.pop_front();
+    }
+
+    const std::chrono::seconds ttl_;
+    MemoryAccount &memory_;
+    std::mutex mutex_;
+    Map map_;
+    std::deque<std::pair<Clock::time_point, std::string>> queue_;
+    std::int64_t size_;
+};
+
+/** Background prefetcher.
+ *
+ *  Queued resources are fetched by a pool of worker threads (started on first
+ *  use) and kept in bounded in-memory buffer until taken over by istream().
+ *  Oldest buffered resources are dropped when the buffer is full or when
+ *  evicted due to memory budget.
+ *
+ *  The buffer also keeps bodies fetched by exists() probes.
+ */
+class Prefetcher {
+public:
+    typedef std::function<SharedBody(const std::string&)> Fetch;
+
+    Prefetcher(const Fetch &fetch, std::size_t threads, std::size_t limit
+               , MemoryAccount &memory)
+        : fetch_(fetch), threads_(threads), limit_(limit), memory_(memory)
+        , size_(), running_(true)
+    {}
+
+    ~Prefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_ = false;
+        }
+        cond_.notify_all();
+        for (auto &worker : workers_) { worker.join(); }
+    }
+
+    operator bool() const { return threads_ && limit_; }
+
+    /** Schedules resource for background fetch.
+     */
+    void prefetch(const std::string &uri) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (buffer_.count(uri) || !pending_.insert(uri).second) {
+                // already buffered or on its way
+                return;
+            }
+            queue_.push_back(uri);
+
+            if (workers_.empty()) {
+                for (std::size_t i(0); i < threads_; ++i) {
+                    workers_.emplace_back(&Prefetcher::worker, this);
+                }
+            }
+        }
+        cond_.notify_one();
+    }
+
+    /** Keeps already fetched resource in the buffer (if it fits).
+     */
+    void keep(const std::string &uri, const SharedBody &body) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!store(uri, body)) { return; }
+        }
+        enforceMemoryBudget();
+    }
+
+    /** Takes prefetched resource from the buffer, if there.
+     */
+    SharedBody take(const std::string &uri) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto fbuffer(buffer_.find(uri));
+        if (fbuffer == buffer_.end()) { return {}; }
+
+        auto body(std::move(fbuffer->second));
+        buffer_.erase(fbuffer);
+        release(body->data.size());
+        return body;
+    }
+
+    /** Drops oldest buffered resources. Returns number of bytes released.
+     */
+    std::size_t evict(std::size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto size(size_);
+        dropOldest([&]() { return (size - size_) < bytes; });
+        return size - size_;
+    }
+
+private:
+    void worker() {
+        for (;;) {
+            std::string uri;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait(lock, [this]() {
+                        return !running_ || !queue_.empty();
+                    });
+                if (!running_) { return; }
+                uri = std::move(queue_.front());
+                queue_.pop_front();
+            }
+
+            SharedBody body;
+            try {
+                body = fetch_(uri);
+            } catch (const std::exception &e) {
+                // ignore, reported when the resource is actually read
+                LOG(debug) << "Failed to prefetch <" << uri << ">: "
+                           << e.what() << ".";
+            }
+
+            bool stored(false);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                pending_.erase(uri);
+                // exists() probe may have parked the body meanwhile
+                if (body) { stored = store(uri, body); }
+            }
+            if (stored) { enforceMemoryBudget(); }
+        }
+    }
+
+    /** Stores resource in the buffer unless it is already there or does not
+     *  fit. Returns true if stored. Must be called under lock.
+     */
+    bool store(const std::string &uri, const SharedBody &body) {
+        const auto size(body->data.size());
+        if ((size > limit_) || buffer_.count(uri)) { return false; }
+
+        buffer_[uri] = body;
+        order_.push_back(uri);
+        size_ += size;
+        memory_.charge(MemoryCategory::cache, size);
+
+        dropOldest([this]() { return size_ > limit_; });
+
+        // keep order in sync with buffer
+        if (order_.size() > 2 * buffer_.size()) {
+            std::deque<std::string> order;
+            for (const auto &item : order_) {
+                if (buffer_.count(item)) { order.push_back(item); }
+            }
+            order_.swap(order);
+        }
+        return true;
+    }
+
+    /** Drops oldest resources while condition holds. Must be called under
+     *  lock.
+     */
+    template <typename Condition> void dropOldest(const Condition &condition)
+    {
+        while (condition() && !order_.empty()) {
+            auto fbuffer(buffer_.find(order_.front()));
+            order_.pop_front();
+            // skip already taken resources
+            if (fbuffer == buffer_.end()) { continue; }
+            release(fbuffer->second->data.size());
+            buffer_.erase(fbuffer);
+        }
+    }
+
+    void release(std::size_t size) {
+        size_ -= size;
+        memory_.charge(MemoryCategory::cache, -std::int64_t(size));
+    }
+
+    const Fetch fetch_;
+    const std::size_t threads_;
+    const std::size_t limit_;
+    MemoryAccount &memory_;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::string> queue_;
+    std::set<std::string> pending_;
+    std::map<std::string, SharedBody> buffer_;
+    std::deque<std::string> order_;
+    std::size_t size_;
+    bool running_;
+    std::vector<std::thread> workers_;
+};
+
+/** Archive manifest: list of all files available under archive root URL.
+ *
+ *  One file per line: path [TAB size [TAB hash]]. Paths are relative to
+ *  archive root. Empty lines and lines starting with # are ignored.
+ */
+class Manifest {
+public:
+    struct Entry {
+        boost::optional<std::size_t> size;
+        std::string hash;
+    };
+
+    typedef PathMap<Entry> Files;
+
+    Manifest(const std::string &uri, const Body &body);
+
+    bool exists(const std::string &path) const {
+        return files_.find(path);
+    }
+
+    const Entry* find(const std::string &path) const {
+        return files_.find(path);
+    }
+
+    /** Find hinted prefix, see roarchive::findPrefix().
+     */
+    HintedPath findPrefix(const FileHint &hint
+                          , const Observer::pointer &observer) const;
+
+    const Files& files() const { return files_; }
+
+private:
+    const std::string uri_;
+    Files files_;
 };
 
+Manifest::Manifest(const std::string &uri, const Body &body)
+    : uri_(uri)
+{
+    Files::Builder builder;
+    std::istringstream is(std::string(body.data.data(), body.data.size()));
+    std::string line;
+    while (std::getline(is, line)) {
+        if (line.empty() || (line[0] == '#')) { continue; }
+
+        std::istringstream ls(line);
+        std::string path;
+        std::getline(ls, path, '\t');
+        if (path.empty()) { continue; }
+
+        Entry entry;
+        std::string size;
+        if (std::getline(ls, size, '\t') && !size.empty()) {
+            try {
+                entry.size = boost::numeric_cast<std::size_t>
+                    (std::stoull(size));
+            } catch (const std::exception&) {
+                LOGTHROW(err2, Error)
+                    << "Invalid size <" << size << "> of file <" << path
+                    << "> in manifest <" << uri_ << ">.";
+            }
+        }
+        std::getline(ls, entry.hash, '\t');
+
+        builder.add(path, entry);
+    }
+    files_ = builder.build();
+
+    LOG(info1) << "Loaded " << files_.size() << " files from manifest <"
+               << uri_ << ">.";
+}
+
+HintedPath Manifest::findPrefix(const FileHint &hint
+                                , const Observer::pointer &observer) const
+{
+    return roarchive::findPrefix(uri_, hint, files_.index(), observer
+                                 , "HTTP archive manifest");
+}
+
+/** Archive root: directory-style URL (i.e. ending with slash) or parent of
+ *  given file URL.
+ */
+std::string rootUrl(const fs::path &path)
+{
+    if (path.filename() == ".") { return path.string(); }
+    return path.parent_path().string() + "/";
+}
+
 HintedPath applyHintToPath(const fs::path &path, const FileHint &hint)
 {
     if (!hint) { return path; }
@@ -107,18 +583,99 @@ HintedPath applyHintToPath(const fs::path &path, const FileHint &hint)
         return HintedPath(ppath, path.filename());
     }
 
-    // TODO: path ends with slash -> get hints and check files under remote path
-    // (URI)
+    // path ends with slash: without manifest we have no way to check files
+    // under remote path (URI)
 
     return path;
 }
 
 struct HttpBase {
-    HttpBase(const fs::path &path, const FileHint &hint)
-        : hintedPath_(applyHintToPath(path, hint))
-    {}
+    HttpBase(const fs::path &path, const OpenOptions &openOptions)
+        : root_(rootUrl(path)), cacheStats_()
+    {
+        if (!openOptions.httpCacheDir.empty()) {
+            diskCache_ = HttpDiskCache::get(openOptions.httpCacheDir
+                                            , openOptions.httpCacheSize
+                                            , openOptions.httpCacheMaxAge);
+        }
+
+        if (!openOptions.httpManifest.empty()) {
+            const auto uri(str(utility::Uri(root_).resolve
+                               (utility::Uri
+                                (openOptions.httpManifest.string()))));
+            TraceSpan span(openOptions.observer, Observer::Event::indexBuild
+                           , uri);
+            const auto body(fetch(uri));
+            if (!body) {
+                LOGTHROW(err2, NoSuchFile)
+                    << "Manifest <" << uri << "> doesn't exist.";
+            }
+            manifest_ = std::make_shared<Manifest>(uri, *body);
+            span.done();
+        }
+
+        hintedPath_ = applyHint(path, openOptions.hint, openOptions.observer);
+    }
+
+    /** Fetches resource, goes through disk cache if configured. Concurrent
+     *  fetches of the same resource are coalesced.
+     */
+    SharedBody fetch(const std::string &uri) const {
+        return inFlight.fetch(uri, [&]() -> SharedBody
+        {
+            if (diskCache_) {
+                if (auto body = diskCache_->fetch(uri)) {
+                    cacheHit(true);
+                    return body;
+                }
+            }
+
+            cacheHit(false);
+            auto body(download(uri));
+            if (body && diskCache_) { diskCache_->store(uri, *body); }
+            return body;
+        });
+    }
+
+    void cacheHit(bool hit) const {
+        if (!cacheStats_) { return; }
+        if (hit) {
+            cacheStats_->cacheHit();
+        } else {
+            cacheStats_->cacheMiss();
+        }
+    }
+
+    /** Applies hint. Directory-style URL is resolved via manifest, if
+     *  available.
+     */
+    HintedPath applyHint(const fs::path &path, const FileHint &hint
+                         , const Observer::pointer &observer)
+    {
+        prefix_.clear();
+        if (!hint || !manifest_ || (path.filename() != ".")) {
+            return applyHintToPath(path, hint);
+        }
+
+        const auto prefix(manifest_->findPrefix(hint, observer));
+        prefix_ = prefix.path;
+        if (prefix_.empty()) { return HintedPath(root_, prefix.usedHint); }
+        return HintedPath(root_ + prefix_.string() + "/", prefix.usedHint);
+    }
+
+    const std::string root_;
+    HttpDiskCache::pointer diskCache_;
+    std::shared_ptr<const Manifest> manifest_;
+
+    /** Hinted path prefix inside manifest.
+     */
+    fs::path prefix_;
 
     HintedPath hintedPath_;
+
+    /** Archive's statistics collector, available once fully constructed.
+     */
+    StatsCollector *cacheStats_;
 };
 
 class Http
@@ -126,12 +683,40 @@ class Http
     , public RoArchive::Detail
 {
 public:
-    Http(const fs::path &path, const FileHint &hint)
-        : HttpBase(path, hint)
+    Http(const fs::path &path, const OpenOptions &openOptions)
+        : HttpBase(path, openOptions)
         , Detail(hintedPath_.path, false)
         , originalPath_(path)
         , base_(path_.string())
-    {}
+        , existsCache_(openOptions.httpExistsTtl, memory())
+        , prefetchDepth_(openOptions.httpPrefetchDepth)
+        , prefetcher_([this](const std::string &uri) { return fetch(uri); }
+                      , openOptions.httpPrefetchThreads
+                      , openOptions.httpPrefetchSize, memory())
+    {
+        cacheStats_ = &stats();
+
+        if (manifest_) { memory().chargeIndex(manifest_->files()); }
+        memory().evictor([this](std::size_t bytes) -> std::size_t
+        {
+            // prefetched bodies go first, they are bigger and cheaper to
+            // lose than exists() answers
+            auto released(prefetcher_.evict(bytes));
+            if (released < bytes) {
+                released += existsCache_.evict(bytes - released);
+            }
+            return released;
+        });
+
+        if (!openOptions.httpPrefetchList.empty()) {
+            loadAccessList(openOptions.httpPrefetchList);
+        }
+    }
+
+    virtual ~Http() {
+        // caches are going away, wait for any running eviction
+        memory().evictor({});
+    }
 
     /** Get (wrapped) input stream for given file.
      *  Throws when not found.
@@ -140,35 +725,129 @@ public:
                                      , const IStream::FilterInit &filterInit)
         const
     {
-        utility::Uri uri(path.string());
-        if (uri.absolute()) {
-            return std::make_unique<HttpIStream>(path, filterInit, path);
-        }
+        const auto uri(resolve(path));
+        const auto body(get(path, uri));
+        return std::make_unique<HttpIStream>(uri, body, filterInit, path
+                                             , memoryPointer());
+    }
+
+    /** Range of file. Served from whole (cached) body since the fetcher has
+     *  no support for range requests.
+     */
+    virtual IStream::pointer istream(const fs::path &path
+                                     , std::size_t offset, std::size_t length
+                                     , const IStream::FilterInit &filterInit)
+        const
+    {
+        const auto uri(resolve(path));
+        const auto body(get(path, uri));
         return std::make_unique<HttpIStream>
-            (str(base_.resolve(utility::Uri(uri))), filterInit, path);
+            (uri, body, offset, length, filterInit, path, memoryPointer());
+    }
+
+    /** Fetches given files in the background.
+     */
+    virtual void prefetch(const Files &paths) const {
+        if (!prefetcher_) { return; }
+        for (const auto &path : paths) { prefetcher_.prefetch(resolve(path)); }
     }
 
+    /** Checks file existence. Answered from manifest if available, otherwise
+     *  by fetching the file: the fetcher has no HEAD support. Fetched body is
+     *  kept in the (bounded) prefetch buffer and reused by following
+     *  istream() call, i.e. probe-then-read costs a single request.
+     */
     virtual bool exists(const fs::path &path) const {
-        (void) path;
-        return true;
+        if (const auto mpath = manifestPath(path)) {
+            return manifest_->exists(*mpath);
+        }
+
+        const auto uri(resolve(path));
+
+        if (existsCache_) {
+            if (const auto exists = existsCache_.get(uri)) {
+                cacheHit(true);
+                return *exists;
+            }
+        }
+
+        const auto body(fetch(uri));
+        if (existsCache_) { existsCache_.put(uri, bool(body)); }
+        if (body) { prefetcher_.keep(uri, body); }
+        return bool(body);
     }
 
     virtual Files list() const {
-        LOGTHROW(err2, NotImplemented)
-            << "HTTP list not implemented.";
-        throw;
+        if (!manifest_) {
+            LOGTHROW(err2, NotImplemented)
+                << "HTTP list not implemented without manifest.";
+        }
+
+        return list(fs::path());
+    }
+
+    virtual Files list(const fs::path &prefix) const {
+        if (!manifest_) {
+            LOGTHROW(err2, NotImplemented)
+                << "HTTP list not implemented without manifest.";
+        }
+
+        const auto &index(manifest_->files().index());
+        const auto base(manifestBase());
+        if (base == PathIndex::none) { return {}; }
+        const auto dir(index.findDir(prefix.string(), base));
+        if (dir == PathIndex::none) { return {}; }
+        return index.list(dir, base);
     }
 
-    virtual boost::optional<fs::path> findFile(const std::string&)
+    virtual void forEach(const Entry::Callback &callback) const {
+        if (!manifest_) {
+            LOGTHROW(err2, NotImplemented)
+                << "HTTP list not implemented without manifest.";
+        }
+
+        const auto &files(manifest_->files());
+        const auto base(manifestBase());
+        if (base == PathIndex::none) { return; }
+
+        Entry entry;
+        files.index().forEach(base, [&](PathIndex::Id id)
+        {
+            entry.path = files.index().path(id, base);
+            entry.size = files.value(id).size;
+            callback(entry);
+        });
+    }
+
+    virtual Listing listDir(const fs::path &path) const {
+        if (!manifest_) {
+            LOGTHROW(err2, NotImplemented)
+                << "HTTP list not implemented without manifest.";
+        }
+
+        const auto &index(manifest_->files().index());
+        const auto base(manifestBase());
+        if (base == PathIndex::none) { return {}; }
+        const auto dir(index.findDir(path.string(), base));
+        if (dir == PathIndex::none) { return {}; }
+        return index.listDir(dir);
+    }
+
+    virtual boost::optional<fs::path> findFile(const std::string &filename)
         const
     {
-        LOGTHROW(err2, NotImplemented)
-            << "HTTP find not implemented.";;
-        throw;
+        if (!manifest_) {
+            LOGTHROW(err2, NotImplemented)
+                << "HTTP find not implemented without manifest.";
+        }
+
+        const auto base(manifestBase());
+        if (base == PathIndex::none) { return boost::none; }
+        return manifest_->files().index().findFile(filename, base);
     }
 
     virtual void applyHint(const FileHint &hint) {
-        hintedPath_ = applyHintToPath(originalPath_, hint);
+        hintedPath_ = HttpBase::applyHint(originalPath_, hint, observer_);
         path_ = hintedPath_.path;
         base_ = utility::Uri(path_.string());
     }
@@ -182,8 +861,111 @@ public:
     }
 
 private:
+    std::string resolve(const fs::path &path) const {
+        utility::Uri uri(path.string());
+        if (uri.absolute()) { return path.string(); }
+        return str(base_.resolve(uri));
+    }
+
+    /** Gets whole body of file at given path: from prefetch buffer or
+     *  fetched. Throws when not found (also when known from exists() cache).
+     */
+    SharedBody get(const fs::path &path, const std::string &uri) const {
+        if (const auto mpath = manifestPath(path)) {
+            if (!manifest_->exists(*mpath)) { noSuchFile(uri); }
+        }
+
+        if (existsCache_) {
+            const auto exists(existsCache_.get(uri));
+            if (exists && !*exists) {
+                cacheHit(true);
+                noSuchFile(uri);
+            }
+        }
+
+        auto body(prefetcher_.take(uri));
+        if (body) { cacheHit(true); }
+
+        if (!body) {
+            body = fetch(uri);
+            if (existsCache_) { existsCache_.put(uri, bool(body)); }
+            if (!body) { noSuchFile(uri); }
+        }
+
+        prefetchFollowing(path);
+
+        return body;
+    }
+
+    /** Returns path inside manifest if given path can be answered from
+     *  manifest.
+     */
+    boost::optional<std::string> manifestPath(const fs::path &path) const {
+        if (!manifest_ || utility::Uri(path.string()).absolute()) {
+            return boost::none;
+        }
+        return (prefix_ / path).string();
+    }
+
+    /** Manifest directory corresponding to archive root.
+     */
+    PathIndex::Id manifestBase() const {
+        return manifest_->files().index().findDir(prefix_.string());
+    }
+
+    /** Loads list of files in expected access order.
+     */
+    void loadAccessList(const fs::path &path) {
+        const auto body(fetch(resolve(path)));
+        if (!body) {
+            LOG(warn2) << "No prefetch list found at <" << resolve(path)
+                       << ">; ignored.";
+            return;
+        }
+
+        std::istringstream is(std::string(body->data.data()
+                                          , body->data.size()));
+        std::string line;
+        while (std::getline(is, line)) {
+            if (line.empty() || (line[0] == '#')) { continue; }
+            accessIndex_.insert(AccessIndex::value_type
+                                (line, accessList_.size()));
+            accessList_.push_back(line);
+        }
+    }
+
+    /** Prefetches files expected to be read after given file according to
+     *  the access list.
+     */
+    void prefetchFollowing(const fs::path &path) const {
+        if (!prefetcher_ || accessList_.empty()) { return; }
+
+        auto findex(accessIndex_.find(path.string()));
+        if (findex == accessIndex_.end()) { return; }
+
+        const auto end(std::min(findex->second + 1 + prefetchDepth_
+                                , accessList_.size()));
+        for (auto i(findex->second + 1); i < end; ++i) {
+            prefetcher_.prefetch(resolve(accessList_[i]));
+        }
+    }
+
+    void noSuchFile(const std::string &uri) const {
+        LOGTHROW(err2, NoSuchFile)
+            << "File at URL <" << uri << "> doesn't exist.";
+    }
+
     const fs::path originalPath_;
     utility::Uri base_;
+    mutable ExistsCache existsCache_;
+
+    typedef std::map<std::string, std::size_t> AccessIndex;
+    std::vector<std::string> accessList_;
+    AccessIndex accessIndex_;
+    const std::size_t prefetchDepth_;
+
+    // must be last: workers use all other members
+    mutable Prefetcher prefetcher_;
 };
 
 } // namespace
@@ -192,7 +974,7 @@ RoArchive::dpointer
 RoArchive::http(const fs::path &path, const OpenOptions &openOptions)
 {
     // do not apply any limit
-    return std::make_shared<Http>(path, openOptions.hint);
+    return std::make_shared<Http>(path, openOptions);
 }
 
 } // namespace roarchive
@@ -0,0 +1,331 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+
+#include "dbglog/dbglog.hpp"
+
+#include "httpcache.hpp"
+
+namespace fs = boost::filesystem;
+
+namespace roarchive {
+
+namespace {
+
+/** Stable (FNV-1a) hash of URI used as a cache key.
+ */
+std::string makeKey(const std::string &uri)
+{
+    std::uint64_t hash(0xcbf29ce484222325ull);
+    for (unsigned char c : uri) {
+        hash ^= c;
+        hash *= 0x100000001b3ull;
+    }
+
+    std::ostringstream os;
+    os << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return os.str();
+}
+
+/** Writes data to new temporary file next to given path. Returns
+ *  temporary file path.
+ */
+fs::path writeTemporary(const fs::path &path, const std::string &header
+                        , const char *data, std::size_t size)
+{
+    const auto tmp(fs::unique_path(fs::path(path).concat(".%%%%%%%%.tmp")));
+    std::ofstream f(tmp.string(), std::ios::binary | std::ios::trunc);
+    try {
+        f.exceptions(std::ios::badbit | std::ios::failbit);
+        f.write(header.data(), header.size());
+        f.write(data, size);
+        f.close();
+    } catch (...) {
+        boost::system::error_code ec;
+        fs::remove(tmp, ec);
+        throw;
+    }
+    return tmp;
+}
+
+/** Body file starts with the URI terminated by zero byte.
+ */
+std::string bodyHeader(const std::string &uri)
+{
+    return uri + '\0';
+}
+
+} // namespace
+
+HttpDiskCache::pointer HttpDiskCache::get(const fs::path &root
+                                          , std::size_t sizeLimit
+                                          , std::time_t maxAge)
+{
+    static std::mutex mutex;
+    static std::map<fs::path, std::weak_ptr<HttpDiskCache>> registry;
+
+    const auto path(fs::absolute(root));
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &slot(registry[path]);
+    if (auto cache = slot.lock()) {
+        if ((cache->sizeLimit_ != sizeLimit) || (cache->maxAge_ != maxAge)) {
+            LOG(warn2)
+                << "HTTP cache at " << path << " already open with size limit "
+                << cache->sizeLimit_ << " and max age " << cache->maxAge_
+                << "; ignoring size limit " << sizeLimit << " and max age "
+                << maxAge << ".";
+        }
+        return cache;
+    }
+
+    auto cache(std::make_shared<HttpDiskCache>(path, sizeLimit, maxAge));
+    slot = cache;
+    return cache;
+}
+
+HttpDiskCache::HttpDiskCache(const fs::path &root, std::size_t sizeLimit
+                             , std::time_t maxAge)
+    : root_(root), sizeLimit_(sizeLimit), maxAge_(maxAge), size_()
+{
+    fs::create_directories(root_);
+    load();
+    evict();
+}
+
+fs::path HttpDiskCache::bodyPath(const std::string &key) const
+{
+    return root_ / (key + ".body");
+}
+
+fs::path HttpDiskCache::metaPath(const std::string &key) const
+{
+    return root_ / (key + ".meta");
+}
+
+void HttpDiskCache::load()
+{
+    struct Loaded {
+        Entry entry;
+        std::time_t accessed;
+    };
+
+    std::vector<Loaded> loaded;
+
+    for (fs::directory_iterator i(root_), e; i != e; ++i) {
+        const auto &path(i->path());
+        if (path.extension() == ".tmp") {
+            // leftover of interrupted store
+            boost::system::error_code ec;
+            fs::remove(path, ec);
+            continue;
+        }
+        if (path.extension() != ".meta") { continue; }
+
+        Loaded l;
+        l.entry.key = path.stem().string();
+
+        auto &uri(l.entry.uri);
+        std::ifstream f(path.string());
+        if (!std::getline(f, uri)
+            || !(f >> l.entry.size >> l.entry.fetched)
+            || (makeKey(uri) != l.entry.key))
+        {
+            LOG(warn2) << "Removing invalid HTTP cache entry " << path << ".";
+            boost::system::error_code ec;
+            fs::remove(path, ec);
+            fs::remove(bodyPath(l.entry.key), ec);
+            continue;
+        }
+
+        boost::system::error_code ec;
+        const auto body(bodyPath(l.entry.key));
+        const auto size(fs::file_size(body, ec));
+        if (ec || (size != (bodyHeader(uri).size() + l.entry.size))) {
+            fs::remove(path, ec);
+            fs::remove(body, ec);
+            continue;
+        }
+
+        l.accessed = fs::last_write_time(body, ec);
+        loaded.push_back(l);
+    }
+
+    // most recently used first
+    std::sort(loaded.begin(), loaded.end()
+              , [](const Loaded &l, const Loaded &r) {
+                  return l.accessed > r.accessed;
+              });
+
+    for (const auto &l : loaded) {
+        lru_.push_back(l.entry);
+        index_[l.entry.key] = std::prev(lru_.end());
+        size_ += l.entry.size;
+    }
+
+    LOG(info1) << "Loaded " << lru_.size() << " entries (" << size_
+               << " bytes) from HTTP cache at " << root_ << ".";
+}
+
+std::shared_ptr<const HttpDiskCache::Body>
+HttpDiskCache::fetch(const std::string &uri)
+{
+    const auto key(makeKey(uri));
+    std::size_t size;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto findex(index_.find(key));
+        if (findex == index_.end()) { return {}; }
+
+        auto ientry(findex->second);
+        if (ientry->uri != uri) {
+            // hash collision
+            return {};
+        }
+
+        if ((std::time(nullptr) - ientry->fetched) >= maxAge_) {
+            // stale, will be replaced
+            return {};
+        }
+
+        size = ientry->size;
+        lru_.splice(lru_.begin(), lru_, ientry);
+    }
+
+    // read outside the lock; file can be concurrently replaced or removed,
+    // body is accepted only if it carries the right URI and size
+    const auto path(bodyPath(key));
+    const auto header(bodyHeader(uri));
+    auto body(std::make_shared<Body>());
+    try {
+        std::ifstream f(path.string(), std::ios::binary);
+        if (!f) { return {}; }
+
+        std::string check(header.size(), '\0');
+        if (!f.read(&check[0], check.size()) || (check != header)) {
+            return {};
+        }
+
+        body->data.resize(size);
+        if (size && !f.read(&body->data[0], size)) { return {}; }
+        if (f.get() != std::ifstream::traits_type::eof()) { return {}; }
+    } catch (const std::exception &e) {
+        LOG(warn2) << "Failed to read HTTP cache entry for <" << uri
+                   << ">: " << e.what() << ".";
+        return {};
+    }
+
+    // remember access
+    boost::system::error_code ec;
+    fs::last_write_time(path, std::time(nullptr), ec);
+
+    return body;
+}
+
+void HttpDiskCache::store(const std::string &uri, const Body &body)
+{
+    const auto key(makeKey(uri));
+    const std::size_t size(body.data.size());
+
+    // too big to be ever cached
+    if (size > sizeLimit_) { return; }
+
+    Entry entry;
+    entry.key = key;
+    entry.uri = uri;
+    entry.size = size;
+    entry.fetched = std::time(nullptr);
+
+    // write data outside the lock
+    fs::path bodyTmp, metaTmp;
+    try {
+        bodyTmp = writeTemporary(bodyPath(key), bodyHeader(uri)
+                                 , body.data.data(), size);
+
+        std::ostringstream os;
+        os << uri << '\n' << entry.size << '\n' << entry.fetched << '\n';
+        metaTmp = writeTemporary(metaPath(key), os.str(), nullptr, 0);
+    } catch (const std::exception &e) {
+        LOG(warn2) << "Failed to store HTTP cache entry for <" << uri
+                   << ">: " << e.what() << ".";
+        boost::system::error_code ec;
+        if (!bodyTmp.empty()) { fs::remove(bodyTmp, ec); }
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto findex(index_.find(key));
+    if (findex != index_.end()) { remove(findex->second); }
+
+    try {
+        fs::rename(bodyTmp, bodyPath(key));
+        fs::rename(metaTmp, metaPath(key));
+    } catch (const std::exception &e) {
+        LOG(warn2) << "Failed to store HTTP cache entry for <" << uri
+                   << ">: " << e.what() << ".";
+        boost::system::error_code ec;
+        fs::remove(bodyTmp, ec);
+        fs::remove(metaTmp, ec);
+        fs::remove(bodyPath(key), ec);
+        return;
+    }
+
+    lru_.push_front(entry);
+    index_[key] = lru_.begin();
+    size_ += size;
+
+    evict();
+}
+
+void HttpDiskCache::remove(Lru::iterator ientry)
+{
+    boost::system::error_code ec;
+    fs::remove(metaPath(ientry->key), ec);
+    fs::remove(bodyPath(ientry->key), ec);
+
+    size_ -= ientry->size;
+    index_.erase(ientry->key);
+    lru_.erase(ientry);
+}
+
+void HttpDiskCache::evict()
+{
+    while ((size_ > sizeLimit_) && !lru_.empty()) {
+        remove(std::prev(lru_.end()));
+    }
+}
+
+} // namespace roarchive
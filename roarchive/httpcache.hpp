@@ -0,0 +1,127 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef roarchive_httpcache_hpp_included_
+#define roarchive_httpcache_hpp_included_
+
+#include <ctime>
+#include <list>
+#include <map>
+#include <mutex>
+#include <memory>
+
+#include <boost/optional.hpp>
+#include <boost/filesystem/path.hpp>
+
+#include "utility/resourcefetcher.hpp"
+
+namespace roarchive {
+
+/** Local on-disk cache of resources fetched over HTTP.
+ *
+ *  Each resource is stored as a pair of files named by hash of its URI:
+ *  body (HASH.body) and metadata (HASH.meta). Both record the URI which is
+ *  checked on every hit, so hash collisions are never served. Entries
+ *  younger than maxAge are served from disk, older ones are considered stale
+ *  and must be refetched.
+ *
+ *  NB: stale entries are not revalidated (If-None-Match/If-Modified-Since):
+ *  utility::ResourceFetcher can neither send request headers nor report
+ *  response validators or 304 status.
+ *
+ *  Total size of cached bodies is kept under sizeLimit by evicting least
+ *  recently used entries. Access order survives restarts since it is stored
+ *  in body's modification time.
+ *
+ *  Instances are shared among all archives using the same cache directory,
+ *  use HttpDiskCache::get() to obtain one. Lock protects only the index, file
+ *  data are read and written outside of it (files are replaced atomically).
+ */
+class HttpDiskCache {
+public:
+    typedef utility::ResourceFetcher::Query::Body Body;
+    typedef std::shared_ptr<HttpDiskCache> pointer;
+
+    /** Returns cache instance for given root directory.
+     *
+     *  First opener wins: when the directory's cache is already open its
+     *  size limit and max age are kept, different ones are only logged.
+     */
+    static pointer get(const boost::filesystem::path &root
+                       , std::size_t sizeLimit, std::time_t maxAge);
+
+    HttpDiskCache(const boost::filesystem::path &root
+                  , std::size_t sizeLimit, std::time_t maxAge);
+
+    /** Returns fresh cached body for given URI, if any.
+     */
+    std::shared_ptr<const Body> fetch(const std::string &uri);
+
+    /** Stores body for given URI.
+     */
+    void store(const std::string &uri, const Body &body);
+
+private:
+    struct Entry {
+        std::string key;
+        std::string uri;
+        std::size_t size;
+        std::time_t fetched;
+    };
+
+    typedef std::list<Entry> Lru;
+
+    /** Loads metadata of all entries found in the cache directory.
+     */
+    void load();
+
+    /** Removes entry and its files. Must be called under lock.
+     */
+    void remove(Lru::iterator ientry);
+
+    /** Evicts least recently used entries until total size fits in the
+     *  limit. Must be called under lock.
+     */
+    void evict();
+
+    boost::filesystem::path bodyPath(const std::string &key) const;
+    boost::filesystem::path metaPath(const std::string &key) const;
+
+    const boost::filesystem::path root_;
+    const std::size_t sizeLimit_;
+    const std::time_t maxAge_;
+
+    std::mutex mutex_;
+
+    /** Entries, most recently used first.
+     */
+    Lru lru_;
+    std::map<std::string, Lru::iterator> index_;
+    std::size_t size_;
+};
+
+} // namespace roarchive
+
+#endif // roarchive_httpcache_hpp_included_
@@ -43,6 +43,81 @@ operator<<(std::basic_ostream<CharT, Traits> &os, const FileHint &hint)
               << '}';
 }
 
+template<typename CharT, typename Traits>
+inline std::basic_ostream<CharT, Traits>&
+operator<<(std::basic_ostream<CharT, Traits> &os, const Stats::Operation &op)
+{
+    switch (op) {
+    case Stats::Operation::exists: return os << "exists";
+    case Stats::Operation::istream: return os << "istream";
+    case Stats::Operation::findFile: return os << "findFile";
+    case Stats::Operation::list: return os << "list";
+    }
+    return os;
+}
+
+template<typename CharT, typename Traits>
+inline std::basic_ostream<CharT, Traits>&
+operator<<(std::basic_ostream<CharT, Traits> &os, const Stats &stats)
+{
+    os << "backend: " << stats.backend
+       << "\nopens: " << stats.opens << " (" << stats.openTime
+       << " us, index: " << stats.indexTime << " us)"
+       << "\nbytes read: " << stats.bytesRead
+       << "\ndecompressed bytes: " << stats.decompressedBytes
+       << "\ncache hits/misses: " << stats.cacheHits << "/"
+       << stats.cacheMisses;
+
+    const auto &ra(stats.readahead);
+    if (ra.advices || ra.randomSwitches) {
+        os << "\nreadahead: " << ra.advices << " advices ("
+           << ra.advisedBytes << " bytes, hits: " << ra.hits
+           << ", wasted bytes: " << ra.wastedBytes << ")"
+           << "\nrandom access: " << ra.randomSwitches << " switches (hits: "
+           << ra.randomHits << ", misses: " << ra.randomMisses << ")";
+    }
+
+    for (std::size_t i(0); i < Stats::OperationCount; ++i) {
+        const auto op(static_cast<Stats::Operation>(i));
+        const auto &ops(stats[op]);
+        os << "\n" << op << ": " << ops.count << " (errors: " << ops.errors
+           << ", p50: " << ops.latency.quantile(0.5)
+           << " us, p99: " << ops.latency.quantile(0.99) << " us)";
+    }
+
+    return os << '\n';
+}
+
+template<typename CharT, typename Traits>
+inline std::basic_ostream<CharT, Traits>&
+operator<<(std::basic_ostream<CharT, Traits> &os, const MemoryUsage &usage)
+{
+    return os << "index: " << usage.index << ", spilled: " << usage.spilled
+              << ", shared: " << usage.shared
+              << ", http bodies: " << usage.httpBodies
+              << ", cache: " << usage.cache;
+}
+
+template<typename CharT, typename Traits>
+inline std::basic_ostream<CharT, Traits>&
+operator<<(std::basic_ostream<CharT, Traits> &os, const MemoryReport &report)
+{
+    os << "memory: " << report.total.total() << " bytes (budget: ";
+    if (report.budget) {
+        os << report.budget << " bytes";
+    } else {
+        os << "unlimited";
+    }
+    os << ")\ntotal: " << report.total;
+
+    for (const auto &archive : report.archives) {
+        os << "\n" << archive.path.string() << " (" << archive.backend
+           << "): " << archive.usage;
+    }
+
+    return os << '\n';
+}
+
 
 } // namespace roarchive
 
@@ -37,6 +37,58 @@
 
 namespace roarchive {
 
+class RoArchive;
+class StatsCollector;
+class Observer;
+
+/** Transparent decompression of whole file reads, see IStream::read().
+ */
+enum class Decompress {
+    /** Return data as stored.
+     */
+    none,
+
+    /** gzip stream (RFC 1952), possibly multi-member.
+     */
+    gzip,
+
+    /** zlib stream (RFC 1950).
+     */
+    zlib,
+
+    /** Raw deflate stream (RFC 1951).
+     */
+    deflate,
+
+    /** gzip if data start with gzip magic, otherwise returned as stored.
+     */
+    detect
+};
+
+/** Byte range of a local file. Used to access data stored verbatim in a file
+ *  directly via kernel.
+ */
+struct FileRange {
+    /** Open file descriptor (not owned), -1 if path has to be opened.
+     */
+    int fd;
+
+    /** Path to file.
+     */
+    boost::filesystem::path path;
+
+    std::size_t start;
+    std::size_t end;
+
+    FileRange(int fd = -1
+              , const boost::filesystem::path &path = boost::filesystem::path()
+              , std::size_t start = 0, std::size_t end = 0)
+        : fd(fd), path(path), start(start), end(end)
+    {}
+
+    std::size_t size() const { return end - start; }
+};
+
 /** Input stream.
  */
 class IStream {
@@ -90,7 +142,26 @@ public:
      */
     std::vector<char> read();
 
+    /** Read whole file and decompress it in one shot. Much faster than
+     *  decompressing filter for small files. File must not be read from
+     *  before.
+     */
+    std::vector<char> read(Decompress decompress);
+
+    /** Returns range of local file where data of this stream are stored
+     *  verbatim, if any. Never available for streams with filters.
+     *  Valid only if stream was not read from before.
+     */
+    boost::optional<FileRange> fileRange() const {
+        if (stacked_) { return boost::none; }
+        return range();
+    }
+
 protected:
+    /** Backend-specific file range. None by default.
+     */
+    virtual boost::optional<FileRange> range() const { return boost::none; }
+
     void update(const boost::optional<std::size_t> &size = boost::none
                 , bool seekable = true)
     {
@@ -103,10 +174,22 @@ protected:
     boost::iostreams::filtering_istream fis_;
 
 private:
+    friend class RoArchive;
+    friend void copy(const IStream::pointer &in, std::ostream &out);
+    friend void copy(const IStream::pointer &in, int out);
+
     bool stacked_;
     bool seekable_;
     boost::optional<std::size_t> size_;
     std::time_t timestamp_;
+
+    /** Statistics collector of parent archive, set by RoArchive.
+     */
+    std::shared_ptr<StatsCollector> stats_;
+
+    /** Tracing hook of parent archive, set by RoArchive.
+     */
+    std::shared_ptr<Observer> observer_;
 };
 
 // support operations
@@ -116,9 +199,21 @@ private:
 void copy(const IStream::pointer &in, std::ostream &out);
 
 /** Copies open input stream to local file.
+ *
+ *  Data stored verbatim in a local file are copied by the kernel, see
+ *  copy(in, int).
  */
 void copy(const IStream::pointer &in, const boost::filesystem::path &out);
 
+/** Copies open input stream to open file descriptor (file, pipe, socket).
+ *
+ *  If stream's data are stored verbatim in a local file (see
+ *  IStream::fileRange()) data are copied by the kernel: copy_file_range(2)
+ *  (possibly reflinked) or sendfile(2). Other streams are copied in user
+ *  space.
+ */
+void copy(const IStream::pointer &in, int out);
+
 } // namespace roarchive
 
 #endif // roarchive_istream_hpp_included_
@@ -0,0 +1,219 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mutex>
+#include <atomic>
+#include <functional>
+
+#include "dbglog/dbglog.hpp"
+
+#include "utility/uri.hpp"
+
+#include "detail.hpp"
+
+namespace fs = boost::filesystem;
+
+namespace roarchive {
+
+namespace {
+
+/** Path as opened by factory(): without inline hint.
+ */
+fs::path openedPath(const fs::path &path, const OpenOptions &openOptions)
+{
+    if (!openOptions.inlineHint) { return path; }
+    const auto str(path.string());
+    return str.substr(0, str.find(openOptions.inlineHint));
+}
+
+/** Tells whether factory() opens given path as HTTP archive.
+ */
+bool openedOverHttp(const fs::path &path, const OpenOptions &openOptions)
+{
+#ifdef ROARCHIVE_HAS_HTTP
+    const auto str(path.string());
+    if (openOptions.nestedSeparator
+        && (str.find(openOptions.nestedSeparator) != std::string::npos))
+    {
+        // nested archive
+        return false;
+    }
+
+    if (!openOptions.mime.empty()) { return openOptions.mime == "http"; }
+
+    try {
+        utility::Uri uri(str);
+        return (uri.scheme() == "http") || (uri.scheme() == "https");
+    } catch (...) {}
+#else
+    (void) path;
+    (void) openOptions;
+#endif
+    return false;
+}
+
+/** Lazily opened archive: real archive is opened on first use.
+ *
+ *  RoArchive resolves this detail before any request, the forwarding
+ *  functions below are used only when the detail is accessed directly.
+ */
+class Lazy : public RoArchive::Detail {
+public:
+    typedef std::function<RoArchive::dpointer()> Open;
+
+    Lazy(const fs::path &path, const Open &open, bool http)
+        : Detail(path), open_(open), http_(http), resolved_(false)
+    {}
+
+    virtual Detail& resolve() { return target(); }
+    virtual const Detail& resolve() const { return target(); }
+    virtual bool resolved() const { return resolved_; }
+
+    virtual IStream::pointer istream(const fs::path &path
+                                     , const IStream::FilterInit &filterInit)
+        const
+    {
+        return target().istream(path, filterInit);
+    }
+
+    virtual IStream::pointer istream(const fs::path &path
+                                     , std::size_t offset, std::size_t length
+                                     , const IStream::FilterInit &filterInit)
+        const
+    {
+        return target().istream(path, offset, length, filterInit);
+    }
+
+    virtual bool exists(const fs::path &path) const {
+        return target().exists(path);
+    }
+
+    virtual boost::optional<fs::path> findFile(const std::string &filename)
+        const
+    {
+        return target().findFile(filename);
+    }
+
+    virtual Files list() const { return target().list(); }
+
+    virtual Files list(const fs::path &prefix) const {
+        return target().list(prefix);
+    }
+
+    virtual void forEach(const Entry::Callback &callback) const {
+        target().forEach(callback);
+    }
+
+    virtual Listing listDir(const fs::path &dir) const {
+        return target().listDir(dir);
+    }
+
+    /** Hint applied before open is kept and applied at open.
+     */
+    virtual void applyHint(const FileHint &hint) {
+        if (!hint) { return; }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!target_) {
+                hint_ = hint;
+                return;
+            }
+        }
+        target_->applyHint(hint);
+    }
+
+    virtual void prefetch(const Files &paths) const {
+        target().prefetch(paths);
+    }
+
+    /** Checks only the path until opened.
+     */
+    virtual bool changed() const {
+        if (resolved_) { return target_->changed(); }
+        return Detail::changed();
+    }
+
+    /** Answered from the path until opened.
+     */
+    virtual bool handlesSchema(const std::string &schema) const {
+        if (resolved_) { return target_->handlesSchema(schema); }
+        return http_ && ((schema == "http") || (schema == "https"));
+    }
+
+    virtual const boost::optional<fs::path>& usedHint() {
+        return target().usedHint();
+    }
+
+private:
+    /** Opens the archive on first call. Failed open is retried by the next
+     *  call.
+     */
+    Detail& target() const {
+        if (!resolved_.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!target_) {
+                LOG(info1) << "Opening lazily opened archive " << path_
+                           << ".";
+                auto target(open_());
+                target->applyHint(hint_);
+                target_ = target;
+                resolved_.store(true, std::memory_order_release);
+            }
+        }
+        return *target_;
+    }
+
+    const Open open_;
+
+    /** Opened as HTTP archive.
+     */
+    const bool http_;
+
+    /** Hint applied before open.
+     */
+    FileHint hint_;
+
+    mutable std::mutex mutex_;
+    mutable RoArchive::dpointer target_;
+    mutable std::atomic<bool> resolved_;
+};
+
+} // namespace
+
+RoArchive::dpointer RoArchive::lazy(const fs::path &path
+                                    , const OpenOptions &openOptions)
+{
+    auto detail(std::make_shared<Lazy>
+                (openedPath(path, openOptions), [path, openOptions]()
+    {
+        return factory(path, openOptions);
+    }, openedOverHttp(path, openOptions)));
+    detail->memory().backend("lazy");
+    detail->observer(openOptions.observer);
+    return detail;
+}
+
+} // namespace roarchive
@@ -0,0 +1,344 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <mutex>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <system_error>
+
+#include "dbglog/dbglog.hpp"
+
+#include "memoryaccount.hpp"
+
+namespace fs = boost::filesystem;
+
+namespace roarchive {
+
+namespace {
+
+struct Registry {
+    std::mutex mutex;
+    std::set<MemoryAccount*> accounts;
+
+    std::array<std::atomic<std::int64_t>, 5> totals;
+
+    std::atomic<std::uint64_t> budget;
+
+    /** Guarded by mutex.
+     */
+    fs::path spillDir;
+
+    Registry() : budget(0), spillDir("/var/tmp") {
+        for (auto &total : totals) { total = 0; }
+    }
+};
+
+Registry& registry()
+{
+    // never destroyed, archives may live in static objects
+    static Registry *registry(new Registry());
+    return *registry;
+}
+
+MemoryUsage usage(const std::array<std::atomic<std::int64_t>, 5> &counters)
+{
+    const auto get([&](MemoryCategory category) -> std::uint64_t {
+            const auto value(counters[static_cast<std::size_t>(category)]
+                             .load());
+            return (value > 0) ? value : 0;
+        });
+
+    MemoryUsage usage;
+    usage.index = get(MemoryCategory::index);
+    usage.spilled = get(MemoryCategory::spilled);
+    usage.shared = get(MemoryCategory::shared);
+    usage.httpBodies = get(MemoryCategory::httpBodies);
+    usage.cache = get(MemoryCategory::cache);
+    return usage;
+}
+
+/** Creates unlinked temporary file in given directory. Returns -1 on
+ *  failure.
+ */
+int tmpfile(const fs::path &dir)
+{
+#ifdef O_TMPFILE
+    const auto fd(::open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC
+                         , 0600));
+    if (fd >= 0) { return fd; }
+#endif
+
+    // fallback for filesystems without O_TMPFILE support
+    auto tmpl((dir / "roarchive-spill.XXXXXX").string());
+    const auto fd2(::mkostemp(&tmpl[0], O_CLOEXEC));
+    if (fd2 >= 0) { ::unlink(tmpl.c_str()); }
+    return fd2;
+}
+
+fs::path spillDir()
+{
+    auto &r(registry());
+    std::lock_guard<std::mutex> lock(r.mutex);
+    return r.spillDir;
+}
+
+/** Maps new spill file of given size. Returns null on failure.
+ */
+char* spill(std::size_t size)
+{
+    const auto dir(spillDir());
+    const auto fd(tmpfile(dir));
+    if (fd < 0) {
+        std::system_error e(errno, std::system_category());
+        LOG(warn2) << "Cannot create spill file in " << dir << ": <"
+                   << e.what() << ">; keeping data on heap.";
+        return nullptr;
+    }
+
+    void *data(MAP_FAILED);
+    if (!::ftruncate(fd, size)) {
+        data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED
+                      , fd, 0);
+    }
+
+    if (data == MAP_FAILED) {
+        std::system_error e(errno, std::system_category());
+        LOG(warn2) << "Cannot map spill file in " << dir << ": <"
+                   << e.what() << ">; keeping data on heap.";
+        ::close(fd);
+        return nullptr;
+    }
+
+    // mapping keeps the file alive
+    ::close(fd);
+    return static_cast<char*>(data);
+}
+
+} // namespace
+
+MemoryUsage& MemoryUsage::operator+=(const MemoryUsage &o)
+{
+    index += o.index;
+    spilled += o.spilled;
+    shared += o.shared;
+    httpBodies += o.httpBodies;
+    cache += o.cache;
+    return *this;
+}
+
+MemoryAccount::MemoryAccount(const fs::path &path)
+    : path_(path)
+{
+    for (auto &counter : counters_) { counter = 0; }
+}
+
+MemoryAccount::pointer MemoryAccount::create(const fs::path &path)
+{
+    pointer account(new MemoryAccount(path));
+
+    auto &r(registry());
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.accounts.insert(account.get());
+    return account;
+}
+
+MemoryAccount::~MemoryAccount()
+{
+    auto &r(registry());
+    {
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.accounts.erase(this);
+    }
+
+    for (std::size_t i(0); i < counters_.size(); ++i) {
+        r.totals[i] -= counters_[i].load();
+    }
+}
+
+void MemoryAccount::backend(const std::string &backend)
+{
+    auto &r(registry());
+    std::lock_guard<std::mutex> lock(r.mutex);
+    backend_ = backend;
+}
+
+void MemoryAccount::charge(MemoryCategory category, std::int64_t bytes)
+{
+    if (!bytes) { return; }
+    const auto index(static_cast<std::size_t>(category));
+    counters_[index] += bytes;
+    registry().totals[index] += bytes;
+}
+
+MemoryUsage MemoryAccount::usage() const
+{
+    return roarchive::usage(counters_);
+}
+
+void MemoryAccount::evictor(const Evictor &evictor)
+{
+    auto &r(registry());
+    std::lock_guard<std::mutex> lock(r.mutex);
+    evictor_ = evictor;
+}
+
+MemoryReport memoryReport()
+{
+    auto &r(registry());
+
+    MemoryReport report;
+    report.budget = r.budget;
+
+    std::lock_guard<std::mutex> lock(r.mutex);
+    report.total = usage(r.totals);
+    for (const auto *account : r.accounts) {
+        report.archives.emplace_back();
+        auto &archive(report.archives.back());
+        archive.path = account->path_;
+        archive.backend = account->backend_;
+        archive.usage = account->usage();
+    }
+
+    std::sort(report.archives.begin(), report.archives.end()
+              , [](const MemoryReport::Archive &a
+                   , const MemoryReport::Archive &b)
+    {
+        return a.usage.total() > b.usage.total();
+    });
+
+    return report;
+}
+
+void setMemoryBudget(std::uint64_t budget, const fs::path &spillDir)
+{
+    auto &r(registry());
+    {
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.spillDir = spillDir;
+    }
+    r.budget = budget;
+
+    LOG(info2) << "Memory budget set to " << budget << " bytes (spill "
+               << "directory: " << spillDir << ").";
+
+    enforceMemoryBudget();
+}
+
+int spillFile()
+{
+    const auto dir(spillDir());
+    const auto fd(tmpfile(dir));
+    if (fd < 0) {
+        std::system_error e(errno, std::system_category());
+        LOG(warn2) << "Cannot create spill file in " << dir << ": <"
+                   << e.what() << ">.";
+    }
+    return fd;
+}
+
+bool overBudget(std::size_t extra)
+{
+    const auto &r(registry());
+    const auto budget(r.budget.load());
+    if (!budget) { return false; }
+    return (usage(r.totals).total() + extra) > budget;
+}
+
+void enforceMemoryBudget()
+{
+    auto &r(registry());
+    const auto budget(r.budget.load());
+    if (!budget) { return; }
+
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    // evict from the biggest caches first
+    std::vector<MemoryAccount*> accounts;
+    for (auto *account : r.accounts) {
+        if (account->evictor_) { accounts.push_back(account); }
+    }
+    std::sort(accounts.begin(), accounts.end()
+              , [](const MemoryAccount *a, const MemoryAccount *b)
+    {
+        return a->usage().cache > b->usage().cache;
+    });
+
+    for (auto *account : accounts) {
+        const auto total(usage(r.totals).total());
+        if (total <= budget) { return; }
+        account->evictor_(total - budget);
+    }
+
+    const auto total(usage(r.totals).total());
+    if (total > budget) {
+        LOG(info1) << "Memory usage (" << total << " bytes) over budget ("
+                   << budget << " bytes) after cache eviction.";
+    }
+}
+
+std::shared_ptr<MemoryBlock> MemoryBlock::allocate(std::size_t size)
+{
+    if (size && overBudget(size)) {
+        if (auto *data = spill(size)) {
+            return std::shared_ptr<MemoryBlock>
+                (new MemoryBlock(data, size, Kind::spilled));
+        }
+    }
+
+    return std::shared_ptr<MemoryBlock>
+        (new MemoryBlock(new char[std::max(size, std::size_t(1))], size
+                         , Kind::heap));
+}
+
+MemoryBlock::pointer MemoryBlock::map(int fd, std::size_t size)
+{
+    if (!size) { return {}; }
+    auto *data(::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0));
+    if (data == MAP_FAILED) { return {}; }
+    return pointer(new MemoryBlock(static_cast<char*>(data), size
+                                   , Kind::shared));
+}
+
+MemoryBlock::~MemoryBlock()
+{
+    if (kind_ != Kind::heap) {
+        ::munmap(data_, size_);
+    } else {
+        delete [] data_;
+    }
+}
+
+void MemoryBlock::seal()
+{
+    if (kind_ == Kind::spilled) { ::mprotect(data_, size_, PROT_READ); }
+}
+
+} // namespace roarchive
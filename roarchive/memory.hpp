@@ -0,0 +1,125 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef roarchive_memory_hpp_included_
+#define roarchive_memory_hpp_included_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <boost/filesystem/path.hpp>
+
+namespace roarchive {
+
+/** Memory held by archive(s), in bytes.
+ */
+struct MemoryUsage {
+    /** In-memory index data (file maps, manifests, merged overlay index)
+     *  and nested archives materialized in memory.
+     */
+    std::uint64_t index;
+
+    /** Index data spilled to mmap-backed temporary files and nested archives
+     *  materialized in the spill directory. Not counted in the budget: these
+     *  pages are file-backed and reclaimable by the kernel.
+     */
+    std::uint64_t spilled;
+
+    /** Index data mapped from shared memory index files; the same pages are
+     *  used by all processes mapping the same index. Not counted in the
+     *  budget.
+     */
+    std::uint64_t shared;
+
+    /** HTTP bodies held by open streams.
+     */
+    std::uint64_t httpBodies;
+
+    /** In-memory caches (HTTP exists cache, HTTP prefetch buffer).
+     */
+    std::uint64_t cache;
+
+    MemoryUsage() : index(), spilled(), shared(), httpBodies(), cache() {}
+
+    /** Memory counted in the budget.
+     */
+    std::uint64_t total() const { return index + httpBodies + cache; }
+
+    MemoryUsage& operator+=(const MemoryUsage &o);
+};
+
+/** Process-wide memory report.
+ */
+struct MemoryReport {
+    struct Archive {
+        /** Archive path (after applying hint).
+         */
+        boost::filesystem::path path;
+        std::string backend;
+        MemoryUsage usage;
+    };
+
+    /** Configured budget, 0 means unlimited.
+     */
+    std::uint64_t budget;
+
+    /** Sum over all archives.
+     */
+    MemoryUsage total;
+
+    /** All open archives (including archives that are already closed but
+     *  memory charged to them is still referenced, e.g. by open streams).
+     */
+    std::vector<Archive> archives;
+
+    MemoryReport() : budget() {}
+};
+
+/** Returns memory used by all archives in this process.
+ */
+MemoryReport memoryReport();
+
+/** Sets process-wide memory budget (0 = unlimited, the default).
+ *
+ *  When over budget:
+ *      * newly built indices are placed in mmap-backed unlinked temporary
+ *        files in spillDir instead of on the heap
+ *      * nested archives that must be decompressed are materialized in
+ *        spillDir instead of anonymous memory
+ *      * in-memory caches of all archives are evicted down to the limit
+ *
+ *  Already built indices are never moved (lookups may be running on them in
+ *  other threads), i.e. the budget can be exceeded by indices built before
+ *  it was reached. Such memory is still charged and reported, and it is
+ *  released only by closing the archive.
+ */
+void setMemoryBudget(std::uint64_t budget
+                     , const boost::filesystem::path &spillDir = "/var/tmp");
+
+} // namespace roarchive
+
+#endif // roarchive_memory_hpp_included_
@@ -0,0 +1,235 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef roarchive_memoryaccount_hpp_included_
+#define roarchive_memoryaccount_hpp_included_
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <functional>
+
+#include <boost/filesystem/path.hpp>
+
+#include "memory.hpp"
+
+namespace roarchive {
+
+enum class MemoryCategory { index, spilled, shared, httpBodies, cache };
+
+/** Memory charged to a single archive.
+ *
+ *  Every account is registered in process-wide registry (see
+ *  memoryReport()) and everything charged to the account is charged to the
+ *  process-wide totals as well. Whatever remains charged is released when the
+ *  account is destroyed.
+ */
+class MemoryAccount {
+public:
+    typedef std::shared_ptr<MemoryAccount> pointer;
+
+    /** Cache evictor: evictor(bytes) should release at least given number of
+     *  bytes (if possible) and return number of bytes actually released.
+     */
+    typedef std::function<std::size_t(std::size_t)> Evictor;
+
+    static pointer create(const boost::filesystem::path &path);
+
+    ~MemoryAccount();
+
+    MemoryAccount(const MemoryAccount&) = delete;
+    MemoryAccount& operator=(const MemoryAccount&) = delete;
+
+    /** Sets backend name, reported in memoryReport().
+     */
+    void backend(const std::string &backend);
+
+    /** Adds (or subtracts if negative) given number of bytes.
+     */
+    void charge(MemoryCategory category, std::int64_t bytes);
+
+    /** Charges index, i.e. anything providing memoryUsage(), spilledSize()
+     *  and sharedSize().
+     */
+    template <typename Index> void chargeIndex(const Index &index) {
+        charge(MemoryCategory::index, index.memoryUsage());
+        charge(MemoryCategory::spilled, index.spilledSize());
+        charge(MemoryCategory::shared, index.sharedSize());
+    }
+
+    MemoryUsage usage() const;
+
+    /** Sets cache evictor used when process is over budget. Empty evictor
+     *  unregisters; returns after any running eviction is finished.
+     */
+    void evictor(const Evictor &evictor);
+
+private:
+    MemoryAccount(const boost::filesystem::path &path);
+
+    friend MemoryReport memoryReport();
+    friend void enforceMemoryBudget();
+
+    const boost::filesystem::path path_;
+
+    /** Guarded by registry mutex.
+     */
+    std::string backend_;
+    Evictor evictor_;
+
+    std::array<std::atomic<std::int64_t>, 5> counters_;
+};
+
+/** Scoped charge, released on destruction.
+ */
+class MemoryCharge {
+public:
+    MemoryCharge() : category_(), bytes_() {}
+
+    MemoryCharge(const MemoryAccount::pointer &account
+                 , MemoryCategory category, std::size_t bytes)
+        : account_(account), category_(category), bytes_(bytes)
+    {
+        if (account_) { account_->charge(category_, bytes_); }
+    }
+
+    MemoryCharge(MemoryCharge &&o)
+        : account_(std::move(o.account_)), category_(o.category_)
+        , bytes_(o.bytes_)
+    {
+        o.account_.reset();
+    }
+
+    MemoryCharge& operator=(MemoryCharge &&o) {
+        if (this != &o) {
+            release();
+            account_ = std::move(o.account_);
+            category_ = o.category_;
+            bytes_ = o.bytes_;
+            o.account_.reset();
+        }
+        return *this;
+    }
+
+    ~MemoryCharge() { release(); }
+
+    void release() {
+        if (!account_) { return; }
+        account_->charge(category_, -std::int64_t(bytes_));
+        account_.reset();
+    }
+
+private:
+    MemoryAccount::pointer account_;
+    MemoryCategory category_;
+    std::size_t bytes_;
+};
+
+/** Returns true if process would be over budget after allocating extra
+ *  bytes. Always false if no budget is set.
+ */
+bool overBudget(std::size_t extra = 0);
+
+/** Creates unlinked temporary file in the spill directory. Returns -1 on
+ *  failure.
+ */
+int spillFile();
+
+/** Evicts caches of all archives until process is within budget. Must not
+ *  be called with any cache lock held.
+ */
+void enforceMemoryBudget();
+
+/** Contiguous block of (eventually) read-only data.
+ *
+ *  Block allocated while the process is over budget is spilled: it lives in
+ *  a shared mapping of an unlinked temporary file in the spill directory, so
+ *  the kernel can write it back and drop it from memory instead of keeping
+ *  it in RAM or swap. Data must not contain any pointers.
+ *
+ *  Shared block is a read-only mapping of a file shared with other processes
+ *  (e.g. in /dev/shm).
+ */
+class MemoryBlock {
+public:
+    typedef std::shared_ptr<const MemoryBlock> pointer;
+
+    enum class Kind { heap, spilled, shared };
+
+    /** Allocates block of given size; spilled if over budget.
+     */
+    static std::shared_ptr<MemoryBlock> allocate(std::size_t size);
+
+    /** Maps whole open file read-only. Returns null on failure.
+     */
+    static pointer map(int fd, std::size_t size);
+
+    ~MemoryBlock();
+
+    MemoryBlock(const MemoryBlock&) = delete;
+    MemoryBlock& operator=(const MemoryBlock&) = delete;
+
+    char* data() { return data_; }
+    const char* data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+    Kind kind() const { return kind_; }
+
+    /** Memory charged to heap (zero if mapped).
+     */
+    std::size_t memoryUsage() const {
+        return (kind_ == Kind::heap) ? size_ : 0;
+    }
+
+    /** Size of spilled data.
+     */
+    std::size_t spilledSize() const {
+        return (kind_ == Kind::spilled) ? size_ : 0;
+    }
+
+    /** Size of data shared with other processes.
+     */
+    std::size_t sharedSize() const {
+        return (kind_ == Kind::shared) ? size_ : 0;
+    }
+
+    /** Marks block as filled. Spilled block is made read-only.
+     */
+    void seal();
+
+private:
+    MemoryBlock(char *data, std::size_t size, Kind kind)
+        : data_(data), size_(size), kind_(kind)
+    {}
+
+    char *data_;
+    std::size_t size_;
+    Kind kind_;
+};
+
+} // namespace roarchive
+
+#endif // roarchive_memoryaccount_hpp_included_
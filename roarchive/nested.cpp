@@ -0,0 +1,276 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <system_error>
+
+#include "dbglog/dbglog.hpp"
+
+#include "utility/cppversion.hpp"
+
+#include "detail.hpp"
+
+namespace fs = boost::filesystem;
+
+namespace roarchive {
+
+namespace {
+
+enum class Format { unknown, tar, zip };
+
+/** Detects archive format from the first bytes of given file range.
+ */
+Format sniff(const FileRange &range)
+{
+    char header[512];
+    const auto size(std::min(sizeof(header), range.size()));
+    const auto got(::pread(range.fd, header, size, range.start));
+    if (got < 4) { return Format::unknown; }
+
+    if (!std::memcmp(header, "PK\x03\x04", 4)
+        || !std::memcmp(header, "PK\x05\x06", 4))
+    {
+        return Format::zip;
+    }
+
+    if ((got == sizeof(header)) && !std::memcmp(header + 257, "ustar", 5)) {
+        return Format::tar;
+    }
+
+    return Format::unknown;
+}
+
+class Fd {
+public:
+    Fd(int fd) : fd_(fd) {}
+    ~Fd() { if (fd_ >= 0) { ::close(fd_); } }
+
+    Fd(const Fd&) = delete;
+    Fd& operator=(const Fd&) = delete;
+
+    operator int() const { return fd_; }
+
+private:
+    int fd_;
+};
+
+/** Decompresses given stream into anonymous memory file, or into unlinked
+ *  file in the spill directory if the process would get over budget.
+ *  Materialized data are charged to given account.
+ */
+int materialize(const fs::path &path, IStream::pointer &&is
+                , const MemoryAccount::pointer &memory, MemoryCharge &charge)
+{
+    const auto expected(is->size());
+    int fd(-1);
+    auto category(MemoryCategory::index);
+    if (overBudget(expected ? *expected : 0)) {
+        fd = spillFile();
+        category = MemoryCategory::spilled;
+    }
+
+    if (fd < 0) {
+        fd = ::memfd_create(path.filename().c_str(), MFD_CLOEXEC);
+        category = MemoryCategory::index;
+    }
+
+    if (fd < 0) {
+        std::system_error e(errno, std::system_category());
+        LOGTHROW(err2, IOError)
+            << "Cannot create memory file for nested archive " << path
+            << ": <" << e.what() << ">.";
+    }
+
+    try {
+        copy(is, fd);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+
+    struct ::stat st;
+    if (!::fstat(fd, &st)) {
+        charge = MemoryCharge(memory, category, st.st_size);
+    }
+    return fd;
+}
+
+fs::path procPath(int fd)
+{
+    return fs::path("/proc/self/fd") / std::to_string(fd);
+}
+
+OpenOptions flat(OpenOptions openOptions)
+{
+    openOptions.nestedSeparator = 0;
+    openOptions.inlineHint = 0;
+    return openOptions;
+}
+
+/** Nested archive that cannot be read in place: entry is decompressed into
+ *  anonymous memory file (or spill file when over budget) which is then
+ *  opened as regular archive. All calls are forwarded to it.
+ *
+ *  NB: there is no seekable decompression layer (inflate checkpoints allowing
+ *  random access into compressed inner archive): indexing the inner archive
+ *  decompresses the whole entry anyway (zip central directory is at its
+ *  end, tar must be scanned) and every access would restart inflate from
+ *  the nearest checkpoint. Store inner archives uncompressed to have them
+ *  read in place.
+ */
+class Materialized : public RoArchive::Detail {
+public:
+    Materialized(const RoArchive &parent, const fs::path &path
+                 , IStream::pointer &&is, const OpenOptions &openOptions)
+        : Detail(parent.path() / path), parent_(parent)
+        , fd_(materialize(path, std::move(is), memoryPointer(), charge_))
+        , archive_(procPath(fd_), flat(openOptions))
+        , usedHint_(archive_.usedHint())
+    {}
+
+    virtual IStream::pointer istream(const fs::path &path
+                                     , const IStream::FilterInit &filterInit)
+        const
+    {
+        return archive_.istream(path, filterInit);
+    }
+
+    virtual IStream::pointer istream(const fs::path &path
+                                     , std::size_t offset, std::size_t length
+                                     , const IStream::FilterInit &filterInit)
+        const
+    {
+        return archive_.istream(path, offset, length, filterInit);
+    }
+
+    virtual bool exists(const fs::path &path) const {
+        return archive_.exists(path);
+    }
+
+    virtual boost::optional<fs::path> findFile(const std::string &filename)
+        const
+    {
+        return archive_.findFile(filename);
+    }
+
+    virtual Files list() const { return archive_.list(); }
+
+    virtual Files list(const fs::path &prefix) const {
+        return archive_.list(prefix);
+    }
+
+    virtual Listing listDir(const fs::path &dir) const {
+        return archive_.listDir(dir);
+    }
+
+    virtual void forEach(const Entry::Callback &callback) const {
+        archive_.forEach(callback);
+    }
+
+    virtual void applyHint(const FileHint &hint) {
+        archive_.applyHint(hint);
+        usedHint_ = archive_.usedHint();
+    }
+
+    virtual const boost::optional<boost::filesystem::path>& usedHint() {
+        return usedHint_;
+    }
+
+    virtual bool changed() const { return parent_.changed(); }
+
+private:
+    RoArchive parent_;
+
+    /** Charge of materialized data.
+     */
+    MemoryCharge charge_;
+
+    /** Memory file, kept open for archive's lifetime.
+     */
+    Fd fd_;
+    RoArchive archive_;
+    boost::optional<boost::filesystem::path> usedHint_;
+};
+
+} // namespace
+
+RoArchive::dpointer RoArchive::nested(const RoArchive &parent
+                                      , const fs::path &path
+                                      , const OpenOptions &openOptions)
+{
+    const auto start(StatsCollector::Clock::now());
+    auto is(parent.istream(path));
+    const auto range(is->fileRange());
+    if (range && (range->fd < 0)) {
+        // plain file, factory() traces the open
+        return factory(range->path, flat(openOptions));
+    }
+
+    TraceSpan span(openOptions.observer, Observer::Event::open
+                   , parent.path() / path);
+    const auto opened([&](const char *backend, const dpointer &detail)
+                      -> dpointer
+    {
+        detail->stats().opened(backend, StatsCollector::Clock::now() - start);
+        detail->memory().backend(backend);
+        detail->observer(openOptions.observer);
+        return span(detail);
+    });
+
+    if (range) {
+        switch (sniff(*range)) {
+        case Format::tar:
+            return opened("tarball", tarball(parent, path, *range
+                                             , openOptions));
+        case Format::zip:
+            return opened("zip", zip(parent, path, *range, openOptions));
+        case Format::unknown: break;
+        }
+    }
+
+    // compressed or unknown format
+    return opened("nested", std::make_shared<Materialized>
+                  (parent, path, std::move(is), openOptions));
+}
+
+RoArchive::RoArchive(const RoArchive &parent, const fs::path &path)
+    : detail_(nested(parent, path, {}))
+{
+}
+
+RoArchive::RoArchive(const RoArchive &parent, const fs::path &path
+                     , const OpenOptions &openOptions)
+    : detail_(nested(parent, path, openOptions))
+{
+}
+
+} // namespace roarchive
@@ -0,0 +1,100 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef roarchive_observer_hpp_included_
+#define roarchive_observer_hpp_included_
+
+#include <chrono>
+#include <memory>
+
+#include <boost/filesystem/path.hpp>
+
+namespace roarchive {
+
+/** I/O tracing hook.
+ *
+ *  Registered via OpenOptions::setObserver(). Receives begin/end
+ *  notification of each traced event. Callbacks are called synchronously
+ *  from the thread doing the work and must be thread-safe.
+ */
+class Observer {
+public:
+    typedef std::shared_ptr<Observer> pointer;
+    typedef std::chrono::steady_clock Clock;
+
+    enum class Event {
+        /** Archive open (whole factory run).
+         */
+        open
+
+        /** Index construction (tarball, zip, HTTP manifest).
+         */
+        , indexBuild
+
+        /** Hint resolution.
+         */
+        , hintResolution
+
+        /** Opening of an entry (istream()).
+         */
+        , entryOpen
+
+        /** Reading of an entry (IStream::read(), copy()).
+         */
+        , entryRead
+    };
+
+    struct Info {
+        Event event;
+
+        /** Archive path for archive events, path inside archive for entry
+         *  events.
+         */
+        boost::filesystem::path path;
+
+        /** Number of bytes read (entryRead only).
+         */
+        std::size_t bytes;
+
+        /** Event duration, valid in end().
+         */
+        Clock::duration duration;
+
+        /** Event ended by an exception, valid in end().
+         */
+        bool failed;
+
+        Info(Event event) : event(event), bytes(), duration(), failed() {}
+    };
+
+    virtual ~Observer() {}
+
+    virtual void begin(const Info &info) = 0;
+    virtual void end(const Info &info) = 0;
+};
+
+} // namespace roarchive
+
+#endif // roarchive_observer_hpp_included_
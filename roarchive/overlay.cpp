@@ -0,0 +1,248 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <map>
+#include <limits>
+
+#include "dbglog/dbglog.hpp"
+
+#include "utility/cppversion.hpp"
+
+#include "detail.hpp"
+#include "pathindex.hpp"
+
+namespace fs = boost::filesystem;
+
+namespace roarchive {
+
+namespace {
+
+typedef std::vector<RoArchive> Layers;
+typedef std::uint16_t LayerIndex;
+
+/** Overlay of several archives. Layers go from bottom to top, file in upper
+ *  layer hides file with the same path in all lower layers.
+ *
+ *  All layers are indexed at open into single merged index mapping path to
+ *  topmost layer containing given path. If any layer cannot be listed
+ *  (e.g. HTTP without manifest) lookups fall back to probing layers from
+ *  top to bottom.
+ */
+class Overlay : public RoArchive::Detail {
+public:
+    Overlay(const Layers &layers)
+        : Detail(layers.empty() ? fs::path() : layers.back().path())
+        , layers_(layers), indexed_(false)
+    {
+        if (layers_.empty()) {
+            LOGTHROW(err2, Error)
+                << "Cannot create overlay archive without any layer.";
+        }
+
+        if (layers_.size() > std::numeric_limits<LayerIndex>::max()) {
+            LOGTHROW(err2, Error)
+                << "Too many layers in overlay archive.";
+        }
+
+        try {
+            // top to bottom: first added path wins
+            PathMap<LayerIndex>::Builder builder;
+            for (std::size_t i(layers_.size()); i--; ) {
+                layers_[i].forEach([&](const Entry &entry)
+                {
+                    builder.add(entry.path.string(), i);
+                });
+            }
+            files_ = builder.build();
+            indexed_ = true;
+
+            LOG(info1) << "Indexed " << files_.size() << " files in "
+                       << layers_.size() << " overlay layers ("
+                       << files_.memoryUsage() << " bytes).";
+            memory().chargeIndex(files_);
+        } catch (const NotImplemented &e) {
+            LOG(info1) << "Cannot index overlay layers (" << e.what()
+                       << "); files will be looked up layer by layer.";
+        }
+    }
+
+    virtual IStream::pointer istream(const fs::path &path
+                                     , const IStream::FilterInit &filterInit)
+        const
+    {
+        return layer(path).istream(path, filterInit);
+    }
+
+    virtual IStream::pointer istream(const fs::path &path
+                                     , std::size_t offset, std::size_t length
+                                     , const IStream::FilterInit &filterInit)
+        const
+    {
+        return layer(path).istream(path, offset, length, filterInit);
+    }
+
+    virtual bool exists(const fs::path &path) const {
+        return find(path);
+    }
+
+    virtual boost::optional<fs::path> findFile(const std::string &filename)
+        const
+    {
+        if (indexed_) { return files_.index().findFile(filename); }
+
+        for (auto ilayers(layers_.rbegin()), elayers(layers_.rend());
+             ilayers != elayers; ++ilayers)
+        {
+            if (auto path = ilayers->findFile(filename)) { return path; }
+        }
+        return boost::none;
+    }
+
+    virtual Files list() const {
+        checkIndexed();
+        return files_.index().list(PathIndex::root, PathIndex::root);
+    }
+
+    virtual Files list(const fs::path &prefix) const {
+        checkIndexed();
+        const auto &index(files_.index());
+        const auto dir(index.findDir(prefix.string()));
+        if (dir == PathIndex::none) { return {}; }
+        return index.list(dir, PathIndex::root);
+    }
+
+    virtual Listing listDir(const fs::path &path) const {
+        checkIndexed();
+        const auto &index(files_.index());
+        const auto dir(index.findDir(path.string()));
+        if (dir == PathIndex::none) { return {}; }
+        return index.listDir(dir);
+    }
+
+    /** Reports entries as seen by the layer that wins each path (with its
+     *  size and timestamp). Files are grouped by layer, bottom layer first.
+     */
+    virtual void forEach(const Entry::Callback &callback) const {
+        checkIndexed();
+        for (std::size_t l(0); l < layers_.size(); ++l) {
+            layers_[l].forEach([&](const Entry &entry)
+            {
+                const auto *layer(files_.find(entry.path.string()));
+                if (layer && (*layer == l)) { callback(entry); }
+            });
+        }
+    }
+
+    virtual void applyHint(const FileHint &hint) {
+        if (!hint) { return; }
+        LOGTHROW(err2, NotImplemented)
+            << "Overlay archive does not support hints; apply hint to "
+            "individual layers.";
+    }
+
+    virtual void prefetch(const Files &paths) const {
+        std::map<const RoArchive*, Files> perLayer;
+        for (const auto &path : paths) {
+            if (const auto *l = find(path)) { perLayer[l].push_back(path); }
+        }
+        for (const auto &item : perLayer) { item.first->prefetch(item.second); }
+    }
+
+    virtual bool changed() const {
+        for (const auto &layer : layers_) {
+            if (layer.changed()) { return true; }
+        }
+        return false;
+    }
+
+    virtual bool handlesSchema(const std::string &schema) const {
+        for (const auto &layer : layers_) {
+            if (layer.handlesSchema(schema)) { return true; }
+        }
+        return false;
+    }
+
+    virtual const boost::optional<boost::filesystem::path>& usedHint() {
+        return usedHint_;
+    }
+
+private:
+    /** Returns topmost layer containing given path, null if none.
+     */
+    const RoArchive* find(const fs::path &path) const {
+        if (indexed_) {
+            const auto *layer(files_.find(path.string()));
+            return layer ? &layers_[*layer] : nullptr;
+        }
+
+        for (auto ilayers(layers_.rbegin()), elayers(layers_.rend());
+             ilayers != elayers; ++ilayers)
+        {
+            if (ilayers->exists(path)) { return &*ilayers; }
+        }
+        return nullptr;
+    }
+
+    const RoArchive& layer(const fs::path &path) const {
+        const auto *layer(find(path));
+        if (!layer) {
+            LOGTHROW(err2, NoSuchFile)
+                << "File " << path << " not found in any layer of overlay "
+                "archive at " << path_ << ".";
+        }
+        return *layer;
+    }
+
+    void checkIndexed() const {
+        if (!indexed_) {
+            LOGTHROW(err2, NotImplemented)
+                << "Overlay list not implemented with unlistable layers.";
+        }
+    }
+
+    Layers layers_;
+    PathMap<LayerIndex> files_;
+    bool indexed_;
+    boost::optional<boost::filesystem::path> usedHint_;
+};
+
+} // namespace
+
+RoArchive::dpointer RoArchive::overlay(const std::vector<RoArchive> &layers
+                                       , const OpenOptions &openOptions)
+{
+    TraceSpan span(openOptions.observer, Observer::Event::indexBuild
+                   , layers.empty() ? fs::path() : layers.back().path());
+    const auto start(StatsCollector::Clock::now());
+
+    auto detail(std::make_shared<Overlay>(layers));
+    detail->stats().opened("overlay", StatsCollector::Clock::now() - start);
+    detail->memory().backend("overlay");
+    detail->observer(openOptions.observer);
+    return span(detail);
+}
+
+} // namespace roarchive
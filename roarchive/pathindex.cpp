@@ -0,0 +1,497 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <stdexcept>
+
+#include "dbglog/dbglog.hpp"
+
+#include "pathindex.hpp"
+#include "error.hpp"
+#include "io.hpp"
+
+namespace roarchive {
+
+constexpr PathIndex::Id PathIndex::none;
+constexpr PathIndex::Id PathIndex::root;
+
+namespace {
+
+/** Splits path into components, skipping empty and "." ones.
+ */
+std::vector<boost::string_ref> split(boost::string_ref path)
+{
+    std::vector<boost::string_ref> components;
+    while (!path.empty()) {
+        const auto slash(path.find('/'));
+        const auto component(path.substr(0, slash));
+        if (!component.empty() && (component != ".")) {
+            components.push_back(component);
+        }
+        if (slash == boost::string_ref::npos) { break; }
+        path.remove_prefix(slash + 1);
+    }
+    return components;
+}
+
+} // namespace
+
+PathIndex::PathIndex()
+    : data_(), dataSize_(), dirCount_(), dirs_(), files_(), arena_()
+    , fileCount_()
+{
+    std::vector<Dir> dirs(1, Dir());
+    dirs.front().parent = none;
+    dirs.front().firstChild = dirs.front().endChild = 1;
+    assign(dirs, {}, {});
+}
+
+PathIndex::PathIndex(const MemoryBlock::pointer &block, std::size_t offset
+                     , std::size_t size)
+    : data_(), dataSize_(), dirCount_(), dirs_(), files_(), arena_()
+    , fileCount_()
+{
+    Header header;
+    if ((offset % alignof(Header)) || (offset > block->size())
+        || (size > block->size() - offset) || (size < sizeof(header)))
+    {
+        LOGTHROW(err2, Error)
+            << "Malformed path index data: bad placement.";
+    }
+
+    const auto *data(block->data() + offset);
+    std::memcpy(&header, data, sizeof(header));
+    if (!header.dirs
+        || ((sizeof(header)
+             + std::uint64_t(header.dirs) * sizeof(Dir)
+             + std::uint64_t(header.files) * sizeof(File)
+             + header.arena) != size))
+    {
+        LOGTHROW(err2, Error)
+            << "Malformed path index data: bad size.";
+    }
+
+    view(block, data);
+
+    if (!valid()) {
+        LOGTHROW(err2, Error)
+            << "Malformed path index data: inconsistent records.";
+    }
+}
+
+void PathIndex::assign(const std::vector<Dir> &dirs
+                       , const std::vector<File> &files
+                       , const std::string &arena)
+{
+    // layout: header, dirs, files, arena; records are 4-byte aligned
+    Header header;
+    header.dirs = dirs.size();
+    header.files = files.size();
+    header.arena = arena.size();
+    header.reserved = 0;
+
+    const auto dirsSize(dirs.size() * sizeof(Dir));
+    const auto filesSize(files.size() * sizeof(File));
+
+    auto block(MemoryBlock::allocate(sizeof(header) + dirsSize + filesSize
+                                     + arena.size()));
+    auto *data(block->data());
+    std::memcpy(data, &header, sizeof(header));
+    data += sizeof(header);
+    std::memcpy(data, dirs.data(), dirsSize);
+    std::memcpy(data + dirsSize, files.data(), filesSize);
+    std::memcpy(data + dirsSize + filesSize, arena.data(), arena.size());
+    block->seal();
+
+    view(block, block->data());
+}
+
+void PathIndex::view(const MemoryBlock::pointer &block, const char *data)
+{
+    Header header;
+    std::memcpy(&header, data, sizeof(header));
+
+    const auto dirsSize(header.dirs * sizeof(Dir));
+    const auto filesSize(header.files * sizeof(File));
+
+    data_ = data;
+    dataSize_ = sizeof(header) + dirsSize + filesSize + header.arena;
+    data += sizeof(header);
+    dirs_ = reinterpret_cast<const Dir*>(data);
+    files_ = reinterpret_cast<const File*>(data + dirsSize);
+    arena_ = data + dirsSize + filesSize;
+    dirCount_ = header.dirs;
+    fileCount_ = header.files;
+    block_ = block;
+}
+
+bool PathIndex::valid() const
+{
+    const auto arenaSize(dataSize_ - (arena_ - data_));
+    const auto validName([&](const Name &n) {
+            return (n.offset <= arenaSize)
+                && (n.length <= arenaSize - n.offset);
+        });
+
+    if (dirs_[root].parent != none) { return false; }
+
+    for (Id d(0); d < dirCount_; ++d) {
+        const auto &dir(dirs_[d]);
+        if (!validName(dir)
+            || (d && (dir.parent >= d))
+            || (dir.firstChild <= d) || (dir.firstChild > dir.endChild)
+            || (dir.endChild > dirCount_)
+            || (dir.firstFile > dir.endFile) || (dir.endFile > fileCount_))
+        {
+            return false;
+        }
+    }
+
+    for (Id f(0); f < fileCount_; ++f) {
+        const auto &file(files_[f]);
+        if (!validName(file) || (file.dir >= dirCount_)) { return false; }
+    }
+
+    return true;
+}
+
+PathIndex::Id PathIndex::child(Id dir, boost::string_ref name) const
+{
+    const auto &d(dirs_[dir]);
+    auto lo(d.firstChild), hi(d.endChild);
+    while (lo < hi) {
+        const auto mid(lo + (hi - lo) / 2);
+        const auto cmp(this->name(dirs_[mid]).compare(name));
+        if (!cmp) { return mid; }
+        if (cmp < 0) { lo = mid + 1; } else { hi = mid; }
+    }
+    return none;
+}
+
+PathIndex::Id PathIndex::find(const std::string &path, Id base) const
+{
+    const auto components(split(path));
+    if (components.empty()) { return none; }
+
+    auto dir(base);
+    for (auto ic(components.begin()), ec(components.end() - 1);
+         ic != ec; ++ic)
+    {
+        if ((dir = child(dir, *ic)) == none) { return none; }
+    }
+
+    const auto &d(dirs_[dir]);
+    const auto &filename(components.back());
+    auto lo(d.firstFile), hi(d.endFile);
+    while (lo < hi) {
+        const auto mid(lo + (hi - lo) / 2);
+        const auto cmp(name(files_[mid]).compare(filename));
+        if (!cmp) { return mid; }
+        if (cmp < 0) { lo = mid + 1; } else { hi = mid; }
+    }
+    return none;
+}
+
+PathIndex::Id PathIndex::findDir(const std::string &path, Id base) const
+{
+    auto dir(base);
+    for (const auto &component : split(path)) {
+        if ((dir = child(dir, component)) == none) { return none; }
+    }
+    return dir;
+}
+
+std::string PathIndex::dirPath(Id dir, Id base) const
+{
+    std::vector<boost::string_ref> components;
+    for (; (dir != base) && (dir != root); dir = dirs_[dir].parent) {
+        components.push_back(name(dirs_[dir]));
+    }
+
+    std::string path;
+    for (auto ic(components.rbegin()), ec(components.rend()); ic != ec; ++ic)
+    {
+        if (!path.empty()) { path.push_back('/'); }
+        path.append(ic->data(), ic->size());
+    }
+    return path;
+}
+
+std::string PathIndex::path(Id file, Id base) const
+{
+    auto path(dirPath(files_[file].dir, base));
+    if (!path.empty()) { path.push_back('/'); }
+    const auto filename(name(files_[file]));
+    path.append(filename.data(), filename.size());
+    return path;
+}
+
+void PathIndex::forEach(Id dir, const std::function<void(Id)> &callback)
+    const
+{
+    const auto &d(dirs_[dir]);
+    for (auto file(d.firstFile); file != d.endFile; ++file) {
+        callback(file);
+    }
+    for (auto child(d.firstChild); child != d.endChild; ++child) {
+        forEach(child, callback);
+    }
+}
+
+Files PathIndex::list(Id dir, Id base) const
+{
+    Files list;
+    forEach(dir, [&](Id file) { list.push_back(path(file, base)); });
+    return list;
+}
+
+Listing PathIndex::listDir(Id dir) const
+{
+    Listing listing;
+    const auto &d(dirs_[dir]);
+
+    listing.files.reserve(d.endFile - d.firstFile);
+    for (auto file(d.firstFile); file != d.endFile; ++file) {
+        listing.files.emplace_back(name(files_[file]).to_string());
+    }
+
+    listing.directories.reserve(d.endChild - d.firstChild);
+    for (auto child(d.firstChild); child != d.endChild; ++child) {
+        listing.directories.emplace_back(name(dirs_[child]).to_string());
+    }
+
+    return listing;
+}
+
+boost::optional<boost::filesystem::path>
+PathIndex::findFile(const std::string &filename, Id base) const
+{
+    // files are ordered by depth
+    for (Id file(0), e(fileCount_); file != e; ++file) {
+        if ((name(files_[file]) == filename) && under(files_[file].dir, base))
+        {
+            return boost::filesystem::path(path(file, base));
+        }
+    }
+    return boost::none;
+}
+
+bool PathIndex::under(Id dir, Id base) const
+{
+    for (; dir != none; dir = dirs_[dir].parent) {
+        if (dir == base) { return true; }
+    }
+    return false;
+}
+
+std::size_t PathIndex::memoryUsage() const
+{
+    return sizeof(*this) + block_->memoryUsage();
+}
+
+PathIndex::Builder::Builder()
+    : dirs_(1, Dir()), added_(0)
+{
+    dirs_.front().parent = none;
+}
+
+PathIndex::Name PathIndex::Builder::intern(boost::string_ref name)
+{
+    // same names repeat a lot (e.g. tile file names in every directory)
+    std::string key(name.data(), name.size());
+    auto fnames(names_.find(key));
+    if (fnames != names_.end()) { return fnames->second; }
+
+    if ((arena_.size() + name.size())
+        > std::numeric_limits<std::uint32_t>::max())
+    {
+        LOGTHROW(err2, Error)
+            << "Too many paths in archive index.";
+    }
+
+    Name n;
+    n.offset = arena_.size();
+    n.length = name.size();
+    arena_.append(name.data(), name.size());
+    names_.insert(std::make_pair(std::move(key), n));
+    return n;
+}
+
+void PathIndex::Builder::add(const std::string &path)
+{
+    const auto order(added_++);
+    const auto components(split(path));
+    if (components.empty()) { return; }
+
+    Id dir(root);
+    std::string key;
+    for (auto ic(components.begin()), ec(components.end() - 1);
+         ic != ec; ++ic)
+    {
+        key.assign(reinterpret_cast<const char*>(&dir), sizeof(dir));
+        key.append(ic->data(), ic->size());
+
+        auto fdirMap(dirMap_.find(key));
+        if (fdirMap != dirMap_.end()) {
+            dir = fdirMap->second;
+            continue;
+        }
+
+        if (dirs_.size() >= none) {
+            LOGTHROW(err2, Error)
+                << "Too many directories in archive index.";
+        }
+
+        Dir d;
+        static_cast<Name&>(d) = intern(*ic);
+        d.parent = dir;
+        dir = dirs_.size();
+        dirs_.push_back(d);
+        dirMap_.insert(std::make_pair(key, dir));
+    }
+
+    if (files_.size() >= none) {
+        LOGTHROW(err2, Error)
+            << "Too many files in archive index.";
+    }
+
+    File f;
+    static_cast<Name&>(f) = intern(components.back());
+    f.dir = dir;
+    f.order = order;
+    files_.push_back(f);
+}
+
+PathIndex PathIndex::Builder::build(std::vector<std::size_t> &order)
+{
+    std::vector<PathIndex::Dir> dirs;
+    std::vector<PathIndex::File> files;
+    const auto nameOf([this](const Name &n) -> boost::string_ref {
+            return { arena_.data() + n.offset, n.length };
+        });
+
+    // number directories breadth-first, children sorted by name
+    std::vector<std::vector<Id>> children(dirs_.size());
+    for (Id d(1); d < dirs_.size(); ++d) {
+        children[dirs_[d].parent].push_back(d);
+    }
+    dirMap_.clear();
+    names_.clear();
+
+    std::vector<Id> bfs(1, root);
+    std::vector<Id> newId(dirs_.size(), none);
+    newId[root] = root;
+
+    dirs.resize(dirs_.size());
+    for (std::size_t i(0); i < bfs.size(); ++i) {
+        auto &ch(children[bfs[i]]);
+        std::sort(ch.begin(), ch.end(), [&](Id l, Id r) {
+                return nameOf(dirs_[l]) < nameOf(dirs_[r]);
+            });
+
+        auto &d(dirs[i]);
+        static_cast<Name&>(d) = dirs_[bfs[i]];
+        d.parent = i ? newId[dirs_[bfs[i]].parent] : none;
+        d.firstChild = bfs.size();
+        for (auto c : ch) {
+            newId[c] = bfs.size();
+            bfs.push_back(c);
+        }
+        d.endChild = bfs.size();
+        d.firstFile = d.endFile = 0;
+        ch = std::vector<Id>();
+    }
+
+    // sort files by (directory, name), keep first of duplicates
+    for (auto &f : files_) { f.dir = newId[f.dir]; }
+    std::stable_sort(files_.begin(), files_.end()
+                     , [&](const File &l, const File &r) -> bool
+    {
+        if (l.dir != r.dir) { return l.dir < r.dir; }
+        return nameOf(l) < nameOf(r);
+    });
+    files_.erase(std::unique(files_.begin(), files_.end()
+                             , [&](const File &l, const File &r)
+    {
+        return (l.dir == r.dir) && (nameOf(l) == nameOf(r));
+    }), files_.end());
+
+    order.clear();
+    order.reserve(files_.size());
+    files.reserve(files_.size());
+    for (const auto &f : files_) {
+        const Id id(files.size());
+        auto &d(dirs[f.dir]);
+        if (d.firstFile == d.endFile) { d.firstFile = id; }
+        d.endFile = id + 1;
+
+        files.emplace_back();
+        auto &file(files.back());
+        static_cast<Name&>(file) = f;
+        file.dir = f.dir;
+        order.push_back(f.order);
+    }
+
+    PathIndex index;
+    index.assign(dirs, files, arena_);
+
+    // reset builder
+    *this = Builder();
+
+    return index;
+}
+
+HintedPath findPrefix(const boost::filesystem::path &path
+                      , const FileHint &hint, const PathIndex &index
+                      , const Observer::pointer &observer
+                      , const char *archive)
+{
+    if (!hint) { return {}; }
+
+    TraceSpan span(observer, Observer::Event::hintResolution, path);
+
+    // match all files, index is ordered by depth
+    FileHint::Matcher matcher(hint);
+    for (PathIndex::Id id(0); id < index.size(); ++id) {
+        const boost::filesystem::path file(index.path(id));
+        if (matcher(file)) {
+            return span(HintedPath(file.parent_path(), file.filename()));
+        }
+    }
+
+    if (!matcher) {
+        LOGTHROW(err2, std::runtime_error)
+            << "No \"" << hint << "\" found in the " << archive << " at "
+            << path << ".";
+    }
+
+    return span(HintedPath(matcher.match().parent_path()
+                           , matcher.match().filename()));
+}
+
+} // namespace roarchive
@@ -0,0 +1,452 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef roarchive_pathindex_hpp_included_
+#define roarchive_pathindex_hpp_included_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <cstring>
+#include <type_traits>
+
+#include <boost/optional.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include "dbglog/dbglog.hpp"
+
+#include "roarchive.hpp"
+#include "error.hpp"
+#include "memoryaccount.hpp"
+#include "detail.hpp"
+
+namespace roarchive {
+
+/** Compact read-only index of file paths inside an archive.
+ *
+ *  Paths are split into directories and file names. Every distinct name (of
+ *  directory or file) is stored only once in a single string arena;
+ *  directories and files are plain fixed-size records referring to the arena
+ *  by offset. Nothing in the index is a pointer.
+ *
+ *  Directories are numbered breadth-first, children of every directory form
+ *  a contiguous range sorted by name. Files are sorted by (directory, name).
+ *  Therefore file IDs go by non-decreasing depth and lookup is a binary
+ *  search per path component.
+ *
+ *  All records and the arena live in single self-describing memory block
+ *  (header, dirs, files, arena) which is spilled to disk when the process is
+ *  over memory budget. Copies share the block. Since the block is
+ *  relocatable it can be stored in a file and mapped by other processes.
+ *
+ *  Paths are normalized: empty and "." components are ignored.
+ */
+class PathIndex {
+public:
+    typedef std::uint32_t Id;
+
+    /** Invalid ID.
+     */
+    static constexpr Id none = Id(-1);
+
+    /** Root directory ID.
+     */
+    static constexpr Id root = 0;
+
+    class Builder;
+
+    PathIndex();
+
+    /** Creates index viewing serialized index data (see data()) at given
+     *  offset in given block. Throws Error if data are malformed.
+     */
+    PathIndex(const MemoryBlock::pointer &block, std::size_t offset
+              , std::size_t size);
+
+    /** Finds file at given path (relative to given directory).
+     *  Returns none if not found.
+     */
+    Id find(const std::string &path, Id base = root) const;
+
+    /** Finds directory at given path (relative to given directory).
+     *  Returns none if not found.
+     */
+    Id findDir(const std::string &path, Id base = root) const;
+
+    /** Number of files.
+     */
+    std::size_t size() const { return fileCount_; }
+
+    /** Full path of given file relative to given directory. The file must
+     *  reside under the directory.
+     */
+    std::string path(Id file, Id base = root) const;
+
+    /** Path of given directory relative to given base directory.
+     */
+    std::string dirPath(Id dir, Id base = root) const;
+
+    /** File name.
+     */
+    boost::string_ref name(Id file) const { return name(files_[file]); }
+
+    /** Directory containing given file.
+     */
+    Id parent(Id file) const { return files_[file].dir; }
+
+    /** Calls callback(file) for every file in given directory's subtree.
+     */
+    void forEach(Id dir, const std::function<void(Id)> &callback) const;
+
+    /** Lists all files in given directory's subtree. Paths are relative to
+     *  base directory, which must be the directory or one of its ancestors.
+     */
+    Files list(Id dir, Id base) const;
+
+    /** Lists content of given directory.
+     */
+    Listing listDir(Id dir) const;
+
+    /** Finds shallowest file with given name in base directory's subtree.
+     *  Returned path is relative to base directory.
+     */
+    boost::optional<boost::filesystem::path>
+    findFile(const std::string &filename, Id base = root) const;
+
+    /** Checks whether directory lies in base directory's subtree.
+     */
+    bool under(Id dir, Id base) const;
+
+    /** Approximate heap memory occupied by the index.
+     */
+    std::size_t memoryUsage() const;
+
+    /** Size of index data spilled to disk.
+     */
+    std::size_t spilledSize() const { return block_->spilledSize(); }
+
+    /** Size of index data shared with other processes.
+     */
+    std::size_t sharedSize() const {
+        return block_->sharedSize() ? dataSize_ : 0;
+    }
+
+    /** Serialized index data.
+     */
+    const char* data() const { return data_; }
+    std::size_t dataSize() const { return dataSize_; }
+
+private:
+    struct Header {
+        std::uint32_t dirs;
+        std::uint32_t files;
+        std::uint32_t arena;
+        std::uint32_t reserved;
+    };
+
+    struct Name {
+        std::uint32_t offset;
+        std::uint32_t length;
+    };
+
+    struct Dir : Name {
+        Id parent;
+        Id firstChild;
+        Id endChild;
+        Id firstFile;
+        Id endFile;
+    };
+
+    struct File : Name {
+        Id dir;
+    };
+
+    boost::string_ref name(const Name &n) const {
+        return { arena_ + n.offset, n.length };
+    }
+
+    Id child(Id dir, boost::string_ref name) const;
+
+    /** Packs records and arena into new memory block.
+     */
+    void assign(const std::vector<Dir> &dirs, const std::vector<File> &files
+                , const std::string &arena);
+
+    /** Sets record pointers to index data in block.
+     */
+    void view(const MemoryBlock::pointer &block, const char *data);
+
+    /** Checks record consistency.
+     */
+    bool valid() const;
+
+    MemoryBlock::pointer block_;
+    const char *data_;
+    std::size_t dataSize_;
+    Id dirCount_;
+    const Dir *dirs_;
+    const File *files_;
+    const char *arena_;
+    Id fileCount_;
+};
+
+/** Collects paths and builds the index.
+ */
+class PathIndex::Builder {
+public:
+    Builder();
+
+    /** Adds file at given path. Files without any path component are
+     *  ignored.
+     */
+    void add(const std::string &path);
+
+    /** Builds the index. Builder is emptied.
+     *
+     *  order[id] is set to index of add() call that added file with given
+     *  ID. When the same path is added more than once only the first one
+     *  is kept.
+     */
+    PathIndex build(std::vector<std::size_t> &order);
+
+private:
+    struct Dir : Name {
+        Id parent;
+    };
+
+    struct File : Name {
+        Id dir;
+        std::size_t order;
+    };
+
+    Name intern(boost::string_ref name);
+
+    std::string arena_;
+    std::vector<Dir> dirs_;
+    std::vector<File> files_;
+    std::size_t added_;
+
+    /** (parent, name) -> directory
+     */
+    std::unordered_map<std::string, Id> dirMap_;
+
+    /** name -> its location in the arena
+     */
+    std::unordered_map<std::string, Name> names_;
+};
+
+/** Resolves file hint against archive's index: finds the shallowest file
+ *  matching the hint. Returns path of its directory (archive prefix) and the
+ *  matched file name; empty path if there is no hint. Throws if nothing
+ *  matches.
+ *
+ *  \param path archive path, for tracing and error reporting
+ *  \param archive archive kind used in error message (e.g. "zip archive")
+ */
+HintedPath findPrefix(const boost::filesystem::path &path
+                      , const FileHint &hint, const PathIndex &index
+                      , const Observer::pointer &observer
+                      , const char *archive);
+
+/** Values of path map: plain vector.
+ */
+template <typename Value
+          , bool Trivial = std::is_trivially_copyable<Value>::value>
+class PathMapValues {
+public:
+    void assign(std::vector<Value> &&values) {
+        values_ = std::move(values);
+        values_.shrink_to_fit();
+    }
+
+    const Value& operator[](std::size_t index) const {
+        return values_[index];
+    }
+
+    std::size_t size() const { return values_.size(); }
+
+    std::size_t memoryUsage() const {
+        return values_.capacity() * sizeof(Value);
+    }
+
+    std::size_t spilledSize() const { return 0; }
+
+    std::size_t sharedSize() const { return 0; }
+
+private:
+    std::vector<Value> values_;
+};
+
+/** Values of path map: trivially copyable values are kept in a memory block
+ *  that can be spilled to disk, same as the index itself.
+ */
+template <typename Value>
+class PathMapValues<Value, true> {
+public:
+    PathMapValues() : values_(), size_() {}
+
+    void assign(std::vector<Value> &&values) {
+        auto block(MemoryBlock::allocate(values.size() * sizeof(Value)));
+        std::memcpy(block->data(), values.data()
+                    , values.size() * sizeof(Value));
+        block->seal();
+        values_ = reinterpret_cast<const Value*>(block->data());
+        size_ = values.size();
+        block_ = block;
+        values = std::vector<Value>();
+    }
+
+    /** Views size values at given offset in given block.
+     */
+    void assign(const MemoryBlock::pointer &block, std::size_t offset
+                , std::size_t size)
+    {
+        values_ = reinterpret_cast<const Value*>(block->data() + offset);
+        size_ = size;
+        block_ = block;
+    }
+
+    const Value& operator[](std::size_t index) const {
+        return values_[index];
+    }
+
+    std::size_t size() const { return size_; }
+
+    const Value* data() const { return values_; }
+
+    std::size_t memoryUsage() const {
+        return block_ ? block_->memoryUsage() : 0;
+    }
+
+    std::size_t spilledSize() const {
+        return block_ ? block_->spilledSize() : 0;
+    }
+
+    /** Only viewed part of shared block.
+     */
+    std::size_t sharedSize() const {
+        return (block_ && block_->sharedSize()) ? size_ * sizeof(Value) : 0;
+    }
+
+private:
+    MemoryBlock::pointer block_;
+    const Value *values_;
+    std::size_t size_;
+};
+
+/** Path index with value attached to every file.
+ */
+template <typename Value>
+class PathMap {
+public:
+    typedef PathIndex::Id Id;
+
+    class Builder {
+    public:
+        void add(const std::string &path, const Value &value) {
+            paths_.add(path);
+            values_.push_back(value);
+        }
+
+        PathMap build() {
+            PathMap map;
+            std::vector<std::size_t> order;
+            map.index_ = paths_.build(order);
+            std::vector<Value> values;
+            values.reserve(order.size());
+            for (auto i : order) { values.push_back(values_[i]); }
+            values_ = std::vector<Value>();
+            map.values_.assign(std::move(values));
+            return map;
+        }
+
+    private:
+        PathIndex::Builder paths_;
+        std::vector<Value> values_;
+    };
+
+    /** Creates map viewing serialized index (see PathIndex::data()) and
+     *  values stored in given block. Values must be suitably aligned.
+     */
+    static PathMap view(const MemoryBlock::pointer &block
+                        , std::size_t indexOffset, std::size_t indexSize
+                        , std::size_t valuesOffset)
+    {
+        static_assert(std::is_trivially_copyable<Value>::value
+                      , "Only trivially copyable values can be viewed.");
+        PathMap map;
+        map.index_ = PathIndex(block, indexOffset, indexSize);
+        const auto size(map.index_.size());
+        if ((valuesOffset % alignof(Value))
+            || (valuesOffset > block->size())
+            || ((block->size() - valuesOffset) / sizeof(Value) < size))
+        {
+            LOGTHROW(err2, Error)
+                << "Malformed path map values.";
+        }
+        map.values_.assign(block, valuesOffset, size);
+        return map;
+    }
+
+    const PathIndex& index() const { return index_; }
+
+    const PathMapValues<Value>& values() const { return values_; }
+
+    /** Returns value of file at given path (relative to given directory),
+     *  null if not found.
+     */
+    const Value* find(const std::string &path
+                      , Id base = PathIndex::root) const
+    {
+        const auto id(index_.find(path, base));
+        return (id == PathIndex::none) ? nullptr : &values_[id];
+    }
+
+    const Value& value(Id file) const { return values_[file]; }
+
+    std::size_t size() const { return values_.size(); }
+
+    std::size_t memoryUsage() const {
+        return index_.memoryUsage() + values_.memoryUsage();
+    }
+
+    std::size_t spilledSize() const {
+        return index_.spilledSize() + values_.spilledSize();
+    }
+
+    std::size_t sharedSize() const {
+        return index_.sharedSize() + values_.sharedSize();
+    }
+
+private:
+    PathIndex index_;
+    PathMapValues<Value> values_;
+};
+
+} // namespace roarchive
+
+#endif // roarchive_pathindex_hpp_included_
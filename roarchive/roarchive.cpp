@@ -24,20 +24,37 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
+#include <cerrno>
+#include <cstring>
 #include <limits>
+#include <system_error>
+#include <tuple>
+#include <set>
+#include <iterator>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 
 #include <boost/iostreams/copy.hpp>
 
 #include "dbglog/dbglog.hpp"
 
+#include "utility/cppversion.hpp"
 #include "utility/magic.hpp"
 #include "utility/binaryio.hpp"
 #include "utility/streams.hpp"
 #include "utility/uri.hpp"
+#include "utility/path.hpp"
 
 #include "roarchive.hpp"
 #include "detail.hpp"
 #include "error.hpp"
+#include "decompress.hpp"
 
 namespace fs = boost::filesystem;
 namespace bio = boost::iostreams;
@@ -47,6 +64,12 @@ namespace roarchive {
 RoArchive::dpointer
 RoArchive::factory(fs::path path, OpenOptions openOptions)
 {
+    if (openOptions.lazy) {
+        // everything (including inline hint split) is deferred
+        openOptions.lazy = false;
+        return lazy(path, openOptions);
+    }
+
     if (openOptions.inlineHint) {
         // check for inline hint
         const auto str(path.string());
@@ -58,6 +81,33 @@ RoArchive::factory(fs::path path, OpenOptions openOptions)
         }
     }
 
+    if (openOptions.nestedSeparator) {
+        // nested archive: open parent and then file inside it as an archive
+        const auto str(path.string());
+        auto split(str.rfind(openOptions.nestedSeparator));
+        if (split != std::string::npos) {
+            auto parentOptions(openOptions);
+            parentOptions.hint = FileHint();
+            parentOptions.inlineHint = 0;
+            parentOptions.mime.clear();
+            const RoArchive parent(str.substr(0, split), parentOptions);
+
+            // traced by nested() itself
+            return nested(parent, str.substr(split + 1), openOptions);
+        }
+    }
+
+    TraceSpan span(openOptions.observer, Observer::Event::open, path);
+    const auto start(StatsCollector::Clock::now());
+    const auto opened([&](const char *backend, const dpointer &detail)
+                      -> dpointer
+    {
+        detail->stats().opened(backend, StatsCollector::Clock::now() - start);
+        detail->memory().backend(backend);
+        detail->observer(openOptions.observer);
+        return span(detail);
+    });
+
     if (openOptions.mime.empty()) {
         // special handling for URL
         try {
@@ -73,11 +123,17 @@ RoArchive::factory(fs::path path, OpenOptions openOptions)
                      ? utility::Magic().mime(path)
                      : openOptions.mime);
 
-    if (magic == "inode/directory") { return directory(path, openOptions); }
-    if (magic == "application/x-tar") { return tarball(path, openOptions); }
-    if (magic == "application/zip") { return zip(path, openOptions); }
+    if (magic == "inode/directory") {
+        return opened("directory", directory(path, openOptions));
+    }
+    if (magic == "application/x-tar") {
+        return opened("tarball", tarball(path, openOptions));
+    }
+    if (magic == "application/zip") {
+        return opened("zip", zip(path, openOptions));
+    }
 #ifdef ROARCHIVE_HAS_HTTP
-    if (magic == "http") { return http(path, openOptions); }
+    if (magic == "http") { return opened("http", http(path, openOptions)); }
 #endif
 
     LOGTHROW(err2, NotAnArchive)
@@ -87,21 +143,18 @@ RoArchive::factory(fs::path path, OpenOptions openOptions)
 
 RoArchive::RoArchive(const fs::path &path)
     : detail_(factory(path, {}))
-    , directio_(detail_->directio())
 {
 }
 
 RoArchive::RoArchive(const fs::path &path
                      , const OpenOptions &openOptions)
     : detail_(factory(path, openOptions))
-    , directio_(detail_->directio())
 {
 }
 
 RoArchive::RoArchive(const fs::path &path, const FileHint &hint
                      , const std::string &mime)
     : detail_(factory(path, OpenOptions().setHint(hint).setMime(mime)))
-    , directio_(detail_->directio())
 {
 }
 
@@ -110,42 +163,207 @@ RoArchive::RoArchive(const fs::path &path, std::size_t limit
     : detail_(factory(path, OpenOptions().setFileLimit(limit)
                       .setHint(hint)
                       .setMime(mime)))
-    , directio_(detail_->directio())
 {}
 
+RoArchive::RoArchive(const std::vector<RoArchive> &layers)
+    : detail_(overlay(layers, {}))
+{
+}
+
+RoArchive::RoArchive(const std::vector<RoArchive> &layers
+                     , const OpenOptions &openOptions)
+    : detail_(overlay(layers, openOptions))
+{
+}
+
+std::vector<RoArchive::Opened>
+RoArchive::openMany(const std::vector<fs::path> &paths
+                    , const OpenOptions &openOptions, std::size_t threads)
+{
+    std::vector<Opened> opened(paths.size());
+    if (!threads) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min(threads, paths.size());
+
+    std::atomic<std::size_t> next(0);
+    const auto worker([&]()
+    {
+        for (std::size_t index; (index = next++) < paths.size(); ) {
+            auto &result(opened[index]);
+            result.path = paths[index];
+            try {
+                result.archive = RoArchive(result.path, openOptions);
+            } catch (const std::exception &e) {
+                LOG(warn2) << "Failed to open archive " << result.path
+                           << ": " << e.what();
+                result.error = std::current_exception();
+            } catch (...) {
+                result.error = std::current_exception();
+            }
+        }
+    });
+
+    if (threads <= 1) {
+        worker();
+        return opened;
+    }
+
+    std::vector<std::thread> workers;
+    for (std::size_t i(0); i < threads; ++i) { workers.emplace_back(worker); }
+    for (auto &w : workers) { w.join(); }
+
+    return opened;
+}
+
+std::vector<RoArchive::Opened>
+RoArchive::openMany(const std::vector<fs::path> &paths, std::size_t threads)
+{
+    return openMany(paths, OpenOptions(), threads);
+}
+
 IStream::pointer RoArchive::istream(const fs::path &path) const
 {
-    auto is(detail_->istream(path));
-    // set exceptions
-    is->get().exceptions(std::ios::badbit | std::ios::failbit);
+    return istream(path, {});
+}
 
-    return is;
+IStream::pointer RoArchive::istream(const fs::path &path
+                                    , const IStream::FilterInit &filterInit)
+    const
+{
+    TraceSpan span(detail().observer(), Observer::Event::entryOpen, path);
+    StatsCollector::Timer timer(detail().stats(), Stats::Operation::istream);
+    return setup(span(timer(detail().istream(path, filterInit))));
 }
 
 IStream::pointer RoArchive::istream(const fs::path &path
+                                    , std::size_t offset, std::size_t length
                                     , const IStream::FilterInit &filterInit)
     const
 {
-    auto is(detail_->istream(path, filterInit));
+    TraceSpan span(detail().observer(), Observer::Event::entryOpen, path);
+    StatsCollector::Timer timer(detail().stats(), Stats::Operation::istream);
+    return setup(span(timer(detail().istream
+                            (path, offset, length, filterInit))));
+}
+
+IStream::pointer RoArchive::setup(IStream::pointer &&is) const
+{
     // set exceptions
     is->get().exceptions(std::ios::badbit | std::ios::failbit);
-    return is;
+    is->stats_ = detail().statsPointer();
+    is->observer_ = detail().observer();
+    return std::move(is);
+}
+
+namespace {
+
+/** Source reading at most given number of bytes from another stream.
+ */
+class LimitedSource {
+public:
+    typedef char char_type;
+    typedef bio::source_tag category;
+
+    LimitedSource(std::istream &is, std::size_t left)
+        : is_(&is), left_(left)
+    {}
+
+    std::streamsize read(char *data, std::streamsize size) {
+        if (!left_) { return -1; }
+        const auto got(is_->rdbuf()->sgetn
+                       (data, std::min<std::size_t>(size, left_)));
+        if (got <= 0) { return -1; }
+        left_ -= got;
+        return got;
+    }
+
+private:
+    std::istream *is_;
+    std::size_t left_;
+};
+
+/** Byte range of another (whole file) stream.
+ */
+class RangeIStream : public IStream {
+public:
+    RangeIStream(IStream::pointer &&whole, std::size_t offset
+                 , std::size_t length
+                 , const IStream::FilterInit &filterInit)
+        : IStream(filterInit), whole_(std::move(whole))
+        , start_(offset)
+        , end_(offset + std::min(length, std::numeric_limits<std::size_t>::max()
+                                 - offset))
+    {
+        if (const auto size = whole_->size()) {
+            std::tie(start_, end_) = clipRange(*size, offset, length);
+        }
+
+        auto &is(whole_->get());
+        if (whole_->seekable()) {
+            is.seekg(start_);
+        } else {
+            // decompress and skip
+            is.ignore(start_);
+        }
+
+        fis_.push(LimitedSource(is, end_ - start_));
+
+        if (whole_->size()) {
+            update(end_ - start_, false);
+        } else {
+            update(boost::none, false);
+        }
+    }
+
+    virtual fs::path path() const { return whole_->path(); }
+    virtual fs::path index() const { return whole_->index(); }
+    virtual void close() { whole_->close(); }
+
+protected:
+    virtual boost::optional<FileRange> range() const {
+        auto fr(whole_->fileRange());
+        if (!fr) { return boost::none; }
+        const auto r(clipRange(fr->size(), start_, end_ - start_));
+        fr->end = fr->start + r.second;
+        fr->start += r.first;
+        return fr;
+    }
+
+private:
+    IStream::pointer whole_;
+    std::size_t start_;
+    std::size_t end_;
+};
+
+} // namespace
+
+IStream::pointer
+RoArchive::Detail::istream(const fs::path &path
+                           , std::size_t offset, std::size_t length
+                           , const IStream::FilterInit &filterInit) const
+{
+    return std::make_unique<RangeIStream>
+        (istream(path, {}), offset, length, filterInit);
 }
 
 bool RoArchive::exists(const fs::path &path) const
 {
-    return detail_->exists(path);
+    StatsCollector::Timer timer(detail().stats(), Stats::Operation::exists);
+    return timer(detail().exists(path));
 }
 
 boost::optional<fs::path> RoArchive::findFile(const std::string &filename)
     const
 {
-    return detail_->findFile(filename);
+    StatsCollector::Timer timer(detail().stats(), Stats::Operation::findFile);
+    return timer(detail().findFile(filename));
 }
 
 fs::path RoArchive::path() const
 {
-    return detail().path();
+    // lazily opened archive knows its path before open
+    return detail_->path();
 }
 
 fs::path RoArchive::path(const fs::path &path) const
@@ -155,36 +373,119 @@ fs::path RoArchive::path(const fs::path &path) const
 
 std::vector<char> IStream::read()
 {
+    TraceSpan span(observer_, Observer::Event::entryRead
+                   , observer_ ? index() : fs::path());
     auto &s(get());
+    std::vector<char> buf;
     if (size_) {
         // we know the size of the file
-        std::vector<char> buf;
         buf.resize(*size_);
         utility::binaryio::read(s, buf.data(), buf.size());
-        return buf;
     } else if (seekable_) {
         // we can measure the file
-        std::vector<char> buf;
         buf.resize(s.seekg(0, std::ios_base::end).tellg());
         s.seekg(0);
         utility::binaryio::read(s, buf.data(), buf.size());
-        return buf;
+    } else {
+        // we need to use the old way
+        std::ostringstream os;
+        bio::copy(s, os);
+        const auto &str(os.str());
+        buf.assign(str.data(), str.data() + str.size());
     }
 
-    // we need to use the old way
-    std::ostringstream os;
-    bio::copy(s, os);
-    const auto &str(os.str());
-    return { str.data(), str.data() + str.size() };
+    if (stats_) { stats_->read(buf.size(), stacked_); }
+    span.bytes(buf.size());
+    return span(std::move(buf));
+}
+
+std::vector<char> IStream::read(Decompress decompress)
+{
+    auto data(read());
+    if (decompress == Decompress::none) { return data; }
+    return roarchive::decompress(std::move(data), decompress, index());
 }
 
 Files RoArchive::list() const
 {
-    return detail_->list();
+    StatsCollector::Timer timer(detail().stats(), Stats::Operation::list);
+    return timer(detail().list());
+}
+
+Files RoArchive::list(const fs::path &prefix) const
+{
+    StatsCollector::Timer timer(detail().stats(), Stats::Operation::list);
+    return timer(detail().list(prefix));
+}
+
+void RoArchive::forEach(const Entry::Callback &callback) const
+{
+    StatsCollector::Timer timer(detail().stats(), Stats::Operation::list);
+    detail().forEach(callback);
+    timer.done();
+}
+
+Listing RoArchive::listDir(const fs::path &dir) const
+{
+    StatsCollector::Timer timer(detail().stats(), Stats::Operation::list);
+    return timer(detail().listDir(dir));
+}
+
+Files RoArchive::Detail::list(const fs::path &prefix) const
+{
+    if (prefix.empty()) { return list(); }
+
+    Files list;
+    for (const auto &path : this->list()) {
+        if (utility::isPathPrefix(path, prefix) && (path != prefix)) {
+            list.push_back(path);
+        }
+    }
+    return list;
+}
+
+void RoArchive::Detail::forEach(const Entry::Callback &callback) const
+{
+    Entry entry;
+    for (const auto &path : list()) {
+        entry.path = path;
+        callback(entry);
+    }
+}
+
+Listing RoArchive::Detail::listDir(const fs::path &dir) const
+{
+    std::set<fs::path> files;
+    std::set<fs::path> directories;
+
+    for (const auto &path : list(dir)) {
+        const auto local(utility::cutPathPrefix(path, dir));
+        auto ilocal(local.begin());
+        if (ilocal == local.end()) { continue; }
+        if (std::next(ilocal) == local.end()) {
+            files.insert(*ilocal);
+        } else {
+            directories.insert(*ilocal);
+        }
+    }
+
+    // directory backend lists directories as well
+    for (const auto &directory : directories) { files.erase(directory); }
+
+    Listing listing;
+    listing.files.assign(files.begin(), files.end());
+    listing.directories.assign(directories.begin(), directories.end());
+    return listing;
+}
+
+void RoArchive::prefetch(const Files &paths) const
+{
+    detail().prefetch(paths);
 }
 
 RoArchive& RoArchive::applyHint(const FileHint &hint)
 {
+    // lazily opened archive applies the hint at open
     detail_->applyHint(hint);
     return *this;
 }
@@ -197,13 +498,14 @@ bool RoArchive::Detail::changed() const
 
 bool RoArchive::changed() const
 {
+    // lazily opened archive checks only its path until opened
     return detail_->changed();
 }
 
 
 boost::optional<boost::filesystem::path> RoArchive::usedHint() const
 {
-    return detail_->usedHint();
+    return detail_->resolve().usedHint();
 }
 
 bool RoArchive::handlesSchema(const std::string &schema) const
@@ -211,16 +513,192 @@ bool RoArchive::handlesSchema(const std::string &schema) const
     return detail_->handlesSchema(schema);
 }
 
+Stats RoArchive::stats() const
+{
+    // do not open lazily opened archive just to report nothing
+    if (!detail_->resolved()) { return {}; }
+    return detail().stats().stats();
+}
+
+MemoryUsage RoArchive::memoryUsage() const
+{
+    if (!detail_->resolved()) { return {}; }
+    return detail().memory().usage();
+}
+
+bool RoArchive::directio() const
+{
+    return detail().directio();
+}
+
+RoArchive::Detail& RoArchive::detail()
+{
+    return detail_->resolve();
+}
+
+const RoArchive::Detail& RoArchive::detail() const
+{
+    return detail_->resolve();
+}
+
 void copy(const IStream::pointer &in, std::ostream &out)
 {
-    bio::copy(in->get(), out);
+    TraceSpan span(in->observer_, Observer::Event::entryRead
+                   , in->observer_ ? in->index() : fs::path());
+    const auto size(bio::copy(in->get(), out));
+    if (in->stats_) { in->stats_->read(size, in->stacked_); }
+    span.bytes(size);
+    span.done();
+}
+
+namespace {
+
+/** Closes owned file descriptor.
+ */
+struct FdHolder {
+    int fd;
+    FdHolder(int fd = -1) : fd(fd) {}
+    ~FdHolder() { if (fd >= 0) { ::close(fd); } }
+};
+
+void writeAll(int fd, const char *data, std::size_t size)
+{
+    while (size) {
+        const auto written(::write(fd, data, size));
+        if (written < 0) {
+            if (errno == EINTR) { continue; }
+            std::system_error e(errno, std::system_category());
+            LOGTHROW(err2, IOError) << "Write failed: <" << e.what() << ">.";
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+/** Copies file range to output file descriptor via kernel.
+ */
+void copyRange(const FileRange &range, int out)
+{
+    FdHolder holder;
+    int src(range.fd);
+    if (src < 0) {
+        src = holder.fd = ::open(range.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (src < 0) {
+            std::system_error e(errno, std::system_category());
+            LOGTHROW(err2, IOError)
+                << "Cannot open file " << range.path << ": <"
+                << e.what() << ">.";
+        }
+    }
+
+    // explicit source offset: shared descriptor's file offset is untouched
+    loff_t offset(range.start);
+    std::size_t remaining(range.size());
+
+#ifdef SYS_copy_file_range
+    bool copyFileRange(true);
+#else
+    bool copyFileRange(false);
+#endif
+    bool sendFile(true);
+
+    while (remaining) {
+        ssize_t copied(-1);
+
+        if (copyFileRange) {
+#ifdef SYS_copy_file_range
+            // file to file only, can reflink on supporting filesystems
+            copied = ::syscall(SYS_copy_file_range, src, &offset, out
+                               , nullptr, remaining, 0u);
+            if ((copied < 0)
+                && ((errno == EXDEV) || (errno == EINVAL) || (errno == ENOSYS)
+                    || (errno == EOPNOTSUPP) || (errno == EBADF)))
+            {
+                copyFileRange = false;
+                continue;
+            }
+#endif
+        } else if (sendFile) {
+            off_t soffset(offset);
+            copied = ::sendfile(out, src, &soffset, remaining);
+            if ((copied < 0) && ((errno == EINVAL) || (errno == ENOSYS))) {
+                sendFile = false;
+                continue;
+            }
+            offset = soffset;
+        } else {
+            // user space fallback
+            char buf[1 << 16];
+            copied = ::pread(src, buf, std::min(remaining, sizeof(buf))
+                             , offset);
+            if (copied > 0) {
+                writeAll(out, buf, copied);
+                offset += copied;
+            }
+        }
+
+        if (copied < 0) {
+            if (errno == EINTR) { continue; }
+            std::system_error e(errno, std::system_category());
+            LOGTHROW(err2, IOError)
+                << "Failed to copy data from " << range.path << ": <"
+                << e.what() << ">.";
+        }
+
+        if (!copied) {
+            LOGTHROW(err2, IOError)
+                << "Unexpected end of file " << range.path << ".";
+        }
+
+        remaining -= copied;
+    }
+}
+
+} // namespace
+
+void copy(const IStream::pointer &in, int out)
+{
+    TraceSpan span(in->observer_, Observer::Event::entryRead
+                   , in->observer_ ? in->index() : fs::path());
+
+    std::size_t size(0);
+    if (const auto range = in->fileRange()) {
+        copyRange(*range, out);
+        size = range->size();
+    } else {
+        // read via stream buffer, stream has exceptions turned on
+        auto *sb(in->get().rdbuf());
+        char buf[1 << 16];
+        while (const auto got = sb->sgetn(buf, sizeof(buf))) {
+            writeAll(out, buf, got);
+            size += got;
+        }
+    }
+
+    if (in->stats_) { in->stats_->read(size, in->stacked_); }
+    span.bytes(size);
+    span.done();
 }
 
 void copy(const IStream::pointer &in, const fs::path &out)
 {
-    utility::ofstreambuf of(out.string());
-    copy(in, of);
-    of.flush();
+    FdHolder fd(::open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC
+                       , 0666));
+    if (fd.fd < 0) {
+        std::system_error e(errno, std::system_category());
+        LOGTHROW(err2, IOError)
+            << "Cannot create file " << out << ": <" << e.what() << ">.";
+    }
+
+    copy(in, fd.fd);
+
+    if (::close(fd.fd)) {
+        fd.fd = -1;
+        std::system_error e(errno, std::system_category());
+        LOGTHROW(err2, IOError)
+            << "Failed to close file " << out << ": <" << e.what() << ">.";
+    }
+    fd.fd = -1;
 }
 
 bool FileHint::Matcher::operator()(const fs::path &path)
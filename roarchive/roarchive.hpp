@@ -26,17 +26,22 @@
 #ifndef roarchive_roarchive_hpp_included_
 #define roarchive_roarchive_hpp_included_
 
+#include <ctime>
 #include <iostream>
 #include <memory>
 #include <functional>
 #include <initializer_list>
 #include <limits>
+#include <exception>
 
 #include <boost/optional.hpp>
 #include <boost/filesystem/path.hpp>
 
 #include "istream.hpp"
 #include "error.hpp"
+#include "stats.hpp"
+#include "memory.hpp"
+#include "observer.hpp"
 
 namespace roarchive {
 
@@ -68,8 +73,60 @@ struct FileHint {
 
 typedef std::vector<boost::filesystem::path> Files;
 
+/** File inside archive as reported by RoArchive::forEach().
+ */
+struct Entry {
+    /** Path relative to archive root.
+     */
+    boost::filesystem::path path;
+
+    /** File size, if known.
+     */
+    boost::optional<std::size_t> size;
+
+    /** File timestamp, -1 if unknown.
+     */
+    std::time_t timestamp;
+
+    Entry() : timestamp(-1) {}
+
+    typedef std::function<void(const Entry&)> Callback;
+};
+
+/** Content of single directory inside archive.
+ */
+struct Listing {
+    /** Names of files in the directory.
+     */
+    Files files;
+
+    /** Names of subdirectories.
+     */
+    Files directories;
+};
+
 struct OpenOptions;
 
+/** Kernel readahead management of tarball archives.
+ */
+enum class Readahead {
+    /** Leave kernel defaults.
+     */
+    none,
+
+    /** Detect sequential or random entry access and advise kernel.
+     */
+    automatic,
+
+    /** Always prefetch data following opened entry.
+     */
+    sequential,
+
+    /** Disable kernel readahead.
+     */
+    random
+};
+
 /** Generic read-only archive.
  *  One of plain directory, tarball or zip archive.
  *
@@ -120,6 +177,51 @@ public:
               , const FileHint &hint = FileHint()
               , const std::string &mime = "");
 
+    /** Opens file inside parent archive as an archive.
+     *
+     * Tarball or zip stored verbatim (plain file, tarball member, stored zip
+     * entry) is accessed in place. Any other (e.g. deflated) entry is
+     * decompressed into anonymous memory file first.
+     */
+    RoArchive(const RoArchive &parent, const boost::filesystem::path &path);
+
+    /** Opens file inside parent archive as an archive, see above.
+     */
+    RoArchive(const RoArchive &parent, const boost::filesystem::path &path
+              , const OpenOptions &openOptions);
+
+    /** Creates overlay of given archives.
+     *
+     * Layers go from bottom to top: file found in upper layer hides the same
+     * path in all lower layers. All layers are indexed at once into single
+     * merged index.
+     */
+    explicit RoArchive(const std::vector<RoArchive> &layers);
+
+    /** Creates overlay of given archives. Only observer is used from open
+     *  options.
+     */
+    RoArchive(const std::vector<RoArchive> &layers
+              , const OpenOptions &openOptions);
+
+    /** Result of batch open, see openMany().
+     */
+    struct Opened;
+
+    /** Opens many archives in parallel on given number of threads (zero means
+     *  number of CPUs). Results go in the order of paths. Any failure is
+     *  reported in its own result; the whole batch never fails.
+     */
+    static std::vector<Opened>
+    openMany(const std::vector<boost::filesystem::path> &paths
+             , const OpenOptions &openOptions, std::size_t threads = 0);
+
+    /** Opens many archives in parallel with default open options.
+     */
+    static std::vector<Opened>
+    openMany(const std::vector<boost::filesystem::path> &paths
+             , std::size_t threads = 0);
+
     /** Checks file existence.
      */
     bool exists(const boost::filesystem::path &path) const;
@@ -139,11 +241,24 @@ public:
     IStream::pointer istream(const boost::filesystem::path &path
                              , const IStream::FilterInit &filterInit) const;
 
+    /** Get input stream for byte range [offset, offset + length) of file at
+     *  given path. Range is clipped to file size. Internal filter (if any)
+     *  is applied to range data.
+     *
+     *  Plain files, tarball entries and stored zip entries are accessed
+     *  directly. Compressed entries are decompressed and skipped up to
+     *  offset.
+     */
+    IStream::pointer istream(const boost::filesystem::path &path
+                             , std::size_t offset, std::size_t length
+                             , const IStream::FilterInit &filterInit = {})
+        const;
+
     /** Returns true in case of direct access to filesystem.
      *  Only directory "archive" supports this.
      *  Optimalization for direct file access.
      */
-    bool directio() const { return directio_; }
+    bool directio() const;
 
     /** Returns path to whole archive.
      */
@@ -155,9 +270,37 @@ public:
     boost::filesystem::path path(const boost::filesystem::path &path) const;
 
     /** List all files in the archive.
+     *
+     *  Paths of indexed archives (tarball, zip) are normalized: empty and
+     *  "." components are dropped, i.e. entry stored as "./a//b" is listed
+     *  as "a/b". Lookups normalize the same way, so both forms can be
+     *  opened.
      */
     Files list() const;
 
+    /** List all files under given directory. Returned paths are relative to
+     *  archive root, as in list().
+     */
+    Files list(const boost::filesystem::path &prefix) const;
+
+    /** Calls callback for every file in the archive. Entries are streamed
+     *  directly from the index (or filesystem walk) without building any
+     *  list. Passed entry is valid only during the call. Paths are
+     *  normalized as in list().
+     */
+    void forEach(const Entry::Callback &callback) const;
+
+    /** List content (files and subdirectories) of single directory.
+     *  Empty listing is returned for non-existent directory.
+     */
+    Listing listDir(const boost::filesystem::path &dir) const;
+
+    /** Announces files that are going to be read soon. Archive may fetch
+     *  them in the background to make following istream() faster.
+     *  Only HTTP archive does anything useful.
+     */
+    void prefetch(const Files &paths) const;
+
     /** Post-constructor path hint application.
      */
     RoArchive& applyHint(const FileHint &hint = FileHint());
@@ -174,6 +317,14 @@ public:
      */
     bool handlesSchema(const std::string &schema) const;
 
+    /** I/O statistics of this archive.
+     */
+    Stats stats() const;
+
+    /** Memory charged to this archive. See memoryReport() for all archives.
+     */
+    MemoryUsage memoryUsage() const;
+
     /** Internal implementation.
      */
     class Detail;
@@ -183,12 +334,15 @@ private:
     /** Internal implementation.
      */
     dpointer detail_;
-    Detail& detail() { return *detail_.get(); }
-    const Detail& detail() const { return *detail_.get(); }
 
-    /** Direct I/O flag
+    /** Detail serving the requests; opens lazily opened archive.
+     */
+    Detail& detail();
+    const Detail& detail() const;
+
+    /** Sets up stream returned by detail for user consumption.
      */
-    bool directio_;
+    IStream::pointer setup(IStream::pointer &&is) const;
 
     static dpointer directory(const boost::filesystem::path &path
                               , const OpenOptions &openOptions);
@@ -200,6 +354,25 @@ private:
     static dpointer http(const boost::filesystem::path &path
                          , const OpenOptions &openOptions);
 
+    static dpointer tarball(const RoArchive &parent
+                            , const boost::filesystem::path &path
+                            , const FileRange &range
+                            , const OpenOptions &openOptions);
+    static dpointer zip(const RoArchive &parent
+                        , const boost::filesystem::path &path
+                        , const FileRange &range
+                        , const OpenOptions &openOptions);
+
+    static dpointer nested(const RoArchive &parent
+                           , const boost::filesystem::path &path
+                           , const OpenOptions &openOptions);
+
+    static dpointer overlay(const std::vector<RoArchive> &layers
+                            , const OpenOptions &openOptions);
+
+    static dpointer lazy(const boost::filesystem::path &path
+                         , const OpenOptions &openOptions);
+
     static dpointer factory(boost::filesystem::path path
                             , OpenOptions openOptions);
 };
@@ -212,9 +385,108 @@ struct OpenOptions {
     std::size_t fileLimit;
     std::string mime;
 
+    /** Separator of nested archive path, e.g. with '!' path
+     *  "data.tar!inner.zip" opens inner.zip stored inside data.tar.
+     *  Nesting can be repeated. Zero disables nested paths.
+     */
+    char nestedSeparator;
+
+    /** Time (in seconds) HTTP exists() answers are cached for. Zero
+     *  disables caching. Bodies fetched by exists() are kept in the prefetch
+     *  buffer (see httpPrefetchSize) regardless of this setting.
+     */
+    std::time_t httpExistsTtl;
+
+    /** Local on-disk cache for HTTP resources. Empty path disables the cache.
+     *
+     *  Archives using the same directory in one process share the cache, its
+     *  size limit and max age are those of the first archive that opened it.
+     */
+    boost::filesystem::path httpCacheDir;
+
+    /** Maximum total size (in bytes) of resources in HTTP disk cache.
+     */
+    std::size_t httpCacheSize;
+
+    /** Time (in seconds) after which cached resource must be refetched.
+     */
+    std::time_t httpCacheMaxAge;
+
+    /** Number of HTTP prefetch threads. Zero disables prefetching.
+     */
+    std::size_t httpPrefetchThreads;
+
+    /** Maximum total size (in bytes) of prefetched (or fetched by exists())
+     *  but not yet read resources. Zero disables the buffer.
+     */
+    std::size_t httpPrefetchSize;
+
+    /** File (relative to archive root) listing paths in expected access
+     *  order. Reading a listed file prefetches httpPrefetchDepth following
+     *  ones.
+     */
+    boost::filesystem::path httpPrefetchList;
+    std::size_t httpPrefetchDepth;
+
+    /** Manifest file (relative to archive root URL) listing all available
+     *  files. When set, exists(), list(), findFile() and hint resolution are
+     *  answered locally.
+     */
+    boost::filesystem::path httpManifest;
+
+    /** I/O tracing hook, optional.
+     */
+    Observer::pointer observer;
+
+    /** Tarball readahead mode and size (in bytes) of data prefetched
+     *  after sequentially accessed entry.
+     */
+    Readahead tarReadahead;
+    std::size_t tarReadaheadSize;
+
+    /** Defer format detection, index construction and hint application
+     *  until the archive is used for the first time. Concurrent first uses
+     *  open the archive only once; open errors are reported by (and retried
+     *  on) every use until successful.
+     *
+     *  stats(), memoryUsage(), changed(), path() and handlesSchema() do not
+     *  open the archive; applyHint() is remembered and applied at open.
+     *  path() is the given path without inline hint.
+     */
+    bool lazy;
+
+    /** Directory (e.g. /dev/shm) for archive indices shared between
+     *  processes. Tarball and zip indices are mapped read-only from index
+     *  files found there; missing or stale ones are built and published
+     *  for other processes. Empty path disables sharing.
+     */
+    boost::filesystem::path sharedIndexDir;
+
+    /** Verify data while reading whole files: CRC-32 of zip entries, tar
+     *  header checksums and CRC-32 of tar entries listed in tarDigests
+     *  sidecar file (lines "CRC32 PATH", CRC in hex, path relative to the
+     *  tarball root). Mismatch raises ChecksumError.
+     *
+     *  Verified streams are not seekable and are never copied by the
+     *  kernel. Byte ranges are not verified (except for tar headers).
+     */
+    bool verify;
+    boost::filesystem::path tarDigests;
+
     OpenOptions()
         : inlineHint(0)
         , fileLimit(std::numeric_limits<std::size_t>::max())
+        , nestedSeparator(0)
+        , httpExistsTtl(60)
+        , httpCacheSize(std::size_t(1) << 30)
+        , httpCacheMaxAge(3600)
+        , httpPrefetchThreads(4)
+        , httpPrefetchSize(std::size_t(64) << 20)
+        , httpPrefetchDepth(8)
+        , tarReadahead(Readahead::none)
+        , tarReadaheadSize(std::size_t(8) << 20)
+        , lazy(false)
+        , verify(false)
     {}
 
     OpenOptions& setHint(FileHint v) {
@@ -225,6 +497,10 @@ struct OpenOptions {
         inlineHint = v; return *this;
     }
 
+    OpenOptions& setNestedSeparator(char v) {
+        nestedSeparator = v; return *this;
+    }
+
     OpenOptions& setFileLimit(std::size_t v) {
         fileLimit = std::move(v); return *this;
     }
@@ -232,6 +508,90 @@ struct OpenOptions {
     OpenOptions& setMime(std::string v) {
         mime = std::move(v); return *this;
     }
+
+    OpenOptions& setHttpExistsTtl(std::time_t v) {
+        httpExistsTtl = v; return *this;
+    }
+
+    OpenOptions& setHttpCache(boost::filesystem::path dir
+                              , std::size_t size = std::size_t(1) << 30
+                              , std::time_t maxAge = 3600)
+    {
+        httpCacheDir = std::move(dir);
+        httpCacheSize = size;
+        httpCacheMaxAge = maxAge;
+        return *this;
+    }
+
+    OpenOptions& setHttpPrefetch(std::size_t threads
+                                 , std::size_t size = std::size_t(64) << 20)
+    {
+        httpPrefetchThreads = threads;
+        httpPrefetchSize = size;
+        return *this;
+    }
+
+    OpenOptions& setHttpPrefetchList(boost::filesystem::path list
+                                     , std::size_t depth = 8)
+    {
+        httpPrefetchList = std::move(list);
+        httpPrefetchDepth = depth;
+        return *this;
+    }
+
+    OpenOptions& setHttpManifest(boost::filesystem::path v) {
+        httpManifest = std::move(v); return *this;
+    }
+
+    OpenOptions& setObserver(Observer::pointer v) {
+        observer = std::move(v); return *this;
+    }
+
+    OpenOptions& setTarReadahead(Readahead mode
+                                 , std::size_t size = std::size_t(8) << 20)
+    {
+        tarReadahead = mode;
+        tarReadaheadSize = size;
+        return *this;
+    }
+
+    OpenOptions& setLazy(bool v) {
+        lazy = v; return *this;
+    }
+
+    OpenOptions& setSharedIndex(boost::filesystem::path dir) {
+        sharedIndexDir = std::move(dir); return *this;
+    }
+
+    OpenOptions& setVerify(bool v
+                           , boost::filesystem::path digests
+                           = boost::filesystem::path())
+    {
+        verify = v;
+        tarDigests = std::move(digests);
+        return *this;
+    }
+};
+
+struct RoArchive::Opened {
+    boost::filesystem::path path;
+
+    /** Opened archive, valid if there was no error.
+     */
+    boost::optional<RoArchive> archive;
+
+    /** Open failure.
+     */
+    std::exception_ptr error;
+
+    operator bool() const { return bool(archive); }
+
+    /** Returns opened archive or rethrows the open failure.
+     */
+    const RoArchive& get() const {
+        if (error) { std::rethrow_exception(error); }
+        return *archive;
+    }
 };
 
 } // namespace roarchive
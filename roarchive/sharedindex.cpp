@@ -0,0 +1,266 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <system_error>
+
+#include <boost/filesystem.hpp>
+
+#include "dbglog/dbglog.hpp"
+
+#include "sharedindex.hpp"
+
+namespace fs = boost::filesystem;
+
+namespace roarchive {
+
+namespace {
+
+const char Magic[8] = { 'r', 'o', 'a', 'i', 'd', 'x', '\0', '\0' };
+const std::uint32_t Version = 1;
+
+/** On-disk header of shared index file. Followed by archive path, index
+ *  data and values (8-byte aligned).
+ */
+struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t valueSize;
+    std::uint64_t fileLimit;
+    std::uint64_t archiveSize;
+    std::int64_t archiveMtime;
+    std::uint64_t archiveInode;
+    std::uint64_t archiveDevice;
+    std::uint64_t pathSize;
+    std::uint64_t indexOffset;
+    std::uint64_t indexSize;
+    std::uint64_t valuesOffset;
+    std::uint64_t valuesSize;
+};
+
+std::uint64_t align(std::uint64_t offset)
+{
+    return (offset + 7) & ~std::uint64_t(7);
+}
+
+/** Stable (FNV-1a) hash, same in all processes and builds.
+ */
+std::uint64_t hash(const std::string &data)
+{
+    std::uint64_t h(0xcbf29ce484222325ull);
+    for (unsigned char c : data) {
+        h ^= c;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+fs::path indexPath(const SharedIndexKey &key)
+{
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx"
+                  , static_cast<unsigned long long>
+                  (hash(key.archive.string() + '\0' + key.kind + '\0'
+                        + std::to_string(key.valueSize) + '\0'
+                        + std::to_string(key.fileLimit))));
+    return key.dir / ("roarchive-" + key.kind + "-" + hex + ".idx");
+}
+
+class Fd {
+public:
+    Fd(int fd) : fd_(fd) {}
+    ~Fd() { if (fd_ >= 0) { ::close(fd_); } }
+
+    Fd(const Fd&) = delete;
+    Fd& operator=(const Fd&) = delete;
+
+    operator int() const { return fd_; }
+
+private:
+    int fd_;
+};
+
+bool writeAll(int fd, const void *data, std::size_t size)
+{
+    const auto *p(static_cast<const char*>(data));
+    while (size) {
+        const auto written(::write(fd, p, size));
+        if (written < 0) {
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+        p += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool pad(int fd, std::uint64_t from, std::uint64_t to)
+{
+    const char zeros[8] = { 0 };
+    return writeAll(fd, zeros, to - from);
+}
+
+} // namespace
+
+boost::optional<SharedIndexFile> loadSharedIndex(SharedIndexKey &key)
+{
+    {
+        boost::system::error_code ec;
+        auto archive(fs::canonical(key.archive, ec));
+        key.archive = ec ? fs::absolute(key.archive) : archive;
+    }
+
+    struct ::stat st;
+    if (::stat(key.archive.c_str(), &st) == -1) {
+        std::system_error e(errno, std::system_category());
+        LOGTHROW(err2, IOError)
+            << "Cannot stat archive " << key.archive << ": <"
+            << e.what() << ">.";
+    }
+    key.archiveSize = st.st_size;
+    key.archiveMtime = std::int64_t(st.st_mtim.tv_sec) * 1000000000
+        + st.st_mtim.tv_nsec;
+    key.archiveInode = st.st_ino;
+    key.archiveDevice = st.st_dev;
+
+    const auto path(indexPath(key));
+    Fd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd < 0) { return boost::none; }
+
+    if ((::fstat(fd, &st) == -1) || (std::size_t(st.st_size) < sizeof(Header)))
+    {
+        return boost::none;
+    }
+    const std::size_t size(st.st_size);
+
+    auto block(MemoryBlock::map(fd, size));
+    if (!block) { return boost::none; }
+
+    Header header;
+    std::memcpy(&header, block->data(), sizeof(header));
+    if (std::memcmp(header.magic, Magic, sizeof(Magic))
+        || (header.version != Version)
+        || (header.valueSize != key.valueSize)
+        || (header.fileLimit != key.fileLimit)
+        || (header.archiveSize != key.archiveSize)
+        || (header.archiveMtime != key.archiveMtime)
+        || (header.archiveInode != key.archiveInode)
+        || (header.archiveDevice != key.archiveDevice)
+        || (header.pathSize > size - sizeof(header))
+        || key.archive.string().compare
+           (0, std::string::npos, block->data() + sizeof(header)
+            , header.pathSize))
+    {
+        LOG(info1) << "Shared index " << path << " does not match archive "
+                   << key.archive << ".";
+        return boost::none;
+    }
+
+    if ((header.indexOffset > size) || (header.indexSize > size)
+        || (header.valuesOffset > size) || (header.valuesSize > size)
+        || (header.valuesSize > size - header.valuesOffset))
+    {
+        LOGTHROW(err2, Error)
+            << "Malformed shared index " << path << ".";
+    }
+
+    LOG(info1) << "Mapped shared index " << path << " of archive "
+               << key.archive << ".";
+    return SharedIndexFile{ block, header.indexOffset, header.indexSize
+            , header.valuesOffset };
+}
+
+boost::optional<SharedIndexFile>
+publishSharedIndex(const SharedIndexKey &key, const PathIndex &index
+                   , const void *values, std::size_t valuesSize)
+{
+    const auto path(indexPath(key));
+    const auto archive(key.archive.string());
+
+    Header header;
+    std::memcpy(header.magic, Magic, sizeof(Magic));
+    header.version = Version;
+    header.valueSize = key.valueSize;
+    header.fileLimit = key.fileLimit;
+    header.archiveSize = key.archiveSize;
+    header.archiveMtime = key.archiveMtime;
+    header.archiveInode = key.archiveInode;
+    header.archiveDevice = key.archiveDevice;
+    header.pathSize = archive.size();
+    header.indexOffset = align(sizeof(header) + header.pathSize);
+    header.indexSize = index.dataSize();
+    header.valuesOffset = align(header.indexOffset + header.indexSize);
+    header.valuesSize = valuesSize;
+
+    auto tmp(path.string() + ".XXXXXX");
+    Fd fd(::mkostemp(&tmp[0], O_CLOEXEC));
+    if (fd < 0) {
+        std::system_error e(errno, std::system_category());
+        LOG(warn2) << "Cannot create shared index in " << key.dir << ": <"
+                   << e.what() << ">.";
+        return boost::none;
+    }
+
+    const auto failed([&]() -> boost::optional<SharedIndexFile>
+    {
+        std::system_error e(errno, std::system_category());
+        LOG(warn2) << "Cannot publish shared index " << path << ": <"
+                   << e.what() << ">.";
+        ::unlink(tmp.c_str());
+        return boost::none;
+    });
+
+    if ((::fchmod(fd, 0644) == -1)
+        || !writeAll(fd, &header, sizeof(header))
+        || !writeAll(fd, archive.data(), archive.size())
+        || !pad(fd, sizeof(header) + header.pathSize, header.indexOffset)
+        || !writeAll(fd, index.data(), index.dataSize())
+        || !pad(fd, header.indexOffset + header.indexSize
+                , header.valuesOffset)
+        || !writeAll(fd, values, valuesSize))
+    {
+        return failed();
+    }
+
+    auto block(MemoryBlock::map(fd, header.valuesOffset + valuesSize));
+    if (!block || (::rename(tmp.c_str(), path.c_str()) == -1)) {
+        return failed();
+    }
+
+    LOG(info1) << "Published shared index " << path << " of archive "
+               << key.archive << ".";
+    return SharedIndexFile{ block, header.indexOffset, header.indexSize
+            , header.valuesOffset };
+}
+
+} // namespace roarchive
@@ -0,0 +1,141 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef roarchive_sharedindex_hpp_included_
+#define roarchive_sharedindex_hpp_included_
+
+#include <cstdint>
+#include <string>
+#include <functional>
+
+#include <boost/optional.hpp>
+#include <boost/filesystem/path.hpp>
+
+#include "dbglog/dbglog.hpp"
+
+#include "pathindex.hpp"
+
+namespace roarchive {
+
+/** Identification of shared index file.
+ */
+struct SharedIndexKey {
+    /** Directory holding index files, e.g. /dev/shm.
+     */
+    boost::filesystem::path dir;
+
+    /** Backend kind, part of file name.
+     */
+    std::string kind;
+
+    /** Indexed archive.
+     */
+    boost::filesystem::path archive;
+
+    /** Size of one value.
+     */
+    std::size_t valueSize;
+
+    /** Archive file limit the index was built with.
+     */
+    std::size_t fileLimit;
+
+    /** Archive identity (filled in by loadSharedIndex()).
+     */
+    std::uint64_t archiveSize;
+    std::int64_t archiveMtime;
+    std::uint64_t archiveInode;
+    std::uint64_t archiveDevice;
+
+    SharedIndexKey(const boost::filesystem::path &dir, const std::string &kind
+                   , const boost::filesystem::path &archive
+                   , std::size_t fileLimit)
+        : dir(dir), kind(kind), archive(archive), valueSize()
+        , fileLimit(fileLimit)
+        , archiveSize(), archiveMtime(), archiveInode(), archiveDevice()
+    {}
+};
+
+/** Shared index file mapped read-only into memory.
+ */
+struct SharedIndexFile {
+    MemoryBlock::pointer block;
+    std::size_t indexOffset;
+    std::size_t indexSize;
+    std::size_t valuesOffset;
+};
+
+/** Maps existing index file. Returns none if there is no such file or the
+ *  file does not match the archive (stale or foreign). Archive identity is
+ *  stored in the key.
+ */
+boost::optional<SharedIndexFile> loadSharedIndex(SharedIndexKey &key);
+
+/** Writes index and values to new index file and atomically publishes it
+ *  under key's name. Key must have been passed to loadSharedIndex() before
+ *  the index was built. Returns mapped published file or none on failure.
+ */
+boost::optional<SharedIndexFile>
+publishSharedIndex(const SharedIndexKey &key, const PathIndex &index
+                   , const void *values, std::size_t valuesSize);
+
+/** Returns path map of given archive: maps shared index file from key.dir
+ *  if valid one exists, otherwise calls build() and publishes its result
+ *  there for other processes. Empty key.dir disables sharing.
+ *
+ *  Failure to publish is not fatal: privately built map is used instead.
+ */
+template <typename Value>
+PathMap<Value> sharedPathMap(SharedIndexKey key
+                             , const std::function<PathMap<Value>()> &build)
+{
+    if (key.dir.empty()) { return build(); }
+
+    key.valueSize = sizeof(Value);
+    try {
+        if (const auto file = loadSharedIndex(key)) {
+            return PathMap<Value>::view(file->block, file->indexOffset
+                                        , file->indexSize
+                                        , file->valuesOffset);
+        }
+    } catch (const Error &e) {
+        LOG(warn2) << "Ignoring malformed shared index of "
+                   << key.archive << ": " << e.what();
+    }
+
+    auto map(build());
+    const auto &values(map.values());
+    if (const auto file = publishSharedIndex
+        (key, map.index(), values.data(), values.size() * sizeof(Value)))
+    {
+        return PathMap<Value>::view(file->block, file->indexOffset
+                                    , file->indexSize, file->valuesOffset);
+    }
+    return map;
+}
+
+} // namespace roarchive
+
+#endif // roarchive_sharedindex_hpp_included_
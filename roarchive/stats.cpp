@@ -0,0 +1,248 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mutex>
+#include <cmath>
+
+#include "statscollector.hpp"
+
+namespace roarchive {
+
+namespace {
+
+/** Stable thread slot index.
+ */
+std::size_t threadSlot(std::size_t slots)
+{
+    static std::atomic<std::size_t> next(0);
+    static thread_local const std::size_t slot(next++);
+    return slot % slots;
+}
+
+std::size_t bucket(const StatsCollector::Clock::duration &duration)
+{
+    auto us(std::chrono::duration_cast<std::chrono::microseconds>
+            (duration).count());
+    std::size_t b(0);
+    while ((us > 0) && (b < (Histogram::Size - 1))) {
+        us >>= 1;
+        ++b;
+    }
+    return b;
+}
+
+struct GlobalStats {
+    std::mutex mutex;
+    std::map<std::string, std::unique_ptr<StatsCollector>> collectors;
+
+    StatsCollector* get(const std::string &backend) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &collector(collectors[backend]);
+        if (!collector) { collector.reset(new StatsCollector()); }
+        return collector.get();
+    }
+
+    std::map<std::string, Stats> stats() {
+        std::map<std::string, Stats> stats;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &item : collectors) {
+            auto s(item.second->stats());
+            s.backend = item.first;
+            stats.insert(std::make_pair(item.first, s));
+        }
+        return stats;
+    }
+};
+
+GlobalStats& globalCollectors()
+{
+    // never destroyed, archives may live in static objects
+    static GlobalStats *global(new GlobalStats());
+    return *global;
+}
+
+} // namespace
+
+std::uint64_t Histogram::count() const
+{
+    std::uint64_t count(0);
+    for (auto value : buckets) { count += value; }
+    return count;
+}
+
+std::uint64_t Histogram::quantile(double q) const
+{
+    const auto total(count());
+    if (!total) { return 0; }
+
+    const auto rank(std::uint64_t(std::ceil(q * total)));
+    std::uint64_t sum(0);
+    for (std::size_t b(0); b < Size; ++b) {
+        sum += buckets[b];
+        if (sum >= rank) { return std::uint64_t(1) << b; }
+    }
+    return std::uint64_t(1) << (Size - 1);
+}
+
+Histogram& Histogram::operator+=(const Histogram &o)
+{
+    for (std::size_t b(0); b < Size; ++b) { buckets[b] += o.buckets[b]; }
+    return *this;
+}
+
+Stats::OperationStats&
+Stats::OperationStats::operator+=(const OperationStats &o)
+{
+    count += o.count;
+    errors += o.errors;
+    latency += o.latency;
+    return *this;
+}
+
+Stats::Readahead& Stats::Readahead::operator+=(const Readahead &o)
+{
+    advices += o.advices;
+    advisedBytes += o.advisedBytes;
+    hits += o.hits;
+    wastedBytes += o.wastedBytes;
+    randomSwitches += o.randomSwitches;
+    randomHits += o.randomHits;
+    randomMisses += o.randomMisses;
+    return *this;
+}
+
+Stats& Stats::operator+=(const Stats &o)
+{
+    opens += o.opens;
+    openTime += o.openTime;
+    indexTime += o.indexTime;
+    for (std::size_t i(0); i < OperationCount; ++i) {
+        operations[i] += o.operations[i];
+    }
+    bytesRead += o.bytesRead;
+    decompressedBytes += o.decompressedBytes;
+    cacheHits += o.cacheHits;
+    cacheMisses += o.cacheMisses;
+    readahead += o.readahead;
+    return *this;
+}
+
+void StatsCollector::add(std::size_t counter, std::uint64_t value)
+{
+    slots_[threadSlot(Slots)].values[counter]
+        .fetch_add(value, std::memory_order_relaxed);
+    if (global_) { global_->add(counter, value); }
+}
+
+void StatsCollector::opened(const std::string &backend
+                            , const Clock::duration &duration)
+{
+    backend_ = backend;
+    global_ = globalCollectors().get(backend);
+    add(Counter::opens, 1);
+    add(Counter::openTime, std::chrono::duration_cast
+        <std::chrono::microseconds>(duration).count());
+
+    // index built in backend's constructor has been recorded locally only
+    if (global_) {
+        std::uint64_t indexTime(0);
+        for (const auto &slot : slots_) {
+            indexTime += slot.values[Counter::indexTime]
+                .load(std::memory_order_relaxed);
+        }
+        if (indexTime) { global_->add(Counter::indexTime, indexTime); }
+    }
+}
+
+void StatsCollector::indexBuilt(const Clock::duration &duration)
+{
+    add(Counter::indexTime, std::chrono::duration_cast
+        <std::chrono::microseconds>(duration).count());
+}
+
+void StatsCollector::operation(Stats::Operation op
+                               , const Clock::duration &duration
+                               , bool error)
+{
+    const auto base(Counter::operations
+                    + static_cast<std::size_t>(op) * Counter::PerOperation);
+    add(base, 1);
+    if (error) { add(base + 1, 1); }
+    add(base + 2 + bucket(duration), 1);
+}
+
+void StatsCollector::read(std::size_t bytes, bool filtered)
+{
+    add(filtered ? Counter::decompressedBytes : Counter::bytesRead, bytes);
+}
+
+Stats StatsCollector::stats() const
+{
+    std::array<std::uint64_t, Counter::count> values;
+    values.fill(0);
+    for (const auto &slot : slots_) {
+        for (std::size_t i(0); i < Counter::count; ++i) {
+            values[i] += slot.values[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    Stats stats(backend_);
+    stats.opens = values[Counter::opens];
+    stats.openTime = values[Counter::openTime];
+    stats.indexTime = values[Counter::indexTime];
+    stats.bytesRead = values[Counter::bytesRead];
+    stats.decompressedBytes = values[Counter::decompressedBytes];
+    stats.cacheHits = values[Counter::cacheHits];
+    stats.cacheMisses = values[Counter::cacheMisses];
+
+    auto &ra(stats.readahead);
+    ra.advices = values[Counter::raAdvices];
+    ra.advisedBytes = values[Counter::raAdvisedBytes];
+    ra.hits = values[Counter::raHits];
+    ra.wastedBytes = values[Counter::raWastedBytes];
+    ra.randomSwitches = values[Counter::raRandomSwitches];
+    ra.randomHits = values[Counter::raRandomHits];
+    ra.randomMisses = values[Counter::raRandomMisses];
+
+    for (std::size_t op(0); op < Stats::OperationCount; ++op) {
+        const auto base(Counter::operations + op * Counter::PerOperation);
+        auto &os(stats.operations[op]);
+        os.count = values[base];
+        os.errors = values[base + 1];
+        for (std::size_t b(0); b < Histogram::Size; ++b) {
+            os.latency.buckets[b] = values[base + 2 + b];
+        }
+    }
+
+    return stats;
+}
+
+std::map<std::string, Stats> globalStats()
+{
+    return globalCollectors().stats();
+}
+
+} // namespace roarchive
@@ -0,0 +1,151 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef roarchive_stats_hpp_included_
+#define roarchive_stats_hpp_included_
+
+#include <array>
+#include <map>
+#include <string>
+#include <cstdint>
+
+namespace roarchive {
+
+/** Latency histogram with logarithmic buckets.
+ *
+ *  Bucket i counts operations that took [2^(i - 1), 2^i) microseconds, bucket
+ *  0 counts operations shorter than 1 microsecond.
+ */
+struct Histogram {
+    static constexpr std::size_t Size = 32;
+    std::array<std::uint64_t, Size> buckets;
+
+    Histogram() { buckets.fill(0); }
+
+    /** Number of recorded values.
+     */
+    std::uint64_t count() const;
+
+    /** Approximate quantile (upper bound of bucket) in microseconds.
+     */
+    std::uint64_t quantile(double q) const;
+
+    Histogram& operator+=(const Histogram &o);
+};
+
+/** Archive I/O statistics.
+ */
+struct Stats {
+    enum class Operation { exists, istream, findFile, list };
+    static constexpr std::size_t OperationCount = 4;
+
+    struct OperationStats {
+        std::uint64_t count;
+        std::uint64_t errors;
+        Histogram latency;
+
+        OperationStats() : count(), errors() {}
+        OperationStats& operator+=(const OperationStats &o);
+    };
+
+    /** Backend name (directory, tarball, zip, http).
+     */
+    std::string backend;
+
+    /** Number of opened archives and total time (in microseconds) spent in
+     *  opening them (includes index construction).
+     */
+    std::uint64_t opens;
+    std::uint64_t openTime;
+
+    /** Total time (in microseconds) spent in building (or mapping shared)
+     *  archive indices. Index built at open is part of openTime as well.
+     */
+    std::uint64_t indexTime;
+
+    std::array<OperationStats, OperationCount> operations;
+
+    /** Bytes read from the archive via IStream::read() or copy(). Bytes read
+     *  through user-supplied filters are reported as decompressed.
+     */
+    std::uint64_t bytesRead;
+    std::uint64_t decompressedBytes;
+
+    /** Backend cache hits/misses (only HTTP so far).
+     */
+    std::uint64_t cacheHits;
+    std::uint64_t cacheMisses;
+
+    /** Kernel readahead decisions (only tarball so far).
+     */
+    struct Readahead {
+        /** Number of WILLNEED advices and total advised bytes.
+         */
+        std::uint64_t advices;
+        std::uint64_t advisedBytes;
+
+        /** Entries opened inside advised range (advice paid off) and advised
+         *  bytes skipped by a jump elsewhere (advice wasted).
+         */
+        std::uint64_t hits;
+        std::uint64_t wastedBytes;
+
+        /** Switches to random access (kernel readahead disabled) and entries
+         *  opened in random mode at random (switch paid off) or sequentially
+         *  (switch was wrong).
+         */
+        std::uint64_t randomSwitches;
+        std::uint64_t randomHits;
+        std::uint64_t randomMisses;
+
+        Readahead()
+            : advices(), advisedBytes(), hits(), wastedBytes()
+            , randomSwitches(), randomHits(), randomMisses()
+        {}
+
+        Readahead& operator+=(const Readahead &o);
+    };
+
+    Readahead readahead;
+
+    Stats(const std::string &backend = std::string())
+        : backend(backend), opens(), openTime(), indexTime(), bytesRead()
+        , decompressedBytes(), cacheHits(), cacheMisses()
+    {}
+
+    const OperationStats& operator[](Operation op) const {
+        return operations[static_cast<std::size_t>(op)];
+    }
+
+    Stats& operator+=(const Stats &o);
+};
+
+/** Statistics of all archives opened in this process, per backend.
+ */
+std::map<std::string, Stats> globalStats();
+
+} // namespace roarchive
+
+#endif // roarchive_stats_hpp_included_
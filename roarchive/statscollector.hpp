@@ -0,0 +1,164 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef roarchive_statscollector_hpp_included_
+#define roarchive_statscollector_hpp_included_
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include "stats.hpp"
+
+namespace roarchive {
+
+/** Lock-free statistics collector.
+ *
+ *  Counters are split into per-thread slots (threads are spread over fixed
+ *  number of cache-line separated slots) and summed up on read.
+ *
+ *  Everything recorded in archive's collector is recorded in process-wide
+ *  per-backend collector as well.
+ */
+class StatsCollector {
+public:
+    typedef std::shared_ptr<StatsCollector> pointer;
+    typedef std::chrono::steady_clock Clock;
+
+    StatsCollector() : global_() {}
+
+    /** Called by factory when archive is opened.
+     */
+    void opened(const std::string &backend, const Clock::duration &duration);
+
+    /** Called by backend when its index is built, may precede opened().
+     */
+    void indexBuilt(const Clock::duration &duration);
+
+    /** Builds index by calling build() and records time spent.
+     */
+    template <typename Build>
+    auto buildIndex(Build &&build) -> decltype(build());
+
+    void operation(Stats::Operation op, const Clock::duration &duration
+                   , bool error);
+
+    void read(std::size_t bytes, bool filtered);
+
+    void cacheHit() { add(Counter::cacheHits, 1); }
+    void cacheMiss() { add(Counter::cacheMisses, 1); }
+
+    void readaheadAdvice(std::size_t bytes) {
+        add(Counter::raAdvices, 1);
+        add(Counter::raAdvisedBytes, bytes);
+    }
+    void readaheadHit() { add(Counter::raHits, 1); }
+    void readaheadWaste(std::size_t bytes) {
+        add(Counter::raWastedBytes, bytes);
+    }
+    void randomSwitch() { add(Counter::raRandomSwitches, 1); }
+    void randomAccess(bool hit) {
+        add(hit ? Counter::raRandomHits : Counter::raRandomMisses, 1);
+    }
+
+    Stats stats() const;
+
+    /** Measures operation, successful finish is marked by passing the result
+     *  through operator().
+     */
+    class Timer {
+    public:
+        Timer(StatsCollector &collector, Stats::Operation op)
+            : collector_(collector), op_(op), start_(Clock::now())
+            , done_(false)
+        {}
+
+        ~Timer() {
+            collector_.operation(op_, Clock::now() - start_, !done_);
+        }
+
+        template <typename T> T&& operator()(T &&value) {
+            done_ = true;
+            return std::forward<T>(value);
+        }
+
+        void done() { done_ = true; }
+
+    private:
+        StatsCollector &collector_;
+        Stats::Operation op_;
+        Clock::time_point start_;
+        bool done_;
+    };
+
+private:
+    struct Counter {
+        enum : std::size_t {
+            opens, openTime, indexTime, bytesRead, decompressedBytes
+            , cacheHits, cacheMisses
+            , raAdvices, raAdvisedBytes, raHits, raWastedBytes
+            , raRandomSwitches, raRandomHits, raRandomMisses
+            , operations
+        };
+
+        static constexpr std::size_t PerOperation = 2 + Histogram::Size;
+
+        static constexpr std::size_t count
+            = operations + Stats::OperationCount * PerOperation;
+    };
+
+    void add(std::size_t counter, std::uint64_t value);
+
+    static constexpr std::size_t Slots = 8;
+
+    struct Slot {
+        std::array<std::atomic<std::uint64_t>, Counter::count> values;
+        // keeps neighbouring slots in different cache lines
+        char padding[64];
+        Slot() { for (auto &value : values) { value = 0; } }
+    };
+
+    std::array<Slot, Slots> slots_;
+
+    std::string backend_;
+
+    /** Process-wide collector for this archive's backend.
+     */
+    StatsCollector *global_;
+};
+
+template <typename Build>
+auto StatsCollector::buildIndex(Build &&build) -> decltype(build())
+{
+    const auto start(Clock::now());
+    auto index(build());
+    indexBuilt(Clock::now() - start);
+    return index;
+}
+
+} // namespace roarchive
+
+#endif // roarchive_statscollector_hpp_included_
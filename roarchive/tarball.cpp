@@ -23,7 +23,18 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
-#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <vector>
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <mutex>
+#include <fstream>
+#include <system_error>
 
 #include "dbglog/dbglog.hpp"
 
@@ -34,6 +45,9 @@
 #include "utility/streams.hpp"
 
 #include "detail.hpp"
+#include "pathindex.hpp"
+#include "sharedindex.hpp"
+#include "checksum.hpp"
 #include "io.hpp"
 
 namespace fs = boost::filesystem;
@@ -46,10 +60,18 @@ class TarIStream : public IStream {
 public:
     typedef utility::io::SubStreamDevice::Filedes Filedes;
 
+    /** Data are verified against given CRC-32, if any.
+     */
     TarIStream(const fs::path &path, const Filedes &fd
-               , const IStream::FilterInit &filterInit)
-        : IStream(filterInit, (fd.end - fd.start)), path_(path)
+               , const IStream::FilterInit &filterInit
+               , const boost::optional<std::uint32_t> &crc = boost::none)
+        : IStream(filterInit, (fd.end - fd.start)), path_(path), fd_(fd)
+        , verify_(crc)
     {
+        if (crc) {
+            fis_.push(Crc32Verifier(path, *crc, fd.end - fd.start));
+            update(fd.end - fd.start, false);
+        }
         fis_.push(utility::io::SubStreamDevice(path, fd));
     }
 
@@ -57,113 +79,444 @@ public:
     virtual fs::path index() const { return path_; }
     virtual void close() {}
 
+protected:
+    virtual boost::optional<FileRange> range() const {
+        // verified data must go through the stream
+        if (verify_) { return boost::none; }
+        return FileRange(fd_.fd, path_, fd_.start, fd_.end);
+    }
+
 private:
     const fs::path path_;
+    const Filedes fd_;
+    const bool verify_;
+};
+
+/** Location of file data in the tarball.
+ */
+struct Extent {
+    std::size_t start;
+    std::size_t end;
 };
 
-HintedPath
-findPrefix(const fs::path &path, const FileHint &hint
-           , const utility::tar::Reader::File::list &files)
+typedef PathMap<Extent> FileMap;
+
+FileMap buildFileMap(const utility::tar::Reader::File::list &files)
+{
+    FileMap::Builder builder;
+    for (const auto &file : files) {
+        builder.add(file.path.string(), { file.start, file.end() });
+    }
+    return builder.build();
+}
+
+/** Builds file map of whole tarball, shared with other processes if
+ *  configured.
+ */
+FileMap loadFileMap(utility::tar::Reader &reader
+                    , const OpenOptions &openOptions)
+{
+    const SharedIndexKey key(openOptions.sharedIndexDir, "tar", reader.path()
+                             , openOptions.fileLimit);
+    return sharedPathMap<Extent>(key, [&]()
+    {
+        return buildFileMap(reader.files(openOptions.fileLimit));
+    });
+}
+
+void readAt(const FileRange &range, char *data, std::size_t size
+            , std::size_t offset)
 {
-    if (!hint) { return {}; }
-
-    // sort paths by depth
-    struct Path {
-        const fs::path *path;
-        std::size_t depth;
-
-        Path(const utility::tar::Reader::File &record)
-            : path(&record.path)
-            , depth(std::distance(path->begin(), path->end())) {}
-        bool operator<(const Path &o) const { return depth < o.depth; }
-    };
-
-    std::vector<Path> paths;
-    paths.reserve(files.size());
-    for (const auto &file : files) { paths.emplace_back(file); }
-    std::sort(paths.begin(), paths.end());
-
-    // match all files
-    FileHint::Matcher matcher(hint);
-    for (const auto &path : paths) {
-        if (matcher(*path.path)) {
-            return HintedPath(path.path->parent_path(), path.path->filename());
+    while (size) {
+        const auto got(::pread(range.fd, data, size, offset));
+        if (got < 0) {
+            if (errno == EINTR) { continue; }
+            std::system_error e(errno, std::system_category());
+            LOGTHROW(err2, IOError)
+                << "Cannot read tarball " << range.path << ": <"
+                << e.what() << ">.";
+        }
+        if (!got) {
+            LOGTHROW(err2, IOError)
+                << "Unexpected end of tarball " << range.path << ".";
         }
+        data += got;
+        size -= got;
+        offset += got;
+    }
+}
+
+/** Parses numeric header field: octal or GNU base-256.
+ */
+std::size_t number(const char *field, std::size_t size)
+{
+    const auto *f(reinterpret_cast<const unsigned char*>(field));
+    std::size_t value(0);
+    if (*f & 0x80) {
+        value = *f & 0x7f;
+        for (std::size_t i(1); i < size; ++i) { value = (value << 8) | f[i]; }
+        return value;
+    }
+
+    for (std::size_t i(0); i < size; ++i) {
+        if ((f[i] >= '0') && (f[i] <= '7')) {
+            value = (value << 3) | (f[i] - '0');
+        } else if (value || ((f[i] != ' ') && f[i])) {
+            break;
+        }
+    }
+    return value;
+}
+
+std::string string(const char *field, std::size_t size)
+{
+    return std::string(field, ::strnlen(field, size));
+}
+
+/** Verifies checksum of tar header preceding file data at given offset.
+ */
+void verifyHeader(const FileRange &archive, const fs::path &path
+                  , std::size_t start)
+{
+    char header[512];
+    if (start < sizeof(header)) {
+        LOGTHROW(err2, ChecksumError)
+            << "No tar header before " << path << " in "
+            << archive.path << ".";
+    }
+    readAt(archive, header, sizeof(header), start - sizeof(header));
+
+    // checksum field counts as spaces; historic implementations used signed
+    // chars
+    std::size_t unsignedSum(8 * ' ');
+    std::ptrdiff_t signedSum(8 * ' ');
+    for (std::size_t i(0); i < sizeof(header); ++i) {
+        if ((i >= 148) && (i < 156)) { continue; }
+        unsignedSum += static_cast<unsigned char>(header[i]);
+        signedSum += static_cast<signed char>(header[i]);
+    }
+
+    const auto recorded(number(header + 148, 8));
+    if ((recorded != unsignedSum) && (std::ptrdiff_t(recorded) != signedSum))
+    {
+        LOGTHROW(err2, ChecksumError)
+            << "Tar header checksum mismatch of " << path << " in "
+            << archive.path << ".";
+    }
+}
+
+typedef PathMap<std::uint32_t> DigestMap;
+
+/** Loads per-entry CRC-32 sidecar file: "CRC32 PATH" lines, CRC in hex.
+ */
+DigestMap loadDigests(const OpenOptions &openOptions)
+{
+    if (!openOptions.verify || openOptions.tarDigests.empty()) { return {}; }
+
+    const auto &path(openOptions.tarDigests);
+    std::ifstream f(path.string());
+    if (!f) {
+        LOGTHROW(err2, IOError)
+            << "Cannot open tarball digest file " << path << ".";
+    }
+
+    DigestMap::Builder builder;
+    std::string line;
+    for (std::size_t lineNo(1); std::getline(f, line); ++lineNo) {
+        if (line.empty() || (line[0] == '#')) { continue; }
+
+        char *end;
+        const auto crc(std::strtoul(line.c_str(), &end, 16));
+        const auto sep(std::strspn(end, " \t"));
+        if ((end == line.c_str()) || !sep || !end[sep]
+            || (crc > 0xfffffffful))
+        {
+            LOGTHROW(err2, Error)
+                << "Invalid line " << lineNo << " in tarball digest file "
+                << path << ".";
+        }
+        builder.add(end + sep, crc);
+    }
+    return builder.build();
+}
+
+/** Extracts path from pax extended header records ("<len> key=value\n").
+ */
+std::string paxPath(const std::string &records)
+{
+    std::size_t pos(0);
+    while (pos < records.size()) {
+        const auto space(records.find(' ', pos));
+        if (space == std::string::npos) { break; }
+        const auto length(std::strtoul(records.c_str() + pos, nullptr, 10));
+        if (!length || ((pos + length) > records.size())) { break; }
+
+        const auto record(records.substr(space + 1
+                                         , pos + length - space - 2));
+        if (record.compare(0, 5, "path=") == 0) { return record.substr(5); }
+        pos += length;
+    }
+    return {};
+}
+
+/** Scans tarball stored in given range of already open file. Understands
+ *  ustar, GNU long names and pax path records. Data offsets are absolute.
+ */
+FileMap scanTar(const FileRange &range, std::size_t limit)
+{
+    FileMap::Builder builder;
+    std::size_t count(0);
+
+    char header[512];
+    std::string longName;
+    for (std::size_t pos(range.start);
+         ((pos + sizeof(header)) <= range.end) && (count < limit); )
+    {
+        readAt(range, header, sizeof(header), pos);
+        if (std::all_of(header, header + sizeof(header)
+                        , [](char c) { return !c; }))
+        {
+            break;
+        }
+
+        const auto size(number(header + 124, 12));
+        const auto data(pos + sizeof(header));
+        if ((data + size) > range.end) {
+            LOGTHROW(err2, NotAnArchive)
+                << "Truncated nested tarball in " << range.path << ".";
+        }
+
+        const auto type(header[156]);
+        switch (type) {
+        case 'L': case 'x': {
+            std::string value(size, '\0');
+            readAt(range, &value[0], size, data);
+            if (type == 'L') {
+                longName = string(value.data(), value.size());
+            } else {
+                longName = paxPath(value);
+            }
+            break;
+        }
+
+        case '0': case '\0': case '7': {
+            auto path(longName);
+            if (path.empty()) {
+                path = string(header, 100);
+                const auto prefix(string(header + 345, 155));
+                if (!std::memcmp(header + 257, "ustar", 5) && !prefix.empty())
+                {
+                    path = prefix + "/" + path;
+                }
+            }
+            builder.add(path, { data, data + size });
+            longName.clear();
+            ++count;
+            break;
+        }
+
+        default:
+            longName.clear();
+        }
+
+        pos = data + ((size + 511) / 512) * 512;
+    }
+
+    return builder.build();
+}
+
+/** Tracks entry access pattern of a tarball and advises kernel: data
+ *  following sequentially read entries are prefetched, kernel readahead is
+ *  disabled for random access.
+ */
+class AccessTracker {
+public:
+    AccessTracker(int fd, const OpenOptions &openOptions
+                  , StatsCollector &stats)
+        : fd_(fd), mode_(openOptions.tarReadahead)
+        , window_(openOptions.tarReadaheadSize), stats_(stats)
+        , lastEnd_(0), advisedFrom_(0), advisedUntil_(0)
+        , sequentialRun_(0), randomRun_(0), random_(false)
+    {
+        if (mode_ == Readahead::random) { setRandom(true); }
     }
 
-    if (!matcher) {
-        LOGTHROW(err2, std::runtime_error)
-            << "No \"" << hint << "\" found in the tarball archive at "
-            << path << ".";
+    /** Called on every entry open.
+     */
+    void open(std::size_t start, std::size_t end);
+
+private:
+    /** Maximum distance from previous entry still considered sequential
+     *  (headers, padding, skipped small entries).
+     */
+    static constexpr std::size_t MaxGap = 64 << 10;
+
+    /** Number of consecutive sequential/random opens needed to switch mode.
+     */
+    static constexpr std::size_t SequentialRun = 2;
+    static constexpr std::size_t RandomRun = 4;
+
+    void advise(std::size_t end);
+    void setRandom(bool random);
+
+    const int fd_;
+    const Readahead mode_;
+    const std::size_t window_;
+    StatsCollector &stats_;
+
+    std::mutex mutex_;
+    std::size_t lastEnd_;
+    std::size_t advisedFrom_;
+    std::size_t advisedUntil_;
+    std::size_t sequentialRun_;
+    std::size_t randomRun_;
+    bool random_;
+};
+
+constexpr std::size_t AccessTracker::MaxGap;
+constexpr std::size_t AccessTracker::SequentialRun;
+constexpr std::size_t AccessTracker::RandomRun;
+
+void AccessTracker::open(std::size_t start, std::size_t end)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    const bool sequential(lastEnd_ && (start >= lastEnd_)
+                          && ((start - lastEnd_) <= MaxGap));
+
+    // evaluate previous decisions
+    if ((start >= advisedFrom_) && (end <= advisedUntil_)) {
+        stats_.readaheadHit();
+    } else if (!sequential && (advisedUntil_ > advisedFrom_)) {
+        // jumped away, rest of advised data is not going to be used
+        const auto used(std::max(std::min(lastEnd_, advisedUntil_)
+                                 , advisedFrom_));
+        stats_.readaheadWaste(advisedUntil_ - used);
+        advisedFrom_ = advisedUntil_ = 0;
     }
+    if (random_) { stats_.randomAccess(!sequential); }
+
+    switch (mode_) {
+    case Readahead::none: case Readahead::random:
+        break;
+
+    case Readahead::sequential:
+        advise(end);
+        break;
+
+    case Readahead::automatic:
+        if (sequential) {
+            randomRun_ = 0;
+            if (++sequentialRun_ >= SequentialRun) {
+                if (random_) { setRandom(false); }
+                advise(end);
+            }
+        } else {
+            sequentialRun_ = 0;
+            if ((++randomRun_ >= RandomRun) && !random_) { setRandom(true); }
+        }
+        break;
+    }
+
+    lastEnd_ = end;
+}
+
+void AccessTracker::advise(std::size_t end)
+{
+    // refill only when less than half of the window is left ahead
+    if (advisedUntil_ >= (end + window_ / 2)) { return; }
+
+    const auto from(std::max(end, advisedUntil_));
+    const auto until(end + window_);
+    if (from != advisedUntil_) { advisedFrom_ = from; }
+    advisedUntil_ = until;
 
-    return HintedPath(matcher.match().parent_path()
-                      , matcher.match().filename());
+    ::posix_fadvise(fd_, from, until - from, POSIX_FADV_WILLNEED);
+    stats_.readaheadAdvice(until - from);
+}
+
+void AccessTracker::setRandom(bool random)
+{
+    ::posix_fadvise(fd_, 0, 0, random ? POSIX_FADV_RANDOM
+                    : POSIX_FADV_NORMAL);
+    if (random) { stats_.randomSwitch(); }
+    random_ = random;
 }
 
 class TarIndex {
 public:
     typedef utility::io::SubStreamDevice::Filedes Filedes;
 
-    TarIndex(utility::tar::Reader &reader, const OpenOptions &openOptions)
-        : path_(reader.path()), files_(reader.files(openOptions.fileLimit))
-        , fd_(reader.filedes())
-        , prefix_(findPrefix(path_, openOptions.hint, files_))
+    TarIndex(const fs::path &path, int fd, FileMap &&files
+             , const OpenOptions &openOptions)
+        : path_(path)
+        , fd_(fd)
+        , files_(std::move(files))
+        , prefix_(findPrefix(path_, openOptions.hint, files_.index()
+                             , openOptions.observer, "tarball archive"))
+        , base_(findBase())
     {
-        for (const auto &file : files_) {
-            if (!utility::isPathPrefix(file.path, prefix_.path)) { continue; }
+        LOG(info1) << "Indexed " << files_.size() << " files in tarball "
+                   << path_ << " (" << files_.memoryUsage() << " bytes).";
+    }
 
-            const auto path(utility::cutPathPrefix(file.path, prefix_.path));
-            index_.insert(map::value_type
-                              (path.string()
-                               , { fd_, file.start, file.end() }));
-        }
+    const FileMap& files() const { return files_; }
+
+    /** Full path of file in the tarball (i.e. including prefix).
+     */
+    std::string fullPath(const std::string &path) const {
+        const auto id(files_.index().find(path, base_));
+        return (id == PathIndex::none) ? path : files_.index().path(id);
     }
 
-    const Filedes& file(const std::string &path) const {
-        auto findex(index_.find(path));
-        if (findex == index_.end()) {
+    Filedes file(const std::string &path) const {
+        const auto *extent(files_.find(path, base_));
+        if (!extent) {
             LOGTHROW(err2, NoSuchFile)
                 << "File \"" << path << "\" not found in the archive at "
                 << path_ << ".";
         }
-        return findex->second;
+        return { fd_, extent->start, extent->end };
     }
 
     bool exists(const std::string &path) const {
-        return (index_.find(path) != index_.end());
+        return files_.find(path, base_);
     }
 
-    Files list() const {
-        std::vector<boost::filesystem::path> list;
-        for (const auto &pair : index_) {
-            list.push_back(pair.first);
-        }
-        return list;
+    Files list(const std::string &prefix = std::string()) const {
+        const auto dir(files_.index().findDir(prefix, base_));
+        if (dir == PathIndex::none) { return {}; }
+        return files_.index().list(dir, base_);
+    }
+
+    void forEach(const Entry::Callback &callback) const {
+        const auto &index(files_.index());
+        Entry entry;
+        index.forEach(base_, [&](PathIndex::Id id)
+        {
+            const auto &extent(files_.value(id));
+            entry.path = index.path(id, base_);
+            entry.size = extent.end - extent.start;
+            callback(entry);
+        });
+    }
+
+    Listing listDir(const std::string &path) const {
+        const auto dir(files_.index().findDir(path, base_));
+        if (dir == PathIndex::none) { return {}; }
+        return files_.index().listDir(dir);
     }
 
     boost::optional<fs::path> findFile(const std::string &filename) const {
-        for (const auto &pair : index_) {
-            const fs::path path(pair.first);
-            if (path.filename() == filename) { return path; }
-        }
-        return boost::none;
+        return files_.index().findFile(filename, base_);
     }
 
-    void applyHint(const FileHint &hint) {
+    void applyHint(const FileHint &hint, const Observer::pointer &observer) {
         if (!hint) { return; }
         // regenerate
-        prefix_ = findPrefix(path_, hint, files_);
-        index_.clear();
-
-        for (const auto &file : files_) {
-            if (!utility::isPathPrefix(file.path, prefix_.path)) { continue; }
-
-            const auto path(utility::cutPathPrefix(file.path, prefix_.path));
-            index_.insert(map::value_type
-                              (path.string()
-                               , { fd_, file.start, file.end() }));
-        }
+        prefix_ = findPrefix(path_, hint, files_.index(), observer
+                             , "tarball archive");
+        base_ = findBase();
     }
 
     const boost::optional<fs::path>& usedHint() const {
@@ -171,20 +524,59 @@ public:
     }
 
 private:
+    PathIndex::Id findBase() const {
+        const auto base(files_.index().findDir(prefix_.path.string()));
+        return (base == PathIndex::none) ? PathIndex::root : base;
+    }
+
     const fs::path path_;
-    utility::tar::Reader::File::list files_;
     int fd_;
-    typedef std::map<std::string, Filedes> map;
-    map index_;
+
+    /** All files in the tarball, full paths.
+     */
+    FileMap files_;
     HintedPath prefix_;
+
+    /** Prefix directory in the index.
+     */
+    PathIndex::Id base_;
 };
 
 class Tarball : public RoArchive::Detail {
 public:
     Tarball(const boost::filesystem::path &path
             , const OpenOptions &openOptions)
-        : Detail(path), reader_(path), index_(reader_, openOptions)
-    {}
+        : Detail(path)
+        , reader_(std::make_shared<utility::tar::Reader>(path))
+        , index_(reader_->path(), reader_->filedes()
+                 , stats().buildIndex([&]() {
+                         return loadFileMap(*reader_, openOptions);
+                     })
+                 , openOptions)
+        , tracker_(tracker(reader_->filedes(), openOptions))
+        , verify_(openOptions.verify), digests_(loadDigests(openOptions))
+    {
+        memory().chargeIndex(index_.files());
+        memory().chargeIndex(digests_);
+    }
+
+    /** Tarball stored verbatim inside parent archive.
+     */
+    Tarball(const RoArchive &parent, const boost::filesystem::path &path
+            , const FileRange &range, const OpenOptions &openOptions)
+        : Detail(parent.path() / path)
+        , parent_(parent)
+        , index_(path_, range.fd
+                 , stats().buildIndex([&]() {
+                         return scanTar(range, openOptions.fileLimit);
+                     })
+                 , openOptions)
+        , tracker_(tracker(range.fd, openOptions))
+        , verify_(openOptions.verify), digests_(loadDigests(openOptions))
+    {
+        memory().chargeIndex(index_.files());
+        memory().chargeIndex(digests_);
+    }
 
     /** Get (wrapped) input stream for given file.
      *  Throws when not found.
@@ -193,8 +585,34 @@ public:
                                      , const IStream::FilterInit &filterInit)
         const
     {
-        return std::make_unique<TarIStream>(path, index_.file(path.string())
-                                            , filterInit);
+        const auto fd(index_.file(path.string()));
+        boost::optional<std::uint32_t> crc;
+        if (verify_) {
+            verifyHeader(FileRange(fd.fd, path_), path, fd.start);
+            if (const auto *digest
+                = digests_.find(index_.fullPath(path.string())))
+            {
+                crc = *digest;
+            }
+        }
+        if (tracker_) { tracker_->open(fd.start, fd.end); }
+        return std::make_unique<TarIStream>(path, fd, filterInit, crc);
+    }
+
+    /** Range of file: sub-range of file's data in the tarball.
+     */
+    virtual IStream::pointer istream(const boost::filesystem::path &path
+                                     , std::size_t offset, std::size_t length
+                                     , const IStream::FilterInit &filterInit)
+        const
+    {
+        auto fd(index_.file(path.string()));
+        if (verify_) { verifyHeader(FileRange(fd.fd, path_), path, fd.start); }
+        const auto range(clipRange(fd.end - fd.start, offset, length));
+        fd.end = fd.start + range.second;
+        fd.start += range.first;
+        if (tracker_) { tracker_->open(fd.start, fd.end); }
+        return std::make_unique<TarIStream>(path, fd, filterInit);
     }
 
     virtual bool exists(const boost::filesystem::path &path) const {
@@ -206,6 +624,18 @@ public:
         return index_.list();
     }
 
+    virtual Files list(const boost::filesystem::path &prefix) const {
+        return index_.list(prefix.string());
+    }
+
+    virtual Listing listDir(const boost::filesystem::path &dir) const {
+        return index_.listDir(dir.string());
+    }
+
+    virtual void forEach(const Entry::Callback &callback) const {
+        index_.forEach(callback);
+    }
+
     virtual boost::optional<fs::path> findFile(const std::string &filename)
         const
     {
@@ -213,16 +643,44 @@ public:
     }
 
     virtual void applyHint(const FileHint &hint) {
-        index_.applyHint(hint);
+        index_.applyHint(hint, observer_);
     }
 
     virtual const boost::optional<boost::filesystem::path>& usedHint() {
         return index_.usedHint();
     }
 
+    virtual bool changed() const {
+        return parent_ ? parent_->changed() : Detail::changed();
+    }
+
 private:
-    utility::tar::Reader reader_;
+    std::unique_ptr<AccessTracker> tracker(int fd
+                                           , const OpenOptions &openOptions)
+    {
+        if (openOptions.tarReadahead == Readahead::none) { return {}; }
+        return std::make_unique<AccessTracker>(fd, openOptions, stats());
+    }
+
+    std::shared_ptr<utility::tar::Reader> reader_;
+
+    /** Parent archive of nested tarball, keeps file open.
+     */
+    boost::optional<RoArchive> parent_;
+
     TarIndex index_;
+
+    /** Readahead management, null if disabled.
+     */
+    std::unique_ptr<AccessTracker> tracker_;
+
+    /** Verify header checksums and digests.
+     */
+    bool verify_;
+
+    /** Per-entry CRC-32 from sidecar file, full paths.
+     */
+    DigestMap digests_;
 };
 
 } // namespace
@@ -231,7 +689,16 @@ RoArchive::dpointer
 RoArchive::tarball(const boost::filesystem::path &path
                    , const OpenOptions &openOptions)
 {
-    return std::make_shared<Tarball>(path, openOptions);
+    TraceSpan span(openOptions.observer, Observer::Event::indexBuild, path);
+    return span(std::make_shared<Tarball>(path, openOptions));
+}
+
+RoArchive::dpointer
+RoArchive::tarball(const RoArchive &parent, const boost::filesystem::path &path
+                   , const FileRange &range, const OpenOptions &openOptions)
+{
+    TraceSpan span(openOptions.observer, Observer::Event::indexBuild, path);
+    return span(std::make_shared<Tarball>(parent, path, range, openOptions));
 }
 
 } // namespace roarchive
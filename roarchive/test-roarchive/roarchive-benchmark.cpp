@@ -0,0 +1,496 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/** Benchmark of all backends on synthetic data.
+ *
+ *  Generates directory, tarball and zip datasets with configurable number of
+ *  files, size distribution and directory depth and measures open time,
+ *  lookup throughput, read throughput, listing cost and multi-threaded
+ *  scaling. Results are written to stdout as JSON lines.
+ *
+ *  Usage: roarchive-benchmark WORKDIR [name=value...]
+ *
+ *      files=N         number of files (10000)
+ *      minSize=N       minimum file size in bytes (256)
+ *      maxSize=N       maximum file size in bytes (1048576)
+ *      depth=N         directory depth (3)
+ *      fanout=N        subdirectories per directory (8)
+ *      compress=0|1    deflate zip entries (0)
+ *      threads=N       maximum number of threads in scaling test (8)
+ *      ops=N           number of operations per test (100000)
+ *      backends=LIST   comma-separated subset of directory,tarball,zip
+ *      seed=N          random seed (42)
+ */
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <ctime>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <fstream>
+#include <map>
+
+#include <boost/filesystem.hpp>
+#include <boost/crc.hpp>
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+
+#include "dbglog/dbglog.hpp"
+#include "roarchive/roarchive.hpp"
+
+namespace fs = boost::filesystem;
+namespace bio = boost::iostreams;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Config {
+    std::size_t files = 10000;
+    std::size_t minSize = 256;
+    std::size_t maxSize = 1 << 20;
+    std::size_t depth = 3;
+    std::size_t fanout = 8;
+    bool compress = false;
+    std::size_t threads = 8;
+    std::size_t ops = 100000;
+    std::string backends = "directory,tarball,zip";
+    unsigned int seed = 42;
+
+    void parse(const std::string &arg);
+};
+
+void Config::parse(const std::string &arg)
+{
+    const auto eq(arg.find('='));
+    if (eq == std::string::npos) {
+        LOGTHROW(err3, std::runtime_error)
+            << "Invalid argument <" << arg << ">, expected name=value.";
+    }
+
+    const auto name(arg.substr(0, eq));
+    const auto value(arg.substr(eq + 1));
+
+    if (name == "files") { files = std::stoul(value); }
+    else if (name == "minSize") { minSize = std::stoul(value); }
+    else if (name == "maxSize") { maxSize = std::stoul(value); }
+    else if (name == "depth") { depth = std::stoul(value); }
+    else if (name == "fanout") { fanout = std::stoul(value); }
+    else if (name == "compress") { compress = std::stoul(value); }
+    else if (name == "threads") { threads = std::stoul(value); }
+    else if (name == "ops") { ops = std::stoul(value); }
+    else if (name == "backends") { backends = value; }
+    else if (name == "seed") { seed = std::stoul(value); }
+    else {
+        LOGTHROW(err3, std::runtime_error)
+            << "Unknown argument <" << name << ">.";
+    }
+}
+
+struct File {
+    std::string path;
+    std::size_t size;
+};
+
+typedef std::vector<File> FileList;
+
+/** Generates file list: log-uniform size distribution, files spread over
+ *  directory tree of given depth and fanout.
+ */
+FileList generateFiles(const Config &config)
+{
+    std::mt19937 rng(config.seed);
+    std::uniform_real_distribution<double>
+        size(std::log(double(config.minSize))
+             , std::log(double(config.maxSize)));
+    std::uniform_int_distribution<std::size_t> dir(0, config.fanout - 1);
+
+    FileList files;
+    files.reserve(config.files);
+    for (std::size_t i(0); i < config.files; ++i) {
+        std::string path;
+        for (std::size_t d(0); d < config.depth; ++d) {
+            path += "d" + std::to_string(dir(rng)) + "/";
+        }
+        path += "f" + std::to_string(i) + ".bin";
+        files.push_back({ path, std::size_t(std::exp(size(rng))) });
+    }
+    return files;
+}
+
+/** Semi-compressible file content.
+ */
+std::string content(const File &file)
+{
+    std::string data(file.size, '\0');
+    std::uint32_t state(std::hash<std::string>()(file.path));
+    for (auto &c : data) {
+        state = state * 1103515245 + 12345;
+        c = "abcdefghijklmnop"[(state >> 16) & 0xf];
+    }
+    return data;
+}
+
+void generateDirectory(const fs::path &root, const FileList &files)
+{
+    for (const auto &file : files) {
+        const auto path(root / file.path);
+        fs::create_directories(path.parent_path());
+        std::ofstream f(path.string(), std::ios::binary);
+        const auto data(content(file));
+        f.write(data.data(), data.size());
+    }
+}
+
+template <typename T>
+void octal(char *dst, std::size_t size, T value)
+{
+    std::snprintf(dst, size, "%0*llo", int(size - 1)
+                  , static_cast<unsigned long long>(value));
+}
+
+void generateTarball(const fs::path &path, const FileList &files)
+{
+    std::ofstream f(path.string(), std::ios::binary);
+    f.exceptions(std::ios::badbit | std::ios::failbit);
+
+    const char zeros[512] = { 0 };
+    for (const auto &file : files) {
+        char header[512] = { 0 };
+        if (file.path.size() > 100) {
+            LOGTHROW(err3, std::runtime_error)
+                << "Path <" << file.path << "> too long for tar header.";
+        }
+        std::copy(file.path.begin(), file.path.end(), header);
+        octal(header + 100, 8, 0644);
+        octal(header + 108, 8, 0);
+        octal(header + 116, 8, 0);
+        octal(header + 124, 12, file.size);
+        octal(header + 136, 12, std::time(nullptr));
+        header[156] = '0';
+        std::copy_n("ustar", 6, header + 257);
+        std::copy_n("00", 2, header + 263);
+
+        // checksum is computed with checksum field filled with spaces
+        std::fill_n(header + 148, 8, ' ');
+        unsigned int sum(0);
+        for (auto c : header) { sum += static_cast<unsigned char>(c); }
+        std::snprintf(header + 148, 8, "%06o", sum);
+
+        f.write(header, sizeof(header));
+        const auto data(content(file));
+        f.write(data.data(), data.size());
+        if (const auto pad = (512 - (data.size() % 512)) % 512) {
+            f.write(zeros, pad);
+        }
+    }
+
+    // end of archive
+    f.write(zeros, sizeof(zeros));
+    f.write(zeros, sizeof(zeros));
+}
+
+struct LittleEndian {
+    std::string &out;
+    LittleEndian(std::string &out) : out(out) {}
+    LittleEndian& u16(std::uint16_t v) {
+        out.push_back(char(v)); out.push_back(char(v >> 8));
+        return *this;
+    }
+    LittleEndian& u32(std::uint32_t v) {
+        return u16(std::uint16_t(v)).u16(std::uint16_t(v >> 16));
+    }
+};
+
+/** Generates plain (non-zip64) zip archive: less than 65535 entries and less
+ *  than 4 GiB of data.
+ */
+void generateZip(const fs::path &path, const FileList &files, bool compress)
+{
+    if (files.size() >= 0xffff) {
+        LOGTHROW(err3, std::runtime_error)
+            << "Too many files (" << files.size()
+            << ") for zip archive without zip64 support.";
+    }
+
+    {
+        // deflate can slightly expand incompressible data
+        std::uint64_t total(0);
+        for (const auto &file : files) {
+            total += 30 + file.path.size() + file.size + file.size / 1000 + 64;
+        }
+        if (total > 0xffffffffu) {
+            LOGTHROW(err3, std::runtime_error)
+                << "Too much data (" << total
+                << " bytes) for zip archive without zip64 support.";
+        }
+    }
+
+    std::ofstream f(path.string(), std::ios::binary);
+    f.exceptions(std::ios::badbit | std::ios::failbit);
+
+    std::string cd;
+    std::size_t offset(0);
+    for (const auto &file : files) {
+        const auto data(content(file));
+
+        boost::crc_32_type crc;
+        crc.process_bytes(data.data(), data.size());
+
+        std::string stored;
+        const std::string *payload(&data);
+        if (compress) {
+            bio::zlib_params params;
+            params.noheader = true;
+            bio::filtering_ostream os;
+            os.push(bio::zlib_compressor(params));
+            os.push(bio::back_inserter(stored));
+            os.write(data.data(), data.size());
+            os.reset();
+            payload = &stored;
+        }
+        const std::uint16_t method(compress ? 8 : 0);
+
+        std::string header;
+        LittleEndian(header).u32(0x04034b50).u16(20).u16(0).u16(method)
+            .u16(0).u16(0).u32(crc.checksum()).u32(payload->size())
+            .u32(data.size()).u16(file.path.size()).u16(0);
+        header += file.path;
+
+        LittleEndian(cd).u32(0x02014b50).u16(20).u16(20).u16(0).u16(method)
+            .u16(0).u16(0).u32(crc.checksum()).u32(payload->size())
+            .u32(data.size()).u16(file.path.size()).u16(0).u16(0)
+            .u16(0).u16(0).u32(0).u32(offset);
+        cd += file.path;
+
+        f.write(header.data(), header.size());
+        f.write(payload->data(), payload->size());
+        offset += header.size() + payload->size();
+    }
+
+    std::string eocd;
+    LittleEndian(eocd).u32(0x06054b50).u16(0).u16(0).u16(files.size())
+        .u16(files.size()).u32(cd.size()).u32(offset).u16(0);
+
+    f.write(cd.data(), cd.size());
+    f.write(eocd.data(), eocd.size());
+}
+
+/** Result printer, one JSON object per line.
+ */
+void result(const std::string &backend, const std::string &test
+            , std::size_t threads, std::size_t ops, std::size_t bytes
+            , const Clock::duration &duration)
+{
+    const auto seconds(std::chrono::duration<double>(duration).count());
+    std::cout << "{\"backend\":\"" << backend << "\",\"test\":\"" << test
+              << "\",\"threads\":" << threads
+              << ",\"ops\":" << ops
+              << ",\"bytes\":" << bytes
+              << ",\"seconds\":" << seconds
+              << ",\"opsPerSecond\":" << (seconds ? ops / seconds : 0)
+              << ",\"bytesPerSecond\":" << (seconds ? bytes / seconds : 0)
+              << "}" << std::endl;
+}
+
+/** Runs fn(thread, op) ops times split among given number of threads.
+ */
+template <typename Fn>
+Clock::duration parallel(std::size_t threads, std::size_t ops, const Fn &fn)
+{
+    std::atomic<std::size_t> next(0);
+    const auto start(Clock::now());
+    std::vector<std::thread> workers;
+    for (std::size_t t(0); t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+                for (std::size_t op; (op = next++) < ops; ) { fn(t, op); }
+            });
+    }
+    for (auto &worker : workers) { worker.join(); }
+    return Clock::now() - start;
+}
+
+void benchmark(const std::string &backend, const fs::path &path
+               , const FileList &files, const Config &config)
+{
+    std::mt19937 rng(config.seed);
+
+    // open
+    {
+        const std::size_t count(5);
+        const auto start(Clock::now());
+        for (std::size_t i(0); i < count; ++i) {
+            roarchive::RoArchive archive(path, roarchive::OpenOptions());
+        }
+        result(backend, "open", 1, count, 0, Clock::now() - start);
+    }
+
+    roarchive::RoArchive archive(path, roarchive::OpenOptions());
+
+    // precomputed random access sequence
+    std::vector<std::size_t> sequence(config.ops);
+    {
+        std::uniform_int_distribution<std::size_t> pick(0, files.size() - 1);
+        for (auto &index : sequence) { index = pick(rng); }
+    }
+
+    // exists: half hits, half misses
+    {
+        const auto duration(parallel(1, config.ops, [&](std::size_t
+                                                        , std::size_t op)
+        {
+            const auto &file(files[sequence[op]]);
+            if (op & 1) {
+                archive.exists(file.path);
+            } else {
+                archive.exists(file.path + ".missing");
+            }
+        }));
+        result(backend, "exists", 1, config.ops, 0, duration);
+    }
+
+    // findFile: linear in all backends, do less
+    {
+        const auto ops(std::min<std::size_t>(config.ops, 100));
+        const auto duration(parallel(1, ops, [&](std::size_t, std::size_t op)
+        {
+            archive.findFile(fs::path(files[sequence[op]].path)
+                             .filename().string());
+        }));
+        result(backend, "findFile", 1, ops, 0, duration);
+    }
+
+    // list
+    {
+        const std::size_t ops(3);
+        const auto duration(parallel(1, ops, [&](std::size_t, std::size_t)
+        {
+            archive.list();
+        }));
+        result(backend, "list", 1, ops, 0, duration);
+    }
+
+    // split files to small and large by median size
+    std::vector<std::size_t> small, large;
+    {
+        std::vector<std::size_t> sizes;
+        for (const auto &file : files) { sizes.push_back(file.size); }
+        std::nth_element(sizes.begin(), sizes.begin() + sizes.size() / 2
+                         , sizes.end());
+        const auto median(sizes[sizes.size() / 2]);
+        for (auto index : sequence) {
+            (files[index].size < median ? small : large).push_back(index);
+        }
+    }
+
+    const auto readTest([&](const std::string &test, std::size_t threads
+                            , const std::vector<std::size_t> &indices
+                            , std::size_t ops)
+    {
+        ops = std::min(ops, indices.size());
+        if (!ops) { return; }
+        // per-thread counters in separate cache lines
+        struct Bytes {
+            std::size_t value;
+            char padding[64 - sizeof(std::size_t)];
+        };
+        std::vector<Bytes> bytes(threads, Bytes());
+        const auto duration(parallel(threads, ops, [&](std::size_t t
+                                                       , std::size_t op)
+        {
+            bytes[t].value += archive.istream(files[indices[op]].path)
+                ->read().size();
+        }));
+        std::size_t total(0);
+        for (const auto &b : bytes) { total += b.value; }
+        result(backend, test, threads, ops, total, duration);
+    });
+
+    readTest("readSmall", 1, small, config.ops);
+    readTest("readLarge", 1, large, config.ops / 10);
+
+    // multi-threaded scaling
+    for (std::size_t threads(1); threads <= config.threads; threads *= 2) {
+        readTest("readScaling", threads, sequence, config.ops);
+    }
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        LOG(fatal) << "Missing parameters.";
+        return EXIT_FAILURE;
+    }
+
+    const fs::path workdir(argv[1]);
+    Config config;
+    for (int i(2); i < argc; ++i) { config.parse(argv[i]); }
+
+    if (!config.files || !config.fanout || !config.ops
+        || (config.minSize > config.maxSize) || !config.minSize)
+    {
+        LOG(fatal) << "Invalid configuration.";
+        return EXIT_FAILURE;
+    }
+
+    const auto files(generateFiles(config));
+    fs::create_directories(workdir);
+
+    const auto wanted([&](const std::string &backend) {
+        return (("," + config.backends + ",").find("," + backend + ",")
+                != std::string::npos);
+    });
+
+    if (wanted("directory")) {
+        const auto path(workdir / "directory");
+        fs::remove_all(path);
+        generateDirectory(path, files);
+        benchmark("directory", path, files, config);
+    }
+
+    if (wanted("tarball")) {
+        const auto path(workdir / "archive.tar");
+        generateTarball(path, files);
+        benchmark("tarball", path, files, config);
+    }
+
+    if (wanted("zip")) {
+        const auto path(workdir / "archive.zip");
+        generateZip(path, files, config.compress);
+        benchmark("zip", path, files, config);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,150 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/** Test of roarchive-extract on a directory archive: directories must not
+ *  be reported as failed entries and --prefix matches whole path
+ *  components.
+ *
+ *  usage: test-roarchive-extract ROARCHIVE-EXTRACT WORKDIR
+ */
+
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <map>
+
+#include <boost/filesystem.hpp>
+
+#include "dbglog/dbglog.hpp"
+
+namespace fs = boost::filesystem;
+
+namespace {
+
+typedef std::map<std::string, std::string> Tree;
+
+void write(const fs::path &root, const Tree &tree)
+{
+    for (const auto &item : tree) {
+        const auto path(root / item.first);
+        fs::create_directories(path.parent_path());
+        std::ofstream f(path.string(), std::ios::binary);
+        f << item.second;
+    }
+}
+
+/** Returns true if root holds exactly given tree (regular files only).
+ */
+bool check(const fs::path &root, const Tree &tree)
+{
+    std::size_t found(0);
+    for (fs::recursive_directory_iterator i(root), e; i != e; ++i) {
+        if (!fs::is_regular_file(i->status())) { continue; }
+        ++found;
+
+        const auto path(i->path().string().substr(root.string().size() + 1));
+        const auto ftree(tree.find(path));
+        if (ftree == tree.end()) {
+            LOG(err3) << "Unexpected file " << i->path() << ".";
+            return false;
+        }
+
+        std::ifstream f(i->path().string(), std::ios::binary);
+        const std::string content((std::istreambuf_iterator<char>(f))
+                                  , std::istreambuf_iterator<char>());
+        if (content != ftree->second) {
+            LOG(err3) << "Content of " << i->path() << " differs.";
+            return false;
+        }
+    }
+
+    if (found != tree.size()) {
+        LOG(err3) << "Found " << found << " files in " << root
+                  << ", expected " << tree.size() << ".";
+        return false;
+    }
+    return true;
+}
+
+int extract(const std::string &tool, const fs::path &archive
+            , const fs::path &output, const std::string &options = "")
+{
+    const auto cmd(tool + " " + archive.string() + " " + output.string()
+                   + " " + options);
+    LOG(info3) << "Running: " << cmd;
+    return std::system(cmd.c_str());
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        LOG(fatal) << "Missing parameters.";
+        return EXIT_FAILURE;
+    }
+
+    const std::string tool(argv[1]);
+    const fs::path workdir(argv[2]);
+    fs::remove_all(workdir);
+
+    const Tree tree = {
+        { "a/b.txt", "b" }
+        , { "a/c/d.txt", "d" }
+        , { "data/x", "x" }
+        , { "database/y", "y" }
+        , { "top", "top" }
+    };
+    const auto source(workdir / "source");
+    write(source, tree);
+
+    int failed(0);
+    const auto expect([&](bool ok, const std::string &what) {
+        if (!ok) {
+            LOG(err3) << "FAILED: " << what;
+            ++failed;
+        }
+    });
+
+    // whole archive, directories are not entries
+    expect(!extract(tool, source, workdir / "all"), "extract exit status");
+    expect(check(workdir / "all", tree), "extracted tree");
+
+    // again, overwriting
+    expect(!extract(tool, source, workdir / "all", "--overwrite")
+           , "overwrite exit status");
+    expect(check(workdir / "all", tree), "overwritten tree");
+
+    // prefix selects whole components only
+    expect(!extract(tool, source, workdir / "prefix", "--prefix data")
+           , "prefix exit status");
+    expect(check(workdir / "prefix", { { "data/x", "x" } })
+           , "prefix tree");
+
+    if (failed) { return EXIT_FAILURE; }
+    LOG(info3) << "OK";
+    return EXIT_SUCCESS;
+}
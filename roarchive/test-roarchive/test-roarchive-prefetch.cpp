@@ -0,0 +1,90 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/** Regression test: exists() probe of a resource being prefetched must not
+ *  charge the prefetch buffer twice.
+ *
+ *  usage: test-roarchive-prefetch URL FILE [ITERATIONS]
+ */
+
+#include <cstdlib>
+#include <thread>
+#include <chrono>
+
+#include "dbglog/dbglog.hpp"
+#include "roarchive/roarchive.hpp"
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        LOG(fatal) << "Missing parameters.";
+        return EXIT_FAILURE;
+    }
+
+    const std::string file(argv[2]);
+    const int iterations((argc > 3) ? std::atoi(argv[3]) : 100);
+
+    // no exists cache: every exists() fetches
+    roarchive::OpenOptions oo;
+    oo.setHttpExistsTtl(0);
+    roarchive::RoArchive archive(argv[1], oo);
+
+    const auto cached([&]() { return archive.memoryUsage().cache; });
+
+    std::uint64_t size(0);
+    for (int i(0); i < iterations; ++i) {
+        // probe while prefetch of the same resource is in flight
+        archive.prefetch({ file });
+        if (!archive.exists(file)) {
+            LOG(fatal) << "File <" << file << "> not found.";
+            return EXIT_FAILURE;
+        }
+
+        // let the prefetch finish
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        const auto buffered(cached());
+        if (size && (buffered != size)) {
+            LOG(fatal) << "Iteration " << i << ": " << buffered
+                       << " bytes buffered, expected " << size << ".";
+            return EXIT_FAILURE;
+        }
+
+        // takes the body from the buffer
+        const auto data(archive.istream(file)->read());
+        if (!size) { size = data.size(); }
+
+        if (const auto left = cached()) {
+            LOG(fatal) << "Iteration " << i << ": " << left
+                       << " bytes left in buffer after read.";
+            return EXIT_FAILURE;
+        }
+    }
+
+    LOG(info3) << "OK: " << iterations << " iterations, " << size
+               << " bytes each.";
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,159 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/** Test of tarball listing: entries stored with "./" prefix (as created by
+ *  "tar -C dir -cf archive.tar .") are listed with normalized paths and can
+ *  be opened by both forms of the path.
+ *
+ *  usage: test-roarchive-tar WORKDIR
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <algorithm>
+#include <map>
+
+#include <boost/filesystem.hpp>
+
+#include "dbglog/dbglog.hpp"
+#include "roarchive/roarchive.hpp"
+
+namespace fs = boost::filesystem;
+
+namespace {
+
+typedef std::map<std::string, std::string> Files;
+
+void octal(char *field, std::size_t size, std::uint64_t value)
+{
+    std::snprintf(field, size, "%0*llo", int(size - 1)
+                  , static_cast<unsigned long long>(value));
+}
+
+void generateTarball(const fs::path &path, const Files &files)
+{
+    std::ofstream f(path.string(), std::ios::binary);
+    f.exceptions(std::ios::badbit | std::ios::failbit);
+
+    const char zeros[512] = { 0 };
+    for (const auto &file : files) {
+        char header[512] = { 0 };
+        std::copy(file.first.begin(), file.first.end(), header);
+        octal(header + 100, 8, 0644);
+        octal(header + 108, 8, 0);
+        octal(header + 116, 8, 0);
+        octal(header + 124, 12, file.second.size());
+        octal(header + 136, 12, std::time(nullptr));
+        header[156] = '0';
+        std::copy_n("ustar", 6, header + 257);
+        std::copy_n("00", 2, header + 263);
+
+        std::fill_n(header + 148, 8, ' ');
+        unsigned int sum(0);
+        for (auto c : header) { sum += static_cast<unsigned char>(c); }
+        std::snprintf(header + 148, 8, "%06o", sum);
+
+        f.write(header, sizeof(header));
+        f.write(file.second.data(), file.second.size());
+        if (const auto pad = (512 - (file.second.size() % 512)) % 512) {
+            f.write(zeros, pad);
+        }
+    }
+
+    f.write(zeros, sizeof(zeros));
+    f.write(zeros, sizeof(zeros));
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        LOG(fatal) << "Missing parameters.";
+        return EXIT_FAILURE;
+    }
+
+    const fs::path workdir(argv[1]);
+    fs::create_directories(workdir);
+    const auto path(workdir / "dot.tar");
+
+    const Files stored = {
+        { "./top", "top" }
+        , { "./dir/file", "file" }
+        , { "./dir/./sub//deep", "deep" }
+    };
+    const Files normalized = {
+        { "top", "top" }
+        , { "dir/file", "file" }
+        , { "dir/sub/deep", "deep" }
+    };
+    generateTarball(path, stored);
+
+    roarchive::RoArchive archive(path, roarchive::OpenOptions());
+    int failed(0);
+    const auto expect([&](bool ok, const std::string &what) {
+        if (!ok) {
+            LOG(err3) << "FAILED: " << what;
+            ++failed;
+        }
+    });
+
+    auto listed(archive.list());
+    std::sort(listed.begin(), listed.end());
+    roarchive::Files expected;
+    for (const auto &file : normalized) { expected.push_back(file.first); }
+    expect(listed == expected, "list() returns normalized paths");
+
+    roarchive::Files walked;
+    archive.forEach([&](const roarchive::Entry &entry) {
+        walked.push_back(entry.path);
+    });
+    std::sort(walked.begin(), walked.end());
+    expect(walked == expected, "forEach() reports normalized paths");
+
+    const auto read([&](const fs::path &path) -> std::string {
+        const auto data(archive.istream(path)->read());
+        return std::string(data.begin(), data.end());
+    });
+
+    auto inormalized(normalized.begin());
+    for (const auto &file : stored) {
+        expect(archive.exists(file.first), "exists " + file.first);
+        expect(read(file.first) == file.second, "read " + file.first);
+
+        expect(archive.exists(inormalized->first)
+               , "exists " + inormalized->first);
+        expect(read(inormalized->first) == inormalized->second
+               , "read " + inormalized->first);
+        ++inormalized;
+    }
+
+    if (failed) { return EXIT_FAILURE; }
+    LOG(info3) << "OK";
+    return EXIT_SUCCESS;
+}
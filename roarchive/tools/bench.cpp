@@ -0,0 +1,372 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+
+#include "dbglog/dbglog.hpp"
+
+#include "utility/buildsys.hpp"
+#include "utility/gccversion.hpp"
+#include "utility/streams.hpp"
+
+#include "service/cmdline.hpp"
+
+#include "roarchive/roarchive.hpp"
+#include "roarchive/io.hpp"
+
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Request {
+    std::string path;
+
+    /** Scheduled time relative to replay start (open loop only).
+     */
+    Clock::duration at;
+};
+
+typedef std::vector<Request> Trace;
+
+class Bench : public service::Cmdline
+{
+public:
+    Bench()
+        : service::Cmdline("roarchive-bench", BUILD_TARGET_VERSION)
+        , threads_(1), openLoop_(false), rate_(0), speed_(1.0), repeat_(1)
+        , readahead_(roarchive::Readahead::none), verify_(false)
+        , decompress_(roarchive::Decompress::none)
+    {}
+
+private:
+    virtual void configuration(po::options_description &cmdline
+                               , po::options_description &config
+                               , po::positional_options_description &pd)
+        UTILITY_OVERRIDE;
+
+    virtual void configure(const po::variables_map &vars)
+        UTILITY_OVERRIDE;
+
+    virtual bool help(std::ostream &out, const std::string &what) const
+        UTILITY_OVERRIDE;
+
+    virtual int run() UTILITY_OVERRIDE;
+
+    Trace loadTrace() const;
+
+    fs::path archive_;
+    fs::path trace_;
+    std::size_t threads_;
+    bool openLoop_;
+    double rate_;
+    double speed_;
+    std::size_t repeat_;
+    std::string hint_;
+    roarchive::Readahead readahead_;
+    fs::path sharedIndex_;
+    bool verify_;
+    fs::path tarDigests_;
+    roarchive::Decompress decompress_;
+};
+
+void Bench::configuration(po::options_description &cmdline
+                          , po::options_description &config
+                          , po::positional_options_description &pd)
+{
+    cmdline.add_options()
+        ("archive", po::value(&archive_)->required()
+         , "Archive to open.")
+        ("trace", po::value(&trace_)->required()
+         , "Access trace: one path per line, optionally prefixed with "
+         "timestamp in seconds (\"TIMESTAMP PATH\").")
+        ("threads", po::value(&threads_)->default_value(threads_)
+         , "Number of replay threads.")
+        ("mode", po::value<std::string>()->default_value("closed")
+         , "Replay mode: closed (next request is issued as soon as a thread "
+         "is free) or open (requests are issued at trace timestamps or at "
+         "given --rate regardless of completion).")
+        ("rate", po::value(&rate_)->default_value(rate_)
+         , "Request rate (per second) in open mode; overrides trace "
+         "timestamps if non-zero.")
+        ("speed", po::value(&speed_)->default_value(speed_)
+         , "Trace timestamp speed-up factor in open mode.")
+        ("repeat", po::value(&repeat_)->default_value(repeat_)
+         , "Number of trace replays.")
+        ("hint", po::value(&hint_)
+         , "Archive file hint.")
+        ("readahead", po::value<std::string>()->default_value("none")
+         , "Tarball readahead mode: none, auto, sequential or random.")
+        ("shared-index", po::value(&sharedIndex_)
+         , "Directory for archive index shared between processes "
+         "(e.g. /dev/shm).")
+        ("verify", po::value(&verify_)->default_value(verify_)
+         ->implicit_value(true)
+         , "Verify checksums of read data; compare with a run without "
+         "verification to measure the overhead.")
+        ("tar-digests", po::value(&tarDigests_)
+         , "Tarball entry CRC-32 sidecar file used with --verify.")
+        ("decompress", po::value<std::string>()->default_value("none")
+         , "Decompress read data: none, gzip, zlib, deflate or detect.")
+        ;
+
+    pd.add("archive", 1)
+        .add("trace", 1);
+
+    (void) config;
+}
+
+void Bench::configure(const po::variables_map &vars)
+{
+    if (!repeat_) {
+        throw po::validation_error
+            (po::validation_error::invalid_option_value, "repeat", "0");
+    }
+
+    const auto mode(vars["mode"].as<std::string>());
+    if (mode == "open") {
+        openLoop_ = true;
+    } else if (mode != "closed") {
+        throw po::validation_error
+            (po::validation_error::invalid_option_value, "mode", mode);
+    }
+
+    const auto readahead(vars["readahead"].as<std::string>());
+    if (readahead == "auto") {
+        readahead_ = roarchive::Readahead::automatic;
+    } else if (readahead == "sequential") {
+        readahead_ = roarchive::Readahead::sequential;
+    } else if (readahead == "random") {
+        readahead_ = roarchive::Readahead::random;
+    } else if (readahead != "none") {
+        throw po::validation_error
+            (po::validation_error::invalid_option_value, "readahead"
+             , readahead);
+    }
+
+    const auto decompress(vars["decompress"].as<std::string>());
+    if (decompress == "gzip") {
+        decompress_ = roarchive::Decompress::gzip;
+    } else if (decompress == "zlib") {
+        decompress_ = roarchive::Decompress::zlib;
+    } else if (decompress == "deflate") {
+        decompress_ = roarchive::Decompress::deflate;
+    } else if (decompress == "detect") {
+        decompress_ = roarchive::Decompress::detect;
+    } else if (decompress != "none") {
+        throw po::validation_error
+            (po::validation_error::invalid_option_value, "decompress"
+             , decompress);
+    }
+
+    if (!threads_) {
+        throw po::validation_error
+            (po::validation_error::invalid_option_value, "threads", "0");
+    }
+
+    if (speed_ <= 0.0) {
+        throw po::validation_error
+            (po::validation_error::invalid_option_value, "speed"
+             , std::to_string(speed_));
+    }
+}
+
+bool Bench::help(std::ostream &out, const std::string &what) const
+{
+    if (what.empty()) {
+        out << R"RAW(roarchive-bench
+usage
+    roarchive-bench ARCHIVE TRACE [OPTIONS]
+
+Replays access trace against archive and reports throughput and latency
+percentiles.
+
+)RAW";
+    }
+    return false;
+}
+
+Trace Bench::loadTrace() const
+{
+    std::ifstream f(trace_.string());
+    if (!f) {
+        LOGTHROW(err3, std::runtime_error)
+            << "Cannot open trace file " << trace_ << ".";
+    }
+
+    Trace trace;
+    boost::optional<double> first;
+    std::string line;
+    while (std::getline(f, line)) {
+        if (line.empty() || (line[0] == '#')) { continue; }
+
+        Request request;
+        double timestamp(0);
+
+        // try TIMESTAMP PATH
+        std::istringstream is(line);
+        std::string path;
+        if ((is >> timestamp) && (is.get() == ' ') && std::getline(is, path)) {
+            if (!first) { first = timestamp; }
+            request.path = path;
+            request.at = std::chrono::duration_cast<Clock::duration>
+                (std::chrono::duration<double>
+                 ((timestamp - *first) / speed_));
+        } else {
+            request.path = line;
+            request.at = Clock::duration();
+        }
+
+        trace.push_back(request);
+    }
+
+    if (rate_ > 0.0) {
+        // fixed rate
+        for (std::size_t i(0); i < trace.size(); ++i) {
+            trace[i].at = std::chrono::duration_cast<Clock::duration>
+                (std::chrono::duration<double>(i / rate_));
+        }
+    }
+
+    return trace;
+}
+
+int Bench::run()
+{
+    const auto trace(loadTrace());
+    if (trace.empty()) {
+        LOG(err3) << "Empty trace " << trace_ << ".";
+        return EXIT_FAILURE;
+    }
+
+    roarchive::OpenOptions oo;
+    if (!hint_.empty()) { oo.setHint(hint_); }
+    oo.setTarReadahead(readahead_);
+    oo.setSharedIndex(sharedIndex_);
+    oo.setVerify(verify_, tarDigests_);
+
+    const auto openStart(Clock::now());
+    roarchive::RoArchive archive(archive_, oo);
+    const auto openTime(Clock::now() - openStart);
+
+    const auto total(trace.size() * repeat_);
+    // trace replay period: length of the trace plus one average gap
+    auto period(trace.back().at);
+    if (trace.size() > 1) { period += period / (trace.size() - 1); }
+
+    // one latency sample per request, written by the executing thread
+    std::vector<Clock::duration> latencies(total);
+    std::atomic<std::size_t> next(0);
+    std::atomic<std::size_t> errors(0);
+    std::atomic<std::size_t> bytes(0);
+
+    const auto start(Clock::now());
+
+    const auto worker([&]()
+    {
+        for (std::size_t index; (index = next++) < total; ) {
+            const auto &request(trace[index % trace.size()]);
+
+            Clock::time_point issued;
+            if (openLoop_) {
+                // scheduled time, latency includes time spent waiting for
+                // a free thread
+                issued = start + request.at
+                    + (index / trace.size()) * period;
+                std::this_thread::sleep_until(issued);
+            } else {
+                issued = Clock::now();
+            }
+
+            try {
+                bytes += archive.istream(request.path)->read(decompress_)
+                    .size();
+            } catch (const std::exception &e) {
+                LOG(warn2) << "Failed to read " << request.path << ": "
+                           << e.what();
+                ++errors;
+            }
+
+            latencies[index] = Clock::now() - issued;
+        }
+    });
+
+    std::vector<std::thread> workers;
+    for (std::size_t i(0); i < threads_; ++i) { workers.emplace_back(worker); }
+    for (auto &w : workers) { w.join(); }
+
+    const auto duration(std::chrono::duration<double>
+                        (Clock::now() - start).count());
+
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile([&](double p) -> double
+    {
+        if (latencies.empty()) { return 0.0; }
+        auto index(std::size_t(p * (latencies.size() - 1)));
+        return std::chrono::duration<double, std::micro>
+            (latencies[index]).count();
+    });
+
+    std::cout
+        << "archive: " << archive_.string()
+        << "\nmode: " << (openLoop_ ? "open" : "closed")
+        << "\nthreads: " << threads_
+        << "\nverify: " << (verify_ ? "yes" : "no")
+        << "\nopen: " << std::chrono::duration<double, std::milli>
+        (openTime).count() << " ms"
+        << "\nrequests: " << total
+        << "\nerrors: " << errors
+        << "\nbytes: " << bytes
+        << "\nduration: " << duration << " s"
+        << "\nthroughput: " << (total / duration) << " req/s, "
+        << (bytes / duration / (1 << 20)) << " MiB/s"
+        << "\nlatency p50: " << percentile(0.5) << " us"
+        << "\nlatency p99: " << percentile(0.99) << " us"
+        << "\nlatency p999: " << percentile(0.999) << " us"
+        << "\n\n" << archive.stats()
+        << "\n" << roarchive::memoryReport();
+    std::cout.flush();
+
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    return Bench()(argc, argv);
+}
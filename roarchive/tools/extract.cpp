@@ -0,0 +1,291 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fnmatch.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <set>
+
+#include <boost/filesystem.hpp>
+
+#include "dbglog/dbglog.hpp"
+
+#include "utility/buildsys.hpp"
+#include "utility/gccversion.hpp"
+#include "utility/streams.hpp"
+
+#include "service/cmdline.hpp"
+
+#include "roarchive/roarchive.hpp"
+
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+
+namespace {
+
+class Extract : public service::Cmdline
+{
+public:
+    Extract()
+        : service::Cmdline("roarchive-extract", BUILD_TARGET_VERSION)
+        , threads_(std::max(1u, std::thread::hardware_concurrency()))
+        , overwrite_(false)
+    {}
+
+private:
+    virtual void configuration(po::options_description &cmdline
+                               , po::options_description &config
+                               , po::positional_options_description &pd)
+        UTILITY_OVERRIDE;
+
+    virtual void configure(const po::variables_map &vars)
+        UTILITY_OVERRIDE;
+
+    virtual bool help(std::ostream &out, const std::string &what) const
+        UTILITY_OVERRIDE;
+
+    virtual int run() UTILITY_OVERRIDE;
+
+    bool selected(const fs::path &path) const;
+
+    fs::path archive_;
+    fs::path output_;
+    std::size_t threads_;
+    std::string prefix_;
+    std::vector<std::string> globs_;
+    std::string hint_;
+    bool overwrite_;
+};
+
+void Extract::configuration(po::options_description &cmdline
+                            , po::options_description &config
+                            , po::positional_options_description &pd)
+{
+    cmdline.add_options()
+        ("archive", po::value(&archive_)->required()
+         , "Archive to open.")
+        ("output", po::value(&output_)->required()
+         , "Output directory.")
+        ("threads", po::value(&threads_)->default_value(threads_)
+         , "Number of extraction threads.")
+        ("prefix", po::value(&prefix_)
+         , "Extract only files under given path prefix.")
+        ("glob", po::value(&globs_)
+         , "Extract only files matching given shell pattern. "
+         "Can be used multiple times.")
+        ("hint", po::value(&hint_)
+         , "Archive file hint.")
+        ("overwrite", "Overwrite existing files.")
+        ;
+
+    pd.add("archive", 1)
+        .add("output", 1);
+
+    (void) config;
+}
+
+void Extract::configure(const po::variables_map &vars)
+{
+    overwrite_ = vars.count("overwrite");
+    if (!threads_) { threads_ = 1; }
+
+    // prefix is matched by whole path components
+    while (!prefix_.empty() && (prefix_.back() == '/')) { prefix_.pop_back(); }
+}
+
+bool Extract::help(std::ostream &out, const std::string &what) const
+{
+    if (what.empty()) {
+        out << R"RAW(roarchive-extract
+usage
+    roarchive-extract ARCHIVE OUTPUT [OPTIONS]
+
+Extracts whole archive or its subset into output directory in parallel.
+
+)RAW";
+    }
+    return false;
+}
+
+bool Extract::selected(const fs::path &path) const
+{
+    const auto str(path.string());
+    if (!prefix_.empty()
+        && (str.compare(0, prefix_.size(), prefix_)
+            || ((str.size() > prefix_.size())
+                && (str[prefix_.size()] != '/'))))
+    {
+        return false;
+    }
+
+    if (globs_.empty()) { return true; }
+    for (const auto &glob : globs_) {
+        if (!::fnmatch(glob.c_str(), str.c_str(), 0)) { return true; }
+    }
+    return false;
+}
+
+/** Archive entry must not escape output directory: no absolute paths, no
+ *  parent references.
+ */
+bool safe(const fs::path &path)
+{
+    if (path.has_root_path()) { return false; }
+    for (const auto &component : path) {
+        if (component == "..") { return false; }
+    }
+    return true;
+}
+
+/** Checks that directory resolves inside root, i.e. that there is no symlink
+ *  leading elsewhere. Only the existing part of the path is resolved, the
+ *  rest is created as plain directories.
+ */
+bool inside(const fs::path &root, fs::path dir)
+{
+    while (!fs::exists(dir)) { dir = dir.parent_path(); }
+    const auto resolved(fs::canonical(dir));
+    auto r(root.begin());
+    for (auto d(resolved.begin()); r != root.end(); ++r, ++d) {
+        if ((d == resolved.end()) || (*d != *r)) { return false; }
+    }
+    return true;
+}
+
+int Extract::run()
+{
+    roarchive::OpenOptions oo;
+    if (!hint_.empty()) { oo.setHint(hint_); }
+    roarchive::RoArchive archive(archive_, oo);
+
+    std::size_t total(0), rejected(0);
+    const auto reject([&](const fs::path &path)
+    {
+        LOG(err3) << "Refusing to extract " << path
+                  << ": path escapes output directory.";
+        ++rejected;
+    });
+
+    // forEach reports files only, list() includes directories in some
+    // backends
+    roarchive::Files files;
+    archive.forEach([&](const roarchive::Entry &entry)
+    {
+        const auto &path(entry.path);
+        if (!selected(path)) { return; }
+        ++total;
+        if (!safe(path)) {
+            reject(path);
+            return;
+        }
+        files.push_back(path);
+    });
+
+    // create all directories up front, each only once; symlinks already
+    // present in the output directory must not lead outside of it
+    {
+        fs::create_directories(output_);
+        const auto root(fs::canonical(output_));
+
+        std::set<fs::path> dirs;
+        for (const auto &path : files) {
+            dirs.insert((output_ / path).parent_path());
+        }
+
+        std::set<fs::path> escaping;
+        for (const auto &dir : dirs) {
+            if (!inside(root, dir)) {
+                escaping.insert(dir);
+                continue;
+            }
+            fs::create_directories(dir);
+        }
+
+        if (!escaping.empty()) {
+            roarchive::Files kept;
+            for (const auto &path : files) {
+                if (escaping.count((output_ / path).parent_path())) {
+                    reject(path);
+                } else {
+                    kept.push_back(path);
+                }
+            }
+            files.swap(kept);
+        }
+    }
+
+    std::atomic<std::size_t> next(0);
+    std::atomic<std::size_t> errors(rejected);
+
+    const auto worker([&]()
+    {
+        for (std::size_t index; (index = next++) < files.size(); ) {
+            const auto &path(files[index]);
+            const auto out(output_ / path);
+
+            try {
+                if (fs::is_symlink(out)) {
+                    LOG(err3) << "Refusing to extract " << path
+                              << ": " << out << " is a symlink.";
+                    ++errors;
+                    continue;
+                }
+
+                if (!overwrite_ && fs::exists(out)) {
+                    LOG(warn3) << "File " << out << " already exists.";
+                    ++errors;
+                    continue;
+                }
+
+                // kernel-side copy when the entry is a plain file range
+                roarchive::copy(archive.istream(path), out);
+            } catch (const std::exception &e) {
+                LOG(err3) << "Failed to extract " << path << ": "
+                          << e.what();
+                ++errors;
+            }
+        }
+    });
+
+    std::vector<std::thread> workers;
+    for (std::size_t i(0); i < threads_; ++i) { workers.emplace_back(worker); }
+    for (auto &w : workers) { w.join(); }
+
+    LOG(info3) << "Extracted " << (total - errors) << " of "
+               << total << " files into " << output_ << ".";
+
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    return Extract()(argc, argv);
+}
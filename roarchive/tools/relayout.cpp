@@ -0,0 +1,581 @@
+/**
+ * Copyright (c) 2017 Melown Technologies SE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * *  Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * *  Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <fnmatch.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+#include <system_error>
+
+#include <boost/filesystem.hpp>
+
+#include "dbglog/dbglog.hpp"
+
+#include "utility/buildsys.hpp"
+#include "utility/gccversion.hpp"
+
+#include "service/cmdline.hpp"
+
+#include "roarchive/roarchive.hpp"
+
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+
+namespace {
+
+const std::size_t BlockSize(512);
+
+/** Tar record size: output is padded to multiple of 20 blocks like tar(1)
+ *  does.
+ */
+const std::size_t RecordSize(20 * BlockSize);
+
+struct File {
+    std::string path;
+    std::time_t timestamp;
+    boost::optional<std::size_t> firstAccess;
+
+    File(const std::string &path, std::time_t timestamp)
+        : path(path), timestamp(timestamp)
+    {}
+};
+
+typedef std::vector<File> FileList;
+
+/** Minimal POSIX tar writer: ustar headers, pax extended header for paths
+ *  that do not fit into ustar name/prefix fields.
+ */
+class TarWriter {
+public:
+    TarWriter(const fs::path &path, bool overwrite)
+        : path_(path), written_()
+        , fd_(::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC
+                     | (overwrite ? O_TRUNC : O_EXCL), 0644))
+    {
+        if (fd_ < 0) {
+            std::system_error e(errno, std::system_category());
+            LOGTHROW(err3, std::runtime_error)
+                << "Cannot create output tarball " << path_ << ": <"
+                << e.what() << ">.";
+        }
+    }
+
+    ~TarWriter() { if (fd_ >= 0) { ::close(fd_); } }
+
+    void add(const std::string &path, std::time_t timestamp
+             , const roarchive::IStream::pointer &is);
+
+    /** Writes end of archive marker, pads to full record and closes the
+     *  file.
+     */
+    void finish();
+
+private:
+    void header(const std::string &name, std::size_t size
+                , std::time_t timestamp, char type
+                , const std::string &prefix = std::string());
+
+    void write(const char *data, std::size_t size);
+    void pad();
+
+    const fs::path path_;
+    std::size_t written_;
+    int fd_;
+};
+
+void octal(char *field, std::size_t size, std::uint64_t value)
+{
+    if (value >> (3 * (size - 1))) {
+        // does not fit, GNU base-256 encoding
+        field[0] = char(0x80);
+        for (auto i(size - 1); i; --i, value >>= 8) {
+            field[i] = char(value & 0xff);
+        }
+        return;
+    }
+    std::snprintf(field, size, "%0*llo", int(size - 1)
+                  , static_cast<unsigned long long>(value));
+}
+
+/** Splits path into ustar prefix and name. Returns false if impossible.
+ */
+bool split(const std::string &path, std::string &prefix, std::string &name)
+{
+    if (path.size() <= 100) {
+        prefix.clear();
+        name = path;
+        return true;
+    }
+
+    for (auto slash(path.find('/')); slash != std::string::npos
+             ; slash = path.find('/', slash + 1))
+    {
+        if (slash > 155) { break; }
+        if ((path.size() - slash - 1) <= 100) {
+            prefix = path.substr(0, slash);
+            name = path.substr(slash + 1);
+            return !name.empty();
+        }
+    }
+    return false;
+}
+
+/** Builds pax extended header record "LENGTH path=PATH\n"; the length
+ *  includes its own digits.
+ */
+std::string paxPathRecord(const std::string &path)
+{
+    const auto payload(" path=" + path + "\n");
+    auto length(payload.size());
+    for (;;) {
+        const auto total(payload.size() + std::to_string(length).size());
+        if (total == length) { break; }
+        length = total;
+    }
+    return std::to_string(length) + payload;
+}
+
+void TarWriter::header(const std::string &name, std::size_t size
+                       , std::time_t timestamp, char type
+                       , const std::string &prefix)
+{
+    char block[BlockSize] = { 0 };
+
+    std::memcpy(block, name.data(), std::min(name.size(), std::size_t(100)));
+    octal(block + 100, 8, 0644);
+    octal(block + 108, 8, 0);
+    octal(block + 116, 8, 0);
+    octal(block + 124, 12, size);
+    octal(block + 136, 12, std::max(timestamp, std::time_t(0)));
+    block[156] = type;
+    std::memcpy(block + 257, "ustar", 6);
+    std::memcpy(block + 263, "00", 2);
+    std::memcpy(block + 345, prefix.data()
+                , std::min(prefix.size(), std::size_t(155)));
+
+    // checksum is computed with checksum field filled with spaces
+    std::memset(block + 148, ' ', 8);
+    unsigned int checksum(0);
+    for (auto c : block) { checksum += static_cast<unsigned char>(c); }
+    std::snprintf(block + 148, 8, "%06o", checksum);
+    block[155] = ' ';
+
+    write(block, sizeof(block));
+}
+
+void TarWriter::add(const std::string &path, std::time_t timestamp
+                    , const roarchive::IStream::pointer &is)
+{
+    std::string prefix, name;
+    if (!split(path, prefix, name)) {
+        // too long for ustar: pax extended header carries the full path
+        const auto record(paxPathRecord(path));
+        header("PaxHeader/" + fs::path(path).filename().string().substr(0, 90)
+               , record.size(), timestamp, 'x');
+        write(record.data(), record.size());
+        pad();
+
+        prefix.clear();
+        name = path.substr(path.size() - std::min(path.size()
+                                                  , std::size_t(100)));
+    }
+
+    if (const auto size = is->size()) {
+        header(name, *size, timestamp, '0', prefix);
+        const auto start(written_);
+        roarchive::copy(is, fd_);
+        written_ = ::lseek(fd_, 0, SEEK_CUR);
+        if ((written_ - start) != *size) {
+            LOGTHROW(err3, std::runtime_error)
+                << "Size mismatch while copying " << path << ": expected "
+                << *size << " bytes, got " << (written_ - start) << ".";
+        }
+    } else {
+        // unknown size (e.g. chunked HTTP): read whole file first
+        const auto data(is->read());
+        header(name, data.size(), timestamp, '0', prefix);
+        write(data.data(), data.size());
+    }
+    pad();
+}
+
+void TarWriter::finish()
+{
+    const char zero[2 * BlockSize] = { 0 };
+    write(zero, sizeof(zero));
+
+    if (const auto tail = written_ % RecordSize) {
+        const std::vector<char> padding(RecordSize - tail);
+        write(padding.data(), padding.size());
+    }
+
+    if (::close(fd_)) {
+        fd_ = -1;
+        std::system_error e(errno, std::system_category());
+        LOGTHROW(err3, std::runtime_error)
+            << "Cannot close output tarball " << path_ << ": <"
+            << e.what() << ">.";
+    }
+    fd_ = -1;
+}
+
+void TarWriter::pad()
+{
+    if (const auto tail = written_ % BlockSize) {
+        const char zero[BlockSize] = { 0 };
+        write(zero, BlockSize - tail);
+    }
+}
+
+void TarWriter::write(const char *data, std::size_t size)
+{
+    while (size) {
+        const auto w(::write(fd_, data, size));
+        if (w < 0) {
+            if (errno == EINTR) { continue; }
+            std::system_error e(errno, std::system_category());
+            LOGTHROW(err3, std::runtime_error)
+                << "Cannot write to output tarball " << path_ << ": <"
+                << e.what() << ">.";
+        }
+        data += w;
+        size -= w;
+        written_ += w;
+    }
+}
+
+class Relayout : public service::Cmdline
+{
+public:
+    Relayout()
+        : service::Cmdline("roarchive-relayout", BUILD_TARGET_VERSION)
+        , window_(8), overwrite_(false)
+    {}
+
+private:
+    virtual void configuration(po::options_description &cmdline
+                               , po::options_description &config
+                               , po::positional_options_description &pd)
+        UTILITY_OVERRIDE;
+
+    virtual void configure(const po::variables_map &vars)
+        UTILITY_OVERRIDE;
+
+    virtual bool help(std::ostream &out, const std::string &what) const
+        UTILITY_OVERRIDE;
+
+    virtual int run() UTILITY_OVERRIDE;
+
+    std::vector<std::size_t> loadTrace(FileList &files) const;
+
+    std::vector<std::size_t> order(FileList &files) const;
+
+    fs::path archive_;
+    fs::path trace_;
+    fs::path output_;
+    std::size_t window_;
+    std::string hint_;
+    std::vector<std::string> front_;
+    bool overwrite_;
+};
+
+void Relayout::configuration(po::options_description &cmdline
+                             , po::options_description &config
+                             , po::positional_options_description &pd)
+{
+    cmdline.add_options()
+        ("archive", po::value(&archive_)->required()
+         , "Archive to re-layout.")
+        ("trace", po::value(&trace_)->required()
+         , "Access trace: one path per line, optionally prefixed with "
+         "timestamp in seconds (\"TIMESTAMP PATH\"), same as "
+         "roarchive-bench input.")
+        ("output", po::value(&output_)->required()
+         , "Output tarball.")
+        ("window", po::value(&window_)->default_value(window_)
+         , "Co-access window: files requested at most this many requests "
+         "apart are considered to be read together.")
+        ("hint", po::value(&hint_)
+         , "Archive file hint; matching files are placed at the very "
+         "beginning of the output.")
+        ("front", po::value(&front_)
+         , "Files matching given shell pattern (e.g. metadata) are placed "
+         "right after the hint file. Can be used multiple times.")
+        ("overwrite", "Overwrite existing output file.")
+        ;
+
+    pd.add("archive", 1)
+        .add("trace", 1)
+        .add("output", 1);
+
+    (void) config;
+}
+
+void Relayout::configure(const po::variables_map &vars)
+{
+    overwrite_ = vars.count("overwrite");
+    if (!window_) {
+        throw po::validation_error
+            (po::validation_error::invalid_option_value, "window", "0");
+    }
+}
+
+bool Relayout::help(std::ostream &out, const std::string &what) const
+{
+    if (what.empty()) {
+        out << R"RAW(roarchive-relayout
+usage
+    roarchive-relayout ARCHIVE TRACE OUTPUT [OPTIONS]
+
+Rewrites archive into a plain tarball with files ordered by access trace:
+hint file and metadata first, then files read together are placed next to
+each other, followed by files never seen in the trace.
+
+Output is a standard POSIX tar readable by any roarchive version.
+
+)RAW";
+    }
+    return false;
+}
+
+/** Loads trace and maps each request to file index. Trace paths are matched
+ *  either exactly or as a path suffix (trace recorded with hint is relative
+ *  to hinted directory).
+ */
+std::vector<std::size_t> Relayout::loadTrace(FileList &files) const
+{
+    std::ifstream f(trace_.string());
+    if (!f) {
+        LOGTHROW(err3, std::runtime_error)
+            << "Cannot open trace file " << trace_ << ".";
+    }
+
+    std::vector<std::string> paths;
+    std::string line;
+    while (std::getline(f, line)) {
+        if (line.empty() || (line[0] == '#')) { continue; }
+
+        // try TIMESTAMP PATH
+        std::istringstream is(line);
+        double timestamp;
+        std::string path;
+        if ((is >> timestamp) && (is.get() == ' ') && std::getline(is, path)) {
+            paths.push_back(path);
+        } else {
+            paths.push_back(line);
+        }
+    }
+
+    std::unordered_map<std::string, std::size_t> mapping;
+    for (std::size_t i(0); i < files.size(); ++i) {
+        mapping.emplace(files[i].path, i);
+    }
+
+    // resolve trace paths not found verbatim by suffix
+    std::unordered_map<std::string, std::size_t> suffixes;
+    for (const auto &path : paths) {
+        if (!mapping.count(path)) { suffixes.emplace(path, files.size()); }
+    }
+    if (!suffixes.empty()) {
+        for (std::size_t i(0); i < files.size(); ++i) {
+            const auto &path(files[i].path);
+            for (auto slash(path.find('/')); slash != std::string::npos
+                     ; slash = path.find('/', slash + 1))
+            {
+                auto fs(suffixes.find(path.substr(slash + 1)));
+                if ((fs != suffixes.end()) && (fs->second == files.size())) {
+                    fs->second = i;
+                }
+            }
+        }
+    }
+
+    std::vector<std::size_t> trace;
+    std::size_t unknown(0);
+    for (const auto &path : paths) {
+        auto fmapping(mapping.find(path));
+        auto index((fmapping != mapping.end())
+                   ? fmapping->second : suffixes[path]);
+        if (index == files.size()) { ++unknown; continue; }
+
+        if (!files[index].firstAccess) {
+            files[index].firstAccess = trace.size();
+        }
+        trace.push_back(index);
+    }
+
+    if (unknown) {
+        LOG(warn3) << unknown << " trace requests do not match any file in "
+                   << "the archive; ignored.";
+    }
+
+    return trace;
+}
+
+/** Computes output order.
+ *
+ *  1) hint file(s)
+ *  2) files matching --front patterns
+ *  3) traced files: greedy chain over co-access graph; next file is the
+ *     unplaced file most often read together with the last placed one,
+ *     ties and gaps resolved by first access
+ *  4) rest in archive order
+ */
+std::vector<std::size_t> Relayout::order(FileList &files) const
+{
+    const auto trace(loadTrace(files));
+
+    std::vector<std::size_t> order;
+    std::vector<bool> placed(files.size(), false);
+    const auto place([&](std::size_t index)
+    {
+        if (placed[index]) { return; }
+        placed[index] = true;
+        order.push_back(index);
+    });
+
+    if (!hint_.empty()) {
+        for (std::size_t i(0); i < files.size(); ++i) {
+            if (fs::path(files[i].path).filename() == hint_) { place(i); }
+        }
+    }
+
+    for (const auto &pattern : front_) {
+        for (std::size_t i(0); i < files.size(); ++i) {
+            if (!::fnmatch(pattern.c_str(), files[i].path.c_str(), 0)) {
+                place(i);
+            }
+        }
+    }
+
+    // co-access graph: edge weight = number of times two files were
+    // requested within the window
+    std::unordered_map<std::size_t
+                       , std::unordered_map<std::size_t, std::size_t>> graph;
+    for (std::size_t i(0); i < trace.size(); ++i) {
+        const auto end(std::min(trace.size(), i + 1 + window_));
+        for (auto j(i + 1); j < end; ++j) {
+            if (trace[i] == trace[j]) { continue; }
+            ++graph[trace[i]][trace[j]];
+            ++graph[trace[j]][trace[i]];
+        }
+    }
+
+    // traced files by first access
+    std::vector<std::size_t> traced;
+    for (std::size_t i(0); i < files.size(); ++i) {
+        if (files[i].firstAccess) { traced.push_back(i); }
+    }
+    std::sort(traced.begin(), traced.end()
+              , [&](std::size_t l, std::size_t r) {
+                  return *files[l].firstAccess < *files[r].firstAccess;
+              });
+
+    auto next(traced.begin());
+    boost::optional<std::size_t> last;
+    for (;;) {
+        boost::optional<std::size_t> best;
+        if (last) {
+            std::size_t weight(0);
+            for (const auto &edge : graph[*last]) {
+                if (placed[edge.first]) { continue; }
+                if ((edge.second > weight)
+                    || ((edge.second == weight)
+                        && (*files[edge.first].firstAccess
+                            < *files[*best].firstAccess)))
+                {
+                    best = edge.first;
+                    weight = edge.second;
+                }
+            }
+        }
+
+        if (!best) {
+            while ((next != traced.end()) && placed[*next]) { ++next; }
+            if (next == traced.end()) { break; }
+            best = *next;
+        }
+
+        place(*best);
+        last = best;
+    }
+
+    const auto tracedCount(order.size());
+
+    for (std::size_t i(0); i < files.size(); ++i) { place(i); }
+
+    LOG(info3) << "Placed " << tracedCount << " hinted/traced files at the "
+               << "front, " << (order.size() - tracedCount)
+               << " untouched files follow.";
+
+    return order;
+}
+
+int Relayout::run()
+{
+    roarchive::OpenOptions oo;
+    roarchive::RoArchive archive(archive_, oo);
+
+    // source archive time for entries without own timestamp
+    const auto defaultTimestamp(fs::last_write_time(archive_));
+
+    FileList files;
+    archive.forEach([&](const roarchive::Entry &entry)
+    {
+        files.emplace_back(entry.path.string()
+                           , ((entry.timestamp >= 0)
+                              ? entry.timestamp : defaultTimestamp));
+    });
+
+    const auto layout(order(files));
+
+    TarWriter writer(output_, overwrite_);
+    for (const auto index : layout) {
+        const auto &file(files[index]);
+        writer.add(file.path, file.timestamp, archive.istream(file.path));
+    }
+    writer.finish();
+
+    LOG(info3) << "Written " << layout.size() << " files into "
+               << output_ << ".";
+
+    return EXIT_SUCCESS;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    return Relayout()(argc, argv);
+}
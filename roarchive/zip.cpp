@@ -23,7 +23,19 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
-#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <type_traits>
+#include <cstdint>
+#include <system_error>
+
+#include <boost/iostreams/filter/zlib.hpp>
 
 #include "dbglog/dbglog.hpp"
 
@@ -31,8 +43,12 @@
 #include "utility/streams.hpp"
 #include "utility/path.hpp"
 #include "utility/zip.hpp"
+#include "utility/substream.hpp"
 
 #include "detail.hpp"
+#include "pathindex.hpp"
+#include "sharedindex.hpp"
+#include "checksum.hpp"
 #include "io.hpp"
 
 namespace fs = boost::filesystem;
@@ -42,15 +58,284 @@ namespace roarchive {
 
 namespace {
 
+/** Low-level access to zip central directory.
+ *
+ *  utility::zip::Reader exposes neither entry data offsets nor CRCs, so we
+ *  parse central directory ourselves. Parsed entries serve as the archive's
+ *  index; the directory itself only keeps the archive file open.
+ *
+ *  Also used to read zip archives stored verbatim inside another file, in
+ *  which case all offsets are relative to the start of the embedded zip.
+ */
+class ZipDirectory {
+public:
+    typedef std::shared_ptr<ZipDirectory> pointer;
+
+    /** Entry record, stored as index value. Plain data with no implicit
+     *  padding since it is written to (and mapped from) shared index files.
+     */
+    struct Entry {
+        std::uint16_t method;
+        std::uint16_t reserved;
+        std::uint32_t crc32;
+        std::uint64_t compressedSize;
+        std::uint64_t uncompressedSize;
+        std::uint64_t headerOffset;
+    };
+
+    typedef PathMap<Entry> Entries;
+
+    /** Opens zip archive file.
+     */
+    ZipDirectory(const fs::path &path);
+
+    /** Zip archive in given range of already open file (not owned).
+     */
+    ZipDirectory(const FileRange &range)
+        : path_(range.path), fd_(range.fd), owned_(false)
+        , base_(range.start), size_(range.size())
+    {}
+
+    ~ZipDirectory() { if (owned_) { ::close(fd_); } }
+
+    ZipDirectory(const ZipDirectory&) = delete;
+    ZipDirectory& operator=(const ZipDirectory&) = delete;
+
+    /** Parses central directory, at most limit entries. Every call parses
+     *  again, result is meant to be kept by the caller.
+     */
+    Entries entries(std::size_t limit) const;
+
+    /** Returns range of entry's (possibly compressed) data.
+     */
+    FileRange data(const Entry &entry, const std::string &path) const;
+
+private:
+    void readAt(void *buf, std::size_t size, std::uint64_t offset) const;
+
+    const fs::path path_;
+    int fd_;
+    const bool owned_;
+
+    /** Start of zip archive in the file.
+     */
+    const std::uint64_t base_;
+    std::uint64_t size_;
+};
+
+template <typename T> T le(const unsigned char *p)
+{
+    T value(0);
+    for (std::size_t i(sizeof(T)); i--; ) { value = (value << 8) | p[i]; }
+    return value;
+}
+
+void ZipDirectory::readAt(void *buf, std::size_t size
+                          , std::uint64_t offset) const
+{
+    auto *data(static_cast<char*>(buf));
+    while (size) {
+        const auto got(::pread(fd_, data, size, base_ + offset));
+        if (got < 0) {
+            if (errno == EINTR) { continue; }
+            std::system_error e(errno, std::system_category());
+            LOGTHROW(err2, IOError)
+                << "Cannot read zip archive " << path_ << ": <"
+                << e.what() << ">.";
+        }
+        if (!got) {
+            LOGTHROW(err2, IOError)
+                << "Unexpected end of zip archive " << path_ << ".";
+        }
+        data += got;
+        size -= got;
+        offset += got;
+    }
+}
+
+ZipDirectory::ZipDirectory(const fs::path &path)
+    : path_(path), fd_(::open(path.c_str(), O_RDONLY | O_CLOEXEC))
+    , owned_(true), base_(0), size_(0)
+{
+    if (fd_ < 0) {
+        std::system_error e(errno, std::system_category());
+        LOGTHROW(err2, IOError)
+            << "Cannot open zip archive " << path_ << ": <"
+            << e.what() << ">.";
+    }
+
+    struct ::stat st;
+    if (::fstat(fd_, &st)) {
+        std::system_error e(errno, std::system_category());
+        ::close(fd_);
+        LOGTHROW(err2, IOError)
+            << "Cannot stat zip archive " << path_ << ": <"
+            << e.what() << ">.";
+    }
+    size_ = st.st_size;
+}
+
+ZipDirectory::Entries ZipDirectory::entries(std::size_t limit) const
+{
+    const std::uint64_t size(size_);
+
+    // end of central directory record: 22 bytes + up to 64k of comment
+    const std::size_t tail(std::min<std::uint64_t>(size, 22 + 0xffff));
+    if (tail < 22) {
+        LOGTHROW(err2, NotAnArchive)
+            << "File " << path_ << " is too short to be a zip archive.";
+    }
+    std::vector<unsigned char> buf(tail);
+    readAt(buf.data(), tail, size - tail);
+
+    std::size_t eocd(tail - 22 + 1);
+    while (eocd-- > 0) {
+        if (le<std::uint32_t>(&buf[eocd]) == 0x06054b50) { break; }
+    }
+    if (eocd > tail) {
+        LOGTHROW(err2, NotAnArchive)
+            << "No end of central directory found in " << path_ << ".";
+    }
+
+    const auto *e(&buf[eocd]);
+    std::uint64_t count(le<std::uint16_t>(e + 10));
+    std::uint64_t cdSize(le<std::uint32_t>(e + 12));
+    std::uint64_t cdOffset(le<std::uint32_t>(e + 16));
+
+    if ((count == 0xffff) || (cdSize == 0xffffffff)
+        || (cdOffset == 0xffffffff))
+    {
+        // zip64: locator precedes end of central directory record
+        unsigned char locator[20];
+        readAt(locator, sizeof(locator), size - tail + eocd - 20);
+        if (le<std::uint32_t>(locator) != 0x07064b50) {
+            LOGTHROW(err2, NotAnArchive)
+                << "Invalid zip64 locator in " << path_ << ".";
+        }
+
+        unsigned char record[56];
+        readAt(record, sizeof(record), le<std::uint64_t>(locator + 8));
+        if (le<std::uint32_t>(record) != 0x06064b50) {
+            LOGTHROW(err2, NotAnArchive)
+                << "Invalid zip64 end of central directory in "
+                << path_ << ".";
+        }
+
+        count = le<std::uint64_t>(record + 32);
+        cdSize = le<std::uint64_t>(record + 40);
+        cdOffset = le<std::uint64_t>(record + 48);
+    }
+
+    if ((cdOffset + cdSize) > size) {
+        LOGTHROW(err2, NotAnArchive)
+            << "Central directory out of file bounds in " << path_ << ".";
+    }
+
+    std::vector<unsigned char> cd(cdSize);
+    readAt(cd.data(), cd.size(), cdOffset);
+
+    PathMap<Entry>::Builder builder;
+    std::size_t pos(0), files(0);
+    for (std::uint64_t i(0); (i < count) && (files < limit); ++i) {
+        if (((pos + 46) > cd.size())
+            || (le<std::uint32_t>(&cd[pos]) != 0x02014b50))
+        {
+            LOGTHROW(err2, NotAnArchive)
+                << "Invalid central directory entry in " << path_ << ".";
+        }
+
+        const auto *h(&cd[pos]);
+        Entry entry = {};
+        entry.method = le<std::uint16_t>(h + 10);
+        entry.crc32 = le<std::uint32_t>(h + 16);
+        entry.compressedSize = le<std::uint32_t>(h + 20);
+        entry.uncompressedSize = le<std::uint32_t>(h + 24);
+        entry.headerOffset = le<std::uint32_t>(h + 42);
+        const std::size_t nameLength(le<std::uint16_t>(h + 28));
+        const std::size_t extraLength(le<std::uint16_t>(h + 30));
+        const std::size_t commentLength(le<std::uint16_t>(h + 32));
+
+        const auto next(pos + 46 + nameLength + extraLength + commentLength);
+        if (next > cd.size()) {
+            LOGTHROW(err2, NotAnArchive)
+                << "Invalid central directory entry in " << path_ << ".";
+        }
+
+        const std::string name(reinterpret_cast<const char*>(h + 46)
+                               , nameLength);
+
+        // zip64 extended information: only fields saturated in the header
+        const auto *x(h + 46 + nameLength);
+        const auto *xe(x + extraLength);
+        while ((x + 4) <= xe) {
+            const auto id(le<std::uint16_t>(x));
+            const auto *v(x + 4);
+            const auto *ve(std::min(xe, v + le<std::uint16_t>(x + 2)));
+            if (id == 0x0001) {
+                const auto field([&](std::uint64_t &value) {
+                    if ((value != 0xffffffff) || ((v + 8) > ve)) { return; }
+                    value = le<std::uint64_t>(v);
+                    v += 8;
+                });
+                field(entry.uncompressedSize);
+                field(entry.compressedSize);
+                field(entry.headerOffset);
+            }
+            x = ve;
+        }
+
+        // explicit directory records are not files
+        if (name.empty() || (name.back() != '/')) {
+            builder.add(name, entry);
+            ++files;
+        }
+        pos = next;
+    }
+
+    return builder.build();
+}
+
+FileRange ZipDirectory::data(const Entry &entry, const std::string &path)
+    const
+{
+    // data follow local header (its extra field may differ from central one)
+    unsigned char header[30];
+    readAt(header, sizeof(header), entry.headerOffset);
+    if (le<std::uint32_t>(header) != 0x04034b50) {
+        LOGTHROW(err2, NotAnArchive)
+            << "Invalid local header of " << path << " in " << path_ << ".";
+    }
+
+    const auto start(base_ + entry.headerOffset + sizeof(header)
+                     + le<std::uint16_t>(header + 26)
+                     + le<std::uint16_t>(header + 28));
+    return FileRange(fd_, path_, start, start + entry.compressedSize);
+}
+
+/** Pushes CRC-32 verifier of given entry, if any, to the stream.
+ */
+void verifier(bio::filtering_istream &fis, const fs::path &path
+              , const ZipDirectory::Entry *verify)
+{
+    if (!verify) { return; }
+    fis.push(Crc32Verifier(path, verify->crc32, verify->uncompressedSize));
+}
+
+/** Entry read via utility::zip::Reader, used for compression methods we do
+ *  not handle ourselves.
+ */
 class ZipIStream : public IStream {
 public:
+    /** Data are verified against given directory entry, if any.
+     */
     ZipIStream(const utility::zip::Reader &reader, std::size_t zipIndex
                , const IStream::FilterInit &filterInit
-               , const fs::path &index)
-        : IStream(filterInit), pf_(reader.plug(zipIndex, fis_))
+               , const fs::path &index
+               , const ZipDirectory::Entry *verify = nullptr)
+        : IStream(filterInit), pf_(plug(reader, zipIndex, verify))
         , index_(index)
     {
-        update(pf_.uncompressedSize, pf_.seekable);
+        update(pf_.uncompressedSize, pf_.seekable && !verify);
     }
 
     virtual fs::path path() const { return pf_.path; }
@@ -58,62 +343,206 @@ public:
     virtual void close() {}
 
 private:
+    utility::zip::PluggedFile plug(const utility::zip::Reader &reader
+                                   , std::size_t zipIndex
+                                   , const ZipDirectory::Entry *verify)
+    {
+        verifier(fis_, reader.files()[zipIndex].path, verify);
+        return reader.plug(zipIndex, fis_);
+    }
+
     utility::zip::PluggedFile pf_;
     const fs::path index_;
 };
 
-HintedPath
-findPrefix(const fs::path &path, const FileHint &hint
-           , const utility::zip::Reader::Record::list &files)
-{
-    if (!hint) { return {}; }
+/** Byte range of stored zip entry, read directly from the archive file.
+ */
+class ZipRangeIStream : public IStream {
+public:
+    typedef utility::io::SubStreamDevice::Filedes Filedes;
 
-    // sort paths by depth
-    struct Path {
-        const fs::path *path;
-        std::size_t depth;
+    /** Whole entry data are verified against given directory entry, if
+     *  any.
+     */
+    ZipRangeIStream(const fs::path &path, const FileRange &range
+                    , const ZipDirectory::pointer &directory
+                    , const IStream::FilterInit &filterInit
+                    , const fs::path &index
+                    , const ZipDirectory::Entry *verify = nullptr)
+        : IStream(filterInit, range.size()), path_(path), index_(index)
+        , range_(range), directory_(directory), verify_(verify)
+    {
+        verifier(fis_, path, verify);
+        fis_.push(utility::io::SubStreamDevice
+                  (path, Filedes(range.fd, range.start, range.end)));
+        if (verify_) { update(range.size(), false); }
+    }
 
-        Path(const utility::zip::Reader::Record &record)
-            : path(&record.path)
-            , depth(std::distance(path->begin(), path->end())) {}
-        bool operator<(const Path &o) const { return depth < o.depth; }
-    };
+    virtual fs::path path() const { return path_; }
+    virtual fs::path index() const { return index_; }
+    virtual void close() {}
 
-    std::vector<Path> paths;
-    paths.reserve(files.size());
-    for (const auto &file : files) { paths.emplace_back(file); }
-    std::sort(paths.begin(), paths.end());
+protected:
+    virtual boost::optional<FileRange> range() const {
+        // verified data must go through the stream
+        if (verify_) { return boost::none; }
+        return range_;
+    }
 
-    // match all files
-    FileHint::Matcher matcher(hint);
-    for (const auto &path : paths) {
-        if (matcher(*path.path)) {
-            return HintedPath(path.path->parent_path(), path.path->filename());
-        }
+private:
+    const fs::path path_;
+    const fs::path index_;
+    const FileRange range_;
+
+    /** Keeps archive file descriptor open.
+     */
+    ZipDirectory::pointer directory_;
+    const bool verify_;
+};
+
+/** Deflated zip entry, inflated on the fly directly from the archive file.
+ */
+class ZipInflateIStream : public IStream {
+public:
+    typedef utility::io::SubStreamDevice::Filedes Filedes;
+
+    ZipInflateIStream(const fs::path &path, const FileRange &range
+                      , std::size_t uncompressedSize
+                      , const ZipDirectory::pointer &directory
+                      , const IStream::FilterInit &filterInit
+                      , const fs::path &index
+                      , const ZipDirectory::Entry *verify = nullptr)
+        : IStream(filterInit, uncompressedSize, false)
+        , path_(path), index_(index), directory_(directory)
+    {
+        verifier(fis_, path, verify);
+        bio::zlib_params params;
+        params.noheader = true;
+        fis_.push(bio::zlib_decompressor(params));
+        fis_.push(utility::io::SubStreamDevice
+                  (path, Filedes(range.fd, range.start, range.end)));
     }
 
-    if (!matcher) {
-        LOGTHROW(err2, std::runtime_error)
-            << "No \"" << hint << "\" found in the zip archive at "
-            << path << ".";
+    virtual fs::path path() const { return path_; }
+    virtual fs::path index() const { return index_; }
+    virtual void close() {}
+
+private:
+    const fs::path path_;
+    const fs::path index_;
+
+    /** Keeps archive file descriptor open.
+     */
+    ZipDirectory::pointer directory_;
+};
+
+/** Opens stream of stored or deflated entry read directly from the archive
+ *  file. Returns null for other compression methods.
+ */
+IStream::pointer entryIStream(const ZipDirectory::pointer &directory
+                              , const ZipDirectory::Entry &entry
+                              , const fs::path &fullPath
+                              , const fs::path &path
+                              , const IStream::FilterInit &filterInit
+                              , bool verify)
+{
+    const auto *v(verify ? &entry : nullptr);
+    switch (entry.method) {
+    case 0:
+        return std::make_unique<ZipRangeIStream>
+            (fullPath, directory->data(entry, fullPath.string()), directory
+             , filterInit, path, v);
+
+    case 8:
+        return std::make_unique<ZipInflateIStream>
+            (fullPath, directory->data(entry, fullPath.string())
+             , entry.uncompressedSize, directory, filterInit, path, v);
     }
+    return {};
+}
 
-    return HintedPath(matcher.match().parent_path()
-                      , matcher.match().filename());
+/** Opens range of stored entry read directly from the archive file. Returns
+ *  null for compressed entries.
+ */
+IStream::pointer rangeIStream(const ZipDirectory::pointer &directory
+                              , const ZipDirectory::Entry &entry
+                              , const fs::path &fullPath
+                              , const fs::path &path
+                              , std::size_t offset, std::size_t length
+                              , const IStream::FilterInit &filterInit)
+{
+    if (entry.method) { return {}; }
+
+    auto range(directory->data(entry, fullPath.string()));
+    const auto r(clipRange(range.size(), offset, length));
+    range.end = range.start + r.second;
+    range.start += r.first;
+    return std::make_unique<ZipRangeIStream>
+        (fullPath, range, directory, filterInit, path);
+}
+
+static_assert(std::is_trivially_copyable<ZipDirectory::Entry>::value
+              && (sizeof(ZipDirectory::Entry) == 32)
+              , "Zip entry record must be plain data without padding.");
+
+/** Parses zip central directory, index is shared with other processes if
+ *  configured: workers mapping an index published by another process parse
+ *  nothing, they get complete entry records (offset, sizes, method, CRC).
+ */
+ZipDirectory::Entries loadEntries(const ZipDirectory &directory
+                                  , const fs::path &path
+                                  , const OpenOptions &openOptions)
+{
+    const SharedIndexKey key(openOptions.sharedIndexDir, "zip", path
+                             , openOptions.fileLimit);
+    return sharedPathMap<ZipDirectory::Entry>(key, [&]()
+    {
+        return directory.entries(openOptions.fileLimit);
+    });
 }
 
+/** Zip archive read through own central directory parser: stored entries
+ *  are accessed in place, deflated ones are inflated on the fly.
+ *
+ *  Archive is either a standalone file or stored verbatim inside parent
+ *  archive, read directly from parent's file.
+ */
 class Zip : public RoArchive::Detail {
 public:
     Zip(const boost::filesystem::path &path, const OpenOptions &openOptions)
-        : Detail(path), reader_(path, openOptions.fileLimit)
-        , prefix_(findPrefix(path, openOptions.hint, reader_.files()))
+        : Detail(path)
+        , directory_(std::make_shared<ZipDirectory>(path))
+        , files_(stats().buildIndex([&]() {
+                    return loadEntries(*directory_, path, openOptions);
+                }))
+        , prefix_(findPrefix(path, openOptions.hint, files_.index()
+                             , openOptions.observer, "zip archive"))
+        , base_(findBase())
+        , verify_(openOptions.verify)
+        , fileLimit_(openOptions.fileLimit), readerOpen_(false)
     {
-        for (const auto &file : reader_.files()) {
-            if (!utility::isPathPrefix(file.path, prefix_.path)) { continue; }
+        LOG(info1) << "Indexed " << files_.size() << " files in zip archive "
+                   << path_ << " (" << files_.memoryUsage() << " bytes).";
+        memory().chargeIndex(files_);
+    }
 
-            const auto path(utility::cutPathPrefix(file.path, prefix_.path));
-            index_.insert(map::value_type(path.string(), file));
-        }
+    /** Zip archive stored verbatim inside parent archive. Index is never
+     *  shared.
+     */
+    Zip(const RoArchive &parent, const boost::filesystem::path &path
+        , const FileRange &range, const OpenOptions &openOptions)
+        : Detail(parent.path() / path), parent_(parent)
+        , directory_(std::make_shared<ZipDirectory>(range))
+        , files_(stats().buildIndex([&]() {
+                    return directory_->entries(openOptions.fileLimit);
+                }))
+        , prefix_(findPrefix(path_, openOptions.hint, files_.index()
+                             , openOptions.observer, "nested zip archive"))
+        , base_(findBase())
+        , verify_(openOptions.verify)
+        , fileLimit_(openOptions.fileLimit), readerOpen_(false)
+    {
+        memory().chargeIndex(files_);
     }
 
     /** Get (wrapped) input stream for given file.
@@ -123,65 +552,188 @@ public:
                                      , const IStream::FilterInit &filterInit)
         const
     {
-        auto findex(index_.find(path.string()));
-        if (findex == index_.end()) {
-            LOGTHROW(err2, NoSuchFile)
-                << "File " << path << " not found in the zip archive at "
+        const auto id(find(path));
+        const auto &entry(files_.value(id));
+        const fs::path fullPath(files_.index().path(id));
+
+        if (auto is = entryIStream(directory_, entry, fullPath, path
+                                   , filterInit, verify_))
+        {
+            return is;
+        }
+
+        if (parent_) {
+            // generic reader cannot read from inside another archive
+            LOGTHROW(err2, NotImplemented)
+                << "Unsupported compression method " << entry.method
+                << " of file " << path << " in " << kind() << " at "
                 << path_ << ".";
         }
 
+        // other compression method, fall back to generic reader
+        const auto &reader(this->reader());
+        const auto &records(reader.files());
+        const auto irecord(std::find_if(records.begin(), records.end()
+                                        , [&](const Record &record)
+        {
+            return record.path == fullPath;
+        }));
+        if (irecord == records.end()) {
+            LOGTHROW(err2, NoSuchFile)
+                << "File " << path << " not found in the " << kind()
+                << " at " << path_ << ".";
+        }
+
         return std::make_unique<ZipIStream>
-            (reader_, findex->second.index, filterInit, path);
+            (reader, irecord->index, filterInit, path
+             , verify_ ? &entry : nullptr);
+    }
+
+    /** Range of file. Stored entries are accessed directly, compressed ones
+     *  are decompressed and skipped up to offset.
+     */
+    virtual IStream::pointer istream(const boost::filesystem::path &path
+                                     , std::size_t offset, std::size_t length
+                                     , const IStream::FilterInit &filterInit)
+        const
+    {
+        const auto id(find(path));
+        if (auto is = rangeIStream(directory_, files_.value(id)
+                                   , files_.index().path(id), path
+                                   , offset, length, filterInit))
+        {
+            return is;
+        }
+
+        // compressed
+        return Detail::istream(path, offset, length, filterInit);
     }
 
     virtual bool exists(const boost::filesystem::path &path) const {
-        return (index_.find(path.string()) != index_.end());
+        return files_.find(path.string(), base_);
     }
 
     virtual Files list() const {
-        Files list;
-        for (const auto &pair : index_) {
-            list.push_back(pair.first);
-        }
-        return list;
+        return files_.index().list(base_, base_);
+    }
+
+    virtual Files list(const boost::filesystem::path &prefix) const {
+        const auto dir(files_.index().findDir(prefix.string(), base_));
+        if (dir == PathIndex::none) { return {}; }
+        return files_.index().list(dir, base_);
+    }
+
+    virtual void forEach(const Entry::Callback &callback) const {
+        const auto &index(files_.index());
+        Entry entry;
+        index.forEach(base_, [&](PathIndex::Id id)
+        {
+            entry.path = index.path(id, base_);
+            entry.size = files_.value(id).uncompressedSize;
+            callback(entry);
+        });
+    }
+
+    virtual Listing listDir(const boost::filesystem::path &path) const {
+        const auto dir(files_.index().findDir(path.string(), base_));
+        if (dir == PathIndex::none) { return {}; }
+        return files_.index().listDir(dir);
     }
 
     virtual boost::optional<fs::path> findFile(const std::string &filename)
         const
     {
-        for (const auto &pair : index_) {
-            if (pair.second.path.filename() == filename) {
-                return fs::path(pair.first);
-            }
-        }
-        return boost::none;
+        return files_.index().findFile(filename, base_);
     }
 
     virtual void applyHint(const FileHint &hint) {
         if (!hint) { return; }
 
         // regenerate
-        prefix_ = findPrefix(path_, hint, reader_.files());
-        index_.clear();
-
-        for (const auto &file : reader_.files()) {
-            if (!utility::isPathPrefix(file.path, prefix_.path)) { continue; }
-
-            const auto path(utility::cutPathPrefix(file.path, prefix_.path));
-            index_.insert(map::value_type(path.string(), file));
-        }
+        prefix_ = findPrefix(path_, hint, files_.index(), observer_, kind());
+        base_ = findBase();
     }
 
     virtual const boost::optional<boost::filesystem::path>& usedHint() {
         return prefix_.usedHint;
     }
 
+    /** Nested archive changes with its parent.
+     */
+    virtual bool changed() const {
+        return parent_ ? parent_->changed() : Detail::changed();
+    }
+
 private:
-    utility::zip::Reader reader_;
+    typedef utility::zip::Reader::Record Record;
+
+    const char* kind() const {
+        return parent_ ? "nested zip archive" : "zip archive";
+    }
+
+    PathIndex::Id find(const boost::filesystem::path &path) const {
+        const auto id(files_.index().find(path.string(), base_));
+        if (id == PathIndex::none) {
+            LOGTHROW(err2, NoSuchFile)
+                << "File " << path << " not found in the " << kind()
+                << " at " << path_ << ".";
+        }
+        return id;
+    }
+
+    PathIndex::Id findBase() const {
+        const auto base(files_.index().findDir(prefix_.path.string()));
+        return (base == PathIndex::none) ? PathIndex::root : base;
+    }
+
+    /** Generic zip reader, opened on first use. Needed only for entries
+     *  compressed by methods other than store and deflate.
+     */
+    const utility::zip::Reader& reader() const {
+        if (!readerOpen_.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(readerMutex_);
+            if (!reader_) {
+                reader_ = std::make_unique<utility::zip::Reader>
+                    (path_, fileLimit_);
+
+                // reader keeps its own list of records on the heap
+                const auto &records(reader_->files());
+                std::size_t size(records.capacity() * sizeof(Record));
+                for (const auto &record : records) {
+                    size += record.path.native().capacity();
+                }
+                readerCharge_ = MemoryCharge(memoryPointer()
+                                             , MemoryCategory::index, size);
+                readerOpen_.store(true, std::memory_order_release);
+            }
+        }
+        return *reader_;
+    }
+
+    /** Parent of nested archive, keeps file open.
+     */
+    boost::optional<RoArchive> parent_;
+
+    ZipDirectory::pointer directory_;
+
+    /** All files in the archive, full paths.
+     */
+    ZipDirectory::Entries files_;
     HintedPath prefix_;
 
-    typedef std::map<std::string, utility::zip::Reader::Record> map;
-    map index_;
+    /** Prefix directory in the index.
+     */
+    PathIndex::Id base_;
+
+    /** Verify CRC-32 of whole entries.
+     */
+    bool verify_;
+
+    const std::size_t fileLimit_;
+    mutable std::mutex readerMutex_;
+    mutable std::unique_ptr<utility::zip::Reader> reader_;
+    mutable MemoryCharge readerCharge_;
+    mutable std::atomic<bool> readerOpen_;
 };
 
 } // namespace
@@ -189,7 +741,17 @@ private:
 RoArchive::dpointer RoArchive::zip(const boost::filesystem::path &path
                                    , const OpenOptions &openOptions)
 {
-    return std::make_shared<Zip>(path, openOptions);
+    TraceSpan span(openOptions.observer, Observer::Event::indexBuild, path);
+    return span(std::make_shared<Zip>(path, openOptions));
+}
+
+RoArchive::dpointer RoArchive::zip(const RoArchive &parent
+                                   , const boost::filesystem::path &path
+                                   , const FileRange &range
+                                   , const OpenOptions &openOptions)
+{
+    TraceSpan span(openOptions.observer, Observer::Event::indexBuild, path);
+    return span(std::make_shared<Zip>(parent, path, range, openOptions));
 }
 
 } // namespace roarchive